@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2004,2005 Kelly Yancey
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * $kbyanc$
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include "dyntrace.h"
+
+/*!
+ * @file
+ *
+ * Arena allocation.
+ *
+ * Objects which live as long as some larger structure (the opcode tree, or
+ * a traced process's region list) are carved out of large chunks rather
+ * than allocated individually.  This saves the allocator's per-object
+ * overhead and lets everything in the arena be released at once.  Objects
+ * cannot be freed individually; callers recycle them if they need to.
+ */
+
+
+/*
+ * Size of the chunks allocated to an arena, including the chunk header.
+ * Chunks this large are mapped directly from the kernel by the allocator,
+ * so they arrive zeroed and the parts never used cost no memory.
+ */
+#define	ARENA_CHUNK_SIZE	(1024 * 1024)
+
+/* Alignment of objects allocated from an arena. */
+#define	ARENA_ALIGN		16
+
+
+struct arena_chunk {
+	struct arena_chunk *next;	/* Previously filled chunk. */
+	size_t		 size;		/* Bytes allocated, with header. */
+	size_t		 used;		/* Bytes used, with header. */
+};
+
+struct arena {
+	struct arena_chunk *chunks;	/* Most recently allocated first. */
+	size_t		 total;		/* Bytes allocated to chunks. */
+};
+
+
+static struct arena_chunk *
+		 arena_chunk_new(arena_t arena, size_t size);
+
+
+/*!
+ * arena_new() - Create a new, empty arena.
+ *
+ *	@return	the new arena.  Memory is only allocated to it as objects
+ *		are allocated from it.
+ */
+arena_t
+arena_new(void)
+{
+	arena_t arena;
+
+	arena = calloc(1, sizeof(*arena));
+	if (arena == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+	return arena;
+}
+
+
+/*!
+ * arena_done() - Free an arena and every object allocated from it.
+ *
+ *	@param	arenap	Pointer to the arena to free.
+ *
+ *	@post	The arena handle pointed to by *arenap is invalidated.
+ */
+void
+arena_done(arena_t *arenap)
+{
+	arena_t arena = *arenap;
+	struct arena_chunk *chunk;
+
+	*arenap = NULL;
+
+	while ((chunk = arena->chunks) != NULL) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+
+/*!
+ * arena_alloc() - Allocate zeroed memory from an arena.
+ *
+ *	@param	arena	The arena to allocate from.
+ *
+ *	@param	size	Number of bytes to allocate.
+ *
+ *	@return	pointer to the memory, aligned for any object.  Allocation
+ *		failures are fatal.
+ *
+ *	Requests too large to share a chunk get a chunk to themselves, which
+ *	is placed behind the current chunk so its free space is not lost.
+ */
+void *
+arena_alloc(arena_t arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	size_t hdrsize;
+	void *p;
+
+	hdrsize = (sizeof(*chunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	chunk = arena->chunks;
+	if (hdrsize + size > ARENA_CHUNK_SIZE / 4) {
+		chunk = arena_chunk_new(arena, hdrsize + size);
+		if (chunk->next != NULL) {
+			/* Keep allocating from the partially used chunk. */
+			arena->chunks = chunk->next;
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		}
+	}
+	else if (chunk == NULL || chunk->used + size > chunk->size)
+		chunk = arena_chunk_new(arena, ARENA_CHUNK_SIZE);
+
+	p = (uint8_t *)chunk + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+
+/*!
+ * arena_strdup() - Copy a string into an arena.
+ *
+ *	@param	arena	The arena to allocate from.
+ *
+ *	@param	str	The string to copy.
+ *
+ *	@return	pointer to the copy.
+ */
+char *
+arena_strdup(arena_t arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+
+	return memcpy(arena_alloc(arena, len), str, len);
+}
+
+
+/*!
+ * arena_size() - Get the amount of memory allocated to an arena.
+ *
+ *	@param	arena	The arena to report on.
+ *
+ *	@return	the number of bytes allocated to the arena's chunks.
+ */
+size_t
+arena_size(arena_t arena)
+{
+
+	return arena->total;
+}
+
+
+/*!
+ * arena_chunk_new() - Internal routine to add a chunk to an arena.
+ *
+ *	@param	arena	The arena to add the chunk to.
+ *
+ *	@param	size	Size of the chunk in bytes, including its header.
+ *
+ *	@return	the new chunk, which is first in the arena's chunk list.
+ */
+struct arena_chunk *
+arena_chunk_new(arena_t arena, size_t size)
+{
+	struct arena_chunk *chunk;
+
+	chunk = calloc(1, size);
+	if (chunk == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+
+	chunk->size = size;
+	chunk->used = (sizeof(*chunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->total += size;
+
+	return chunk;
+}
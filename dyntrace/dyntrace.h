@@ -42,6 +42,7 @@
 
 
 typedef	struct target_state *target_t;
+typedef	struct arena *arena_t;
 
 
 typedef enum {
@@ -57,15 +58,42 @@ typedef enum {
 #define	NUMREGIONTYPES		  7
 #define	REGION_IS_TEXT(rt)	((rt) < REGION_NONTEXT_UNKNOWN)
 
+/*
+ * Instruction set architectures the tracer can decode.  A traced process
+ * may switch between them (e.g. a 32-bit process running in compatibility
+ * mode on an amd64 host) so the ISA is determined for each instruction.
+ */
+typedef enum {
+	ISA_X86			= 0,	/* IA-32, including amd64 compat mode */
+	ISA_AMD64		= 1	/* amd64 64-bit mode */
+} isa_t;
+
+#define	NUMISAS			  2
+
+extern const char *isa_name[NUMISAS];
+
+
 typedef struct region_info *region_t;
 typedef struct region_list *region_list_t;
 
+
+/* Execution counts for a single instruction address; see hotspot.c. */
+struct hotspot {
+	vm_offset_t	 pc;
+	uint64_t	 n;
+	uint64_t	 cycles;
+	uint64_t	 error;		/* Most n may overstate the count by. */
+	uint32_t	 id;		/* Counter of the last opcode run. */
+};
+
 extern const char *region_type_name[NUMREGIONTYPES];
 
 
 extern bool	 opt_debug;
 extern bool	 opt_printzero;
+extern bool	 opt_objects;
 extern char	*opt_outfile;
+extern char	*opt_hotspotfile;
 
 #define debug(fmt, ...) do {			\
 	if (opt_debug) warn(fmt, __VA_ARGS__);	\
@@ -82,27 +110,80 @@ extern void	 fatal(int eval, const char *fmt, ...)
 extern void	 setsighandler(int sig, void (*handler)(int));
 
 
+extern arena_t	 arena_new(void);
+extern void	 arena_done(arena_t *arenap);
+extern void	*arena_alloc(arena_t arena, size_t size);
+extern char	*arena_strdup(arena_t arena, const char *str);
+extern size_t	 arena_size(arena_t arena);
+
+
 extern region_list_t
 		 region_list_new(void);
 extern void	 region_list_done(region_list_t *rlistp);
 
 extern region_t	 region_lookup(region_list_t rlist, vm_offset_t addr);
-extern void	 region_update(region_list_t rlist,
+extern region_t	 region_next(region_list_t rlist, vm_offset_t addr);
+extern region_t	 region_update(region_list_t rlist,
 			       vm_offset_t start, vm_offset_t end,
 			       region_type_t type, bool readonly);
+extern region_t	 region_replace(region_list_t rlist,
+				vm_offset_t start, vm_offset_t end,
+				region_type_t type, bool readonly);
+extern bool	 region_map(target_t targ, region_t region, int fd,
+			    off_t offset);
+extern bool	 region_can_map(region_t region);
+extern void	 region_clear(region_list_t rlist,
+			      vm_offset_t start, vm_offset_t end);
 extern size_t	 region_read(target_t targ, region_t region,
 			     vm_offset_t offset, void *dest, size_t len);
 extern region_type_t
 		 region_get_type(region_t region);
 extern size_t	 region_get_range(region_t region,
 				  vm_offset_t *startp, vm_offset_t *endp);
+extern void	 region_cache_set_size(size_t mb);
+extern void	 region_cache_report(void);
+extern uint	 region_get_object(region_t region);
+extern void	 region_set_object(region_t region, uint object);
+extern bool	 region_object_rule(const char *rule);
+extern uint	 region_object(const char *name);
+extern const char *
+		 region_object_name(uint object);
+extern uint	 region_object_count(void);
+extern uint32_t	 region_decode_lookup(region_t region, vm_offset_t pc,
+				      isa_t isa);
+extern bool	 region_decode_store(region_t region, vm_offset_t pc,
+				     isa_t isa, uint32_t id);
+
+
+extern void	 hotspot_set_size(size_t mb);
+extern bool	 hotspot_enabled(void);
+extern void	 hotspot_add(vm_offset_t pc, uint32_t id, uint cycles);
+extern uint	 hotspot_sort(void);
+extern const struct hotspot *
+		 hotspot_get(uint rank);
+extern uint64_t	 hotspot_evicted(void);
 
 
 extern void	 optree_parsefile(const char *filepath);
-extern void	 optree_update(target_t targ, region_t region,
+extern void	 optree_load_builtin(void);
+extern bool	 optree_isa_loaded(isa_t isa);
+extern void	 optree_compile(void);
+extern bool	 optree_set_decoder(const char *name);
+extern bool	 optree_set_checker(const char *name);
+extern void	 optree_benchmark_sample(void);
+extern void	 optree_benchmark(void);
+extern void	 optree_corpus_save(const char *filepath);
+extern void	 optree_corpus_load(const char *filepath);
+extern void	 optree_verify_lengths(void);
+extern bool	 optree_set_histogram_bits(uint bits);
+extern void	 optree_set_ngrams(uint top);
+extern void	 optree_verify_report(void);
+extern void	 optree_cache_report(void);
+extern bool	 optree_update(target_t targ, region_t region, isa_t isa,
 			       vm_offset_t pc, uint cycles);
 extern void	 optree_output_open(void);
 extern void	 optree_output(void);
+extern void	 optree_output_file(const char *filepath);
 
 
 extern void	 target_init(void);
@@ -114,11 +195,13 @@ extern void	 target_detach(target_t *targp);
 
 extern target_t	 target_wait(void);
 extern void	 target_step(target_t targ);
+extern void	 target_syscall(target_t targ);
 
 extern size_t	 target_read(target_t targ, vm_offset_t addr,
 			     void *dest, size_t len);
 
 extern vm_offset_t target_get_pc(target_t targ);
+extern isa_t	 target_get_isa(target_t targ);
 extern uint	 target_get_cycles(target_t targ);
 extern const char *target_get_name(target_t targ);
 extern region_t	 target_get_region(target_t targ, vm_offset_t offset);
@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2004,2005 Kelly Yancey
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * $kbyanc$
+ */
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include "dyntrace.h"
+
+/*!
+ * @file
+ *
+ * Per-address execution profile.
+ *
+ * The number of times each instruction address is executed, and the cycles
+ * spent there, are kept in a table found by linear probing of an
+ * open-addressed hash on the address.  The table's memory is capped (see
+ * hotspot_set_size()); once it holds as many addresses as fit, it becomes a
+ * Space-Saving heavy hitters summary: an address not in the table replaces
+ * the one with the lowest count, inheriting that count as its error.  The
+ * counts of addresses executed more often than a 1/size fraction of all
+ * instructions are then still reported, overestimated by at most their
+ * error, while rarely executed addresses churn through the remaining
+ * entries.  The entry with the lowest count is found with a heap which is
+ * only built once the table is full.
+ */
+
+
+/* Initial number of addresses allocated. */
+#define	HOTSPOT_MINSIZE		4096
+
+/*
+ * Upper bound on the memory used for each address: the entry itself, its
+ * heap index and position, and the hash table which is kept between a
+ * quarter and half full.
+ */
+#define	HOTSPOT_ENTRY_SIZE	(sizeof(struct hotspot) + 6 * sizeof(uint32_t))
+
+
+static struct hotspot *hotspots = NULL;
+static uint32_t	 nhotspots = 0;
+static uint32_t	 maxhotspots = 0;	/* Allocated. */
+static uint32_t	 hotspot_limit = 0;	/* Cap on maxhotspots. */
+static uint32_t	*hotspot_hash = NULL;	/* Index + 1 into hotspots[]. */
+static uint32_t	 hotspot_hash_size = 0;	/* Power of two. */
+static uint32_t	*hotspot_heap = NULL;	/* Indexes, lowest count first. */
+static uint32_t	*hotspot_pos = NULL;	/* Position of each in the heap. */
+static uint32_t	*hotspot_order = NULL;	/* Sorted by hotspot_sort(). */
+static uint64_t	 hotspot_evictions = 0;
+
+
+static uint32_t	 hotspot_hashval(vm_offset_t pc);
+static void	 hotspot_insert(uint32_t idx);
+static void	 hotspot_remove(vm_offset_t pc);
+static void	 hotspot_grow(void);
+static void	 hotspot_heap_build(void);
+static void	 hotspot_heap_down(uint32_t pos);
+static int	 hotspot_compare(const void *a, const void *b);
+
+
+/*!
+ * hotspot_set_size() - Enable the per-address execution profile.
+ *
+ *	@param	mb	Most memory to use, in megabytes; zero disables the
+ *			profile.
+ *
+ *	Must be called before tracing starts.
+ */
+void
+hotspot_set_size(size_t mb)
+{
+	size_t limit;
+
+	assert(nhotspots == 0);
+
+	limit = mb * 1024 * 1024 / HOTSPOT_ENTRY_SIZE;
+	hotspot_limit = (limit > UINT32_MAX / 4) ? UINT32_MAX / 4 : limit;
+}
+
+
+/*!
+ * hotspot_enabled() - Determine whether the per-address execution profile
+ *		       is being kept.
+ */
+bool
+hotspot_enabled(void)
+{
+
+	return hotspot_limit != 0;
+}
+
+
+/*!
+ * hotspot_add() - Count the execution of the instruction at an address.
+ *
+ *	@param	pc	Address of the instruction.
+ *
+ *	@param	id	Non-zero identifier of the instruction's counter.
+ *
+ *	@param	cycles	Cycles spent executing the instruction.
+ */
+void
+hotspot_add(vm_offset_t pc, uint32_t id, uint cycles)
+{
+	struct hotspot *h;
+	uint32_t i, idx;
+
+	if (hotspot_limit == 0)
+		return;
+
+	if (hotspot_hash_size != 0) {
+		i = hotspot_hashval(pc);
+		for (;;) {
+			i &= hotspot_hash_size - 1;
+			idx = hotspot_hash[i];
+			if (idx == 0)
+				break;
+			h = &hotspots[idx - 1];
+			if (h->pc == pc) {
+				h->n++;
+				h->cycles += cycles;
+				h->id = id;
+				if (hotspot_heap != NULL)
+					hotspot_heap_down(hotspot_pos[idx - 1]);
+				return;
+			}
+			i++;
+		}
+	}
+
+	if (nhotspots < hotspot_limit) {
+		if (nhotspots == maxhotspots)
+			hotspot_grow();
+		h = &hotspots[nhotspots];
+		memset(h, 0, sizeof(*h));
+		h->pc = pc;
+		h->n = 1;
+		h->cycles = cycles;
+		h->id = id;
+		hotspot_insert(nhotspots++);
+		return;
+	}
+
+	/*
+	 * The table is full; the address replaces the one with the lowest
+	 * count.  Its true count is somewhere between one and the count
+	 * it is given.  The cycles spent in it before now are unknown.
+	 */
+	if (hotspot_heap == NULL)
+		hotspot_heap_build();
+
+	idx = hotspot_heap[0];
+	h = &hotspots[idx];
+	hotspot_remove(h->pc);
+	hotspot_evictions++;
+
+	h->pc = pc;
+	h->error = h->n;
+	h->n++;
+	h->cycles = cycles;
+	h->id = id;
+	hotspot_insert(idx);
+	hotspot_heap_down(0);
+}
+
+
+/*!
+ * hotspot_hashval() - Internal routine to hash an instruction address.
+ */
+uint32_t
+hotspot_hashval(vm_offset_t pc)
+{
+
+	return ((uint64_t)pc * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+
+/*!
+ * hotspot_insert() - Internal routine to add an entry to the hash table.
+ *
+ *	@param	idx	Index of the entry in hotspots[].
+ */
+void
+hotspot_insert(uint32_t idx)
+{
+	uint32_t i;
+
+	i = hotspot_hashval(hotspots[idx].pc);
+	for (;;) {
+		i &= hotspot_hash_size - 1;
+		if (hotspot_hash[i] == 0)
+			break;
+		i++;
+	}
+	hotspot_hash[i] = idx + 1;
+}
+
+
+/*!
+ * hotspot_remove() - Internal routine to remove an address from the hash
+ *		      table.
+ *
+ *	@param	pc	The address, which must be in the table.
+ *
+ *	Entries after the removed one in its probe sequence are moved back
+ *	to fill the gap so that lookups never need to skip deleted slots.
+ */
+void
+hotspot_remove(vm_offset_t pc)
+{
+	uint32_t mask = hotspot_hash_size - 1;
+	uint32_t i, j, home;
+
+	i = hotspot_hashval(pc) & mask;
+	while (hotspots[hotspot_hash[i] - 1].pc != pc)
+		i = (i + 1) & mask;
+
+	j = i;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (hotspot_hash[j] == 0)
+			break;
+
+		/*
+		 * The entry at j can fill the gap at i unless its home slot
+		 * lies cyclically between the two.
+		 */
+		home = hotspot_hashval(hotspots[hotspot_hash[j] - 1].pc) &
+		       mask;
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue;
+
+		hotspot_hash[i] = hotspot_hash[j];
+		i = j;
+	}
+	hotspot_hash[i] = 0;
+}
+
+
+/*!
+ * hotspot_grow() - Internal routine to double the number of entries
+ *		    allocated, up to the limit, and resize the hash table to
+ *		    match.
+ */
+void
+hotspot_grow(void)
+{
+	uint32_t idx;
+
+	maxhotspots = (maxhotspots == 0) ? HOTSPOT_MINSIZE : maxhotspots * 2;
+	if (maxhotspots > hotspot_limit)
+		maxhotspots = hotspot_limit;
+
+	hotspots = realloc(hotspots, maxhotspots * sizeof(*hotspots));
+	if (hotspots == NULL)
+		fatal(EX_OSERR, "realloc: %m");
+
+	if (maxhotspots * 2 <= hotspot_hash_size)
+		return;
+
+	hotspot_hash_size = (hotspot_hash_size == 0) ? HOTSPOT_MINSIZE * 2 :
+			    hotspot_hash_size;
+	while (hotspot_hash_size < maxhotspots * 2)
+		hotspot_hash_size *= 2;
+
+	free(hotspot_hash);
+	hotspot_hash = calloc(hotspot_hash_size, sizeof(*hotspot_hash));
+	if (hotspot_hash == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+
+	for (idx = 0; idx < nhotspots; idx++)
+		hotspot_insert(idx);
+}
+
+
+/*!
+ * hotspot_heap_build() - Internal routine to build the heap of entries
+ *			  by count once the table is full.
+ */
+void
+hotspot_heap_build(void)
+{
+	uint32_t pos;
+
+	hotspot_heap = malloc(nhotspots * sizeof(*hotspot_heap));
+	hotspot_pos = malloc(nhotspots * sizeof(*hotspot_pos));
+	if (hotspot_heap == NULL || hotspot_pos == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+
+	for (pos = 0; pos < nhotspots; pos++) {
+		hotspot_heap[pos] = pos;
+		hotspot_pos[pos] = pos;
+	}
+	for (pos = nhotspots / 2; pos-- > 0;)
+		hotspot_heap_down(pos);
+
+	debug("hotspot table full at %u addresses; keeping the most "
+	      "frequently executed", nhotspots);
+}
+
+
+/*!
+ * hotspot_heap_down() - Internal routine to restore the heap order after
+ *			 the count of an entry has grown.
+ *
+ *	@param	pos	Position in the heap of the entry.
+ */
+void
+hotspot_heap_down(uint32_t pos)
+{
+	uint32_t idx = hotspot_heap[pos];
+	uint64_t n = hotspots[idx].n;
+	uint32_t child;
+
+	for (;;) {
+		child = pos * 2 + 1;
+		if (child >= nhotspots)
+			break;
+		if (child + 1 < nhotspots &&
+		    hotspots[hotspot_heap[child + 1]].n <
+		    hotspots[hotspot_heap[child]].n)
+			child++;
+		if (hotspots[hotspot_heap[child]].n >= n)
+			break;
+
+		hotspot_heap[pos] = hotspot_heap[child];
+		hotspot_pos[hotspot_heap[pos]] = pos;
+		pos = child;
+	}
+	hotspot_heap[pos] = idx;
+	hotspot_pos[idx] = pos;
+}
+
+
+/*!
+ * hotspot_sort() - Sort the addresses executed by their counts.
+ *
+ *	@return	the number of addresses, which may be retrieved in order of
+ *		decreasing count with hotspot_get().
+ */
+uint
+hotspot_sort(void)
+{
+	uint32_t i;
+
+	free(hotspot_order);
+	hotspot_order = malloc((nhotspots + 1) * sizeof(*hotspot_order));
+	if (hotspot_order == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+
+	for (i = 0; i < nhotspots; i++)
+		hotspot_order[i] = i;
+	qsort(hotspot_order, nhotspots, sizeof(*hotspot_order),
+	      hotspot_compare);
+
+	return nhotspots;
+}
+
+
+int
+hotspot_compare(const void *a, const void *b)
+{
+	const struct hotspot *ha = &hotspots[*(const uint32_t *)a];
+	const struct hotspot *hb = &hotspots[*(const uint32_t *)b];
+
+	if (ha->n != hb->n)
+		return (ha->n > hb->n) ? -1 : 1;
+	return (ha->pc < hb->pc) ? -1 : (ha->pc > hb->pc);
+}
+
+
+/*!
+ * hotspot_get() - Get an address's execution counts.
+ *
+ *	@param	rank	Position of the address in the order set by the last
+ *			call to hotspot_sort().
+ *
+ *	@return	the address's counts.
+ */
+const struct hotspot *
+hotspot_get(uint rank)
+{
+
+	assert(rank < nhotspots);
+	return &hotspots[hotspot_order[rank]];
+}
+
+
+/*!
+ * hotspot_evicted() - Get the number of addresses dropped from the
+ *		       per-address profile to make room for others.
+ *
+ *	@return	zero if the counts of every address executed are exact.
+ */
+uint64_t
+hotspot_evicted(void)
+{
+
+	return hotspot_evictions;
+}
@@ -30,8 +30,11 @@
 #include <sys/time.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <sysexits.h>
@@ -41,11 +44,36 @@
 #include "dyntrace.h"
 
 #define	DEFAULT_CHECKPOINT	(15 * 60)	/* 15 minutes */
-#define	DEFAULT_OPFILE		"/usr/local/share/dyntrace/oplist-x86.xml"
+#define	DEFAULT_HOTSPOTS_MB	16
+#define	DEFAULT_OPFILE_AMD64	"/usr/local/share/dyntrace/oplist-amd64.xml"
+
+/*
+ * Values returned by getopt_long(3) for options which only have a long
+ * form.  These must not collide with any single-character option.
+ */
+enum {
+	OPT_BENCHMARK		= CHAR_MAX + 1,
+	OPT_CACHE_MB,
+	OPT_CHECKPOINT_INSNS,
+	OPT_CORPUS,
+	OPT_DECODER,
+	OPT_GROUP,
+	OPT_HISTOGRAM_BITS,
+	OPT_HOTSPOTS,
+	OPT_HOTSPOTS_FILE,
+	OPT_MAX_INSNS,
+	OPT_NGRAMS,
+	OPT_OBJECTS,
+	OPT_VERIFY_DECODER,
+	OPT_VERIFY_LENGTHS
+};
 
 
 static void	 usage(const char *msg);
+static uint64_t	 parse_count(const char *optname, const char *arg);
 static void	 trace(target_t targ);
+static void	 insn_event(void);
+static void	 insn_event_schedule(void);
 static void	 time_record(const char *msg, struct timeval *tvp);
 static void	 epilogue(void);
 static uint	 rounddiv(uint64_t a, uint64_t b);
@@ -55,15 +83,22 @@ static void	 sig_checkpoint(int sig);
 
 static struct timeval starttime, stoptime;
 static uint64_t	 instructions	= 0;
+static uint64_t	 insn_next_event = UINT64_MAX;
+static uint64_t	 insn_next_checkpoint = 0;
 
 static volatile sig_atomic_t terminate	= false;
 static volatile sig_atomic_t checkpoint	= false;
 
        bool	 opt_debug	= false;
        bool	 opt_printzero	= false;
+       bool	 opt_objects	= false;
        int	 opt_checkpoint	= -1;
+static uint64_t	 opt_checkpoint_insns = 0;
+static uint64_t	 opt_max_insns	= 0;
 static pid_t	 opt_pid	= -1;
+static char	*opt_corpus	= NULL;
        char	*opt_outfile	= NULL;
+       char	*opt_hotspotfile = NULL;
        char	*opt_command	= NULL;
 
 
@@ -78,25 +113,94 @@ usage(const char *msg)
 	progname = getprogname();
 
 	fatal(EX_USAGE,
-"usage: %s [-vz] [-c seconds] [-f opcodefile] [-o outputfile] command\n"
-"       %s [-vz] [-c seconds] [-f opcodefile] [-o outputfile] -p pid\n",
-		progname, progname
+"usage: %s [-vz] [-c seconds] [-f opcodefile] [-o outputfile]\n"
+"           [--benchmark] [--cache-mb size] [--checkpoint-insns count]\n"
+"           [--corpus file] [--decoder name] [--group name=pattern]\n"
+"           [--histogram-bits bits] [--hotspots size] [--hotspots-file file]\n"
+"           [--max-insns count] [--ngrams count] [--objects]\n"
+"           [--verify-decoder name] [--verify-lengths] command\n"
+"       %s [-vz] [-c seconds] [-f opcodefile] [-o outputfile]\n"
+"           [--benchmark] [--cache-mb size] [--checkpoint-insns count]\n"
+"           [--corpus file] [--decoder name] [--group name=pattern]\n"
+"           [--histogram-bits bits] [--hotspots size] [--hotspots-file file]\n"
+"           [--max-insns count] [--ngrams count] [--objects]\n"
+"           [--verify-decoder name] [--verify-lengths] -p pid\n"
+"       %s [-v] [-f opcodefile] [--corpus file] --benchmark\n",
+		progname, progname, progname
 	);
 }
 
 
+/*!
+ * parse_count() - Parse an instruction count specified on the command line.
+ *
+ *	@param	optname	Name of the option the count was given for; used
+ *			for error reporting only.
+ *
+ *	@param	arg	The option argument to parse.
+ *
+ *	@return	the instruction count.  Invalid counts are fatal.
+ */
+uint64_t
+parse_count(const char *optname, const char *arg)
+{
+	unsigned long long count;
+	char *end;
+
+	errno = 0;
+	count = strtoull(arg, &end, 0);
+	if (errno != 0 || *arg == '\0' || *arg == '-' || *end != '\0')
+		fatal(EX_USAGE, "invalid count for %s: \"%s\"", optname, arg);
+
+	return count;
+}
+
+
 int
 main(int argc, char *argv[])
 {
+	static const struct option longopts[] = {
+		{ "benchmark",		no_argument,	   NULL,
+					OPT_BENCHMARK },
+		{ "cache-mb",		required_argument, NULL,
+					OPT_CACHE_MB },
+		{ "checkpoint-insns",	required_argument, NULL,
+					OPT_CHECKPOINT_INSNS },
+		{ "corpus",		required_argument, NULL,
+					OPT_CORPUS },
+		{ "decoder",		required_argument, NULL,
+					OPT_DECODER },
+		{ "group",		required_argument, NULL,
+					OPT_GROUP },
+		{ "histogram-bits",	required_argument, NULL,
+					OPT_HISTOGRAM_BITS },
+		{ "hotspots",		required_argument, NULL,
+					OPT_HOTSPOTS },
+		{ "hotspots-file",	required_argument, NULL,
+					OPT_HOTSPOTS_FILE },
+		{ "max-insns",		required_argument, NULL,
+					OPT_MAX_INSNS },
+		{ "ngrams",		required_argument, NULL,
+					OPT_NGRAMS },
+		{ "objects",		no_argument,	   NULL,
+					OPT_OBJECTS },
+		{ "verify-decoder",	required_argument, NULL,
+					OPT_VERIFY_DECODER },
+		{ "verify-lengths",	no_argument,	   NULL,
+					OPT_VERIFY_LENGTHS },
+		{ NULL,			0,		   NULL, 0 }
+	};
 	bool opsloaded = false;
+	bool benchmark = false;
 	target_t targ;
 	int ch;
 
 	if (argc == 1)
 		usage(NULL);
 
-	while ((ch = getopt(argc, argv, "c:f:o:p:vz")) != -1) {
-		switch ((char)ch) {
+	while ((ch = getopt_long(argc, argv, "c:f:o:p:vz",
+				 longopts, NULL)) != -1) {
+		switch (ch) {
 		case 'c':
 			opt_checkpoint = atoi(optarg);
 			if (opt_checkpoint < 0) {
@@ -135,6 +239,70 @@ main(int argc, char *argv[])
 			opt_printzero = true;
 			break;
 
+		case OPT_BENCHMARK:
+			benchmark = true;
+			break;
+
+		case OPT_CACHE_MB:
+			region_cache_set_size(parse_count("--cache-mb",
+							  optarg));
+			break;
+
+		case OPT_CHECKPOINT_INSNS:
+			opt_checkpoint_insns = parse_count("--checkpoint-insns",
+							   optarg);
+			break;
+
+		case OPT_CORPUS:
+			opt_corpus = optarg;
+			break;
+
+		case OPT_DECODER:
+			if (!optree_set_decoder(optarg))
+				usage("unknown decoder");
+			break;
+
+		case OPT_GROUP:
+			if (!region_object_rule(optarg))
+				usage("expected --group name=pattern");
+			opt_objects = true;
+			break;
+
+		case OPT_HISTOGRAM_BITS:
+			if (!optree_set_histogram_bits(
+			    parse_count("--histogram-bits", optarg)))
+				usage("--histogram-bits must be at most 7");
+			break;
+
+		case OPT_HOTSPOTS:
+			hotspot_set_size(parse_count("--hotspots", optarg));
+			break;
+
+		case OPT_HOTSPOTS_FILE:
+			opt_hotspotfile = optarg;
+			break;
+
+		case OPT_MAX_INSNS:
+			opt_max_insns = parse_count("--max-insns", optarg);
+			break;
+
+		case OPT_NGRAMS:
+			optree_set_ngrams(parse_count("--ngrams", optarg));
+			break;
+
+		case OPT_OBJECTS:
+			opt_objects = true;
+			break;
+
+		case OPT_VERIFY_DECODER:
+			if (!optree_set_checker(optarg))
+				usage("unknown decoder");
+			break;
+
+		case OPT_VERIFY_LENGTHS:
+			optree_verify_lengths();
+			break;
+
 		case '?':
 		default:
 			usage(NULL);
@@ -146,11 +314,37 @@ main(int argc, char *argv[])
 
 	if (opt_checkpoint == -1)
 		opt_checkpoint = DEFAULT_CHECKPOINT;
+	if (opt_hotspotfile != NULL && !hotspot_enabled())
+		hotspot_set_size(DEFAULT_HOTSPOTS_MB);
 	if (!opsloaded) {
-		optree_parsefile(DEFAULT_OPFILE);
+		optree_load_builtin();
+#ifdef __amd64__
+		/*
+		 * Native amd64 processes need the 64-bit opcode list, but
+		 * we can still trace 32-bit processes without it.
+		 */
+		if (access(DEFAULT_OPFILE_AMD64, R_OK) == 0)
+			optree_parsefile(DEFAULT_OPFILE_AMD64);
+#endif
 		opsloaded = true;
 	}
 
+	optree_compile();
+
+	/*
+	 * With no process to trace, benchmark the decoders on a previously
+	 * recorded corpus or random instructions.  Otherwise, record the
+	 * instructions traced so they can be used instead and/or saved.
+	 */
+	if (benchmark && argc == 0 && opt_pid == -1) {
+		if (opt_corpus != NULL)
+			optree_corpus_load(opt_corpus);
+		optree_benchmark();
+		exit(EX_OK);
+	}
+	if (benchmark || opt_corpus != NULL)
+		optree_benchmark_sample();
+
 	target_init();
 
 	if (opt_pid != -1) {
@@ -200,6 +394,16 @@ main(int argc, char *argv[])
 		     opt_checkpoint);
 	}
 
+	if (opt_checkpoint_insns != 0) {
+		warn("snapshots every %llu instructions",
+		     (unsigned long long)opt_checkpoint_insns);
+	}
+	if (opt_max_insns != 0) {
+		warn("tracing at most %llu instructions",
+		     (unsigned long long)opt_max_insns);
+	}
+	insn_event_schedule();
+
 	time_record("trace started at", &starttime);
 
 	trace(targ);
@@ -208,6 +412,13 @@ main(int argc, char *argv[])
 	epilogue();
 
 	optree_output();
+	optree_verify_report();
+
+	if (opt_corpus != NULL)
+		optree_corpus_save(opt_corpus);
+
+	if (benchmark)
+		optree_benchmark();
 
 	/*
 	 * If we attached to an already running process (i.e. -p pid command
@@ -236,10 +447,21 @@ trace(target_t targ)
 		vm_offset_t pc = target_get_pc(targ);
 		region_t region = target_get_region(targ, pc);
 		uint cycles = target_get_cycles(targ);
+		bool syscall;
 
-		optree_update(targ, region, pc, cycles);
+		syscall = optree_update(targ, region, target_get_isa(targ), pc,
+					cycles);
 		instructions++;
 
+		/*
+		 * Instruction-count driven events (snapshots and the
+		 * instruction limit) are folded into a single comparison
+		 * against the next instruction count that needs attention
+		 * to keep the common case cheap.
+		 */
+		if (instructions == insn_next_event)
+			insn_event();
+
 		/*
 		 * Periodically record the instruction counters in case
 		 * we get interrupted (e.g. power outage, etc) so at least
@@ -255,6 +477,12 @@ trace(target_t targ)
 		if (terminate)
 			break;
 
+		/*
+		 * Let the target know when it is about to step over a system
+		 * call so it can follow any changes to its memory map.
+		 */
+		if (syscall)
+			target_syscall(targ);
 		target_step(targ);
 		targ = target_wait();
 		if (targ == NULL)
@@ -263,6 +491,63 @@ trace(target_t targ)
 }
 
 
+/*!
+ * insn_event() - Handle instruction-count driven events.
+ *
+ *	Called from trace() when the number of instructions traced reaches
+ *	the count scheduled by insn_event_schedule().  Writes a numbered
+ *	snapshot of the execution profile every --checkpoint-insns
+ *	instructions and requests termination once --max-insns instructions
+ *	have been traced.
+ */
+void
+insn_event(void)
+{
+	char *snapfile;
+
+	if (instructions == insn_next_checkpoint) {
+		asprintf(&snapfile, "%s.%llu", opt_outfile,
+			 (unsigned long long)
+			 (instructions / opt_checkpoint_insns));
+		if (snapfile == NULL)
+			fatal(EX_OSERR, "malloc: %m");
+
+		debug("snapshot of %llu instructions to %s",
+		      (unsigned long long)instructions, snapfile);
+		optree_output_file(snapfile);
+		free(snapfile);
+	}
+
+	if (instructions == opt_max_insns) {
+		warn("instruction limit reached");
+		terminate = true;
+	}
+
+	insn_event_schedule();
+}
+
+
+/*!
+ * insn_event_schedule() - Compute the instruction count at which trace()
+ *			   next needs to call insn_event().
+ */
+void
+insn_event_schedule(void)
+{
+
+	insn_next_event = UINT64_MAX;
+
+	if (opt_checkpoint_insns != 0) {
+		insn_next_checkpoint = instructions + opt_checkpoint_insns -
+				       (instructions % opt_checkpoint_insns);
+		insn_next_event = insn_next_checkpoint;
+	}
+
+	if (opt_max_insns > instructions && opt_max_insns < insn_next_event)
+		insn_next_event = opt_max_insns;
+}
+
+
 void
 time_record(const char *msg, struct timeval *tvp)
 {
@@ -302,6 +587,9 @@ epilogue(void)
 	      (unsigned long long)instructions,
 	      stoptime.tv_sec, rounddiv(stoptime.tv_usec, 1000),
 	      ips / 1000, ips % 1000);
+
+	optree_cache_report();
+	region_cache_report();
 }
 
 
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2004,2005 Kelly Yancey
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $kbyanc$
+ */
+
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include "dyntrace.h"
+#include "optree.h"
+
+/*!
+ * @file
+ *
+ * opgen: compile opcode lists into C.
+ *
+ * Run at build time to convert the distributed opcode lists into constant
+ * tables that are linked into dyntrace (see optree_load_builtin()), so that
+ * dyntrace does not need to parse any XML at startup.  The C source is
+ * written to stdout.
+ *
+ * Usage: opgen oplist.xml ...
+ */
+
+
+bool opt_debug = false;
+
+/* Names of the isa_t values, for the generated source. */
+static const char *isa_enum[NUMISAS] = {
+	"ISA_X86",
+	"ISA_AMD64"
+};
+
+/* Names of the opext_t values, for the generated source. */
+static const char *opext_enum[NUMOPEXTS] = {
+	"OPEXT_BASE",
+	"OPEXT_X87",
+	"OPEXT_MMX",
+	"OPEXT_SSE",
+	"OPEXT_SSE2",
+	"OPEXT_SSE3",
+	"OPEXT_SSSE3",
+	"OPEXT_SSE41",
+	"OPEXT_SSE42",
+	"OPEXT_AVX128",
+	"OPEXT_AVX256",
+	"OPEXT_AVX512"
+};
+
+
+/*!
+ * @struct opgen_state
+ *
+ *	State passed to opgen_entry() while writing each opcode list.
+ */
+struct opgen_state {
+	uint		 nentries;
+};
+
+
+static void	 opgen_entry(isa_t isa, const struct oplist_entry *ent,
+			     void *arg);
+static void	 opgen_string(const char *str);
+static void	 opgen_bytes(const uint8_t *bytes);
+static const char *opgen_basename(const char *filepath);
+
+
+int
+main(int argc, char *argv[])
+{
+	struct opgen_state state;
+	isa_t *isas;
+	uint *counts;
+	int i;
+
+	if (argc < 2)
+		fatal(EX_USAGE, "usage: opgen oplist.xml ...");
+
+	isas = malloc(argc * sizeof(*isas));
+	counts = malloc(argc * sizeof(*counts));
+	if (isas == NULL || counts == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+
+	printf("/*\n"
+	       " * Opcode lists compiled into dyntrace.\n"
+	       " *\n"
+	       " * Generated by opgen; do not edit.\n"
+	       " */\n"
+	       "\n"
+	       "#include <sys/types.h>\n"
+	       "\n"
+	       "#include <stdbool.h>\n"
+	       "#include <stdint.h>\n"
+	       "\n"
+	       "#include \"dyntrace.h\"\n"
+	       "#include \"optree.h\"\n");
+
+	for (i = 1; i < argc; i++) {
+		printf("\n\n/* %s */\n", opgen_basename(argv[i]));
+		printf("static const struct oplist_entry oplist%d[] = {\n", i);
+
+		state.nentries = 0;
+		isas[i] = oplist_parsefile(argv[i], opgen_entry, &state);
+		counts[i] = state.nentries;
+
+		printf("};\n");
+	}
+
+	printf("\n\nconst struct oplist_builtin oplist_builtins[] = {\n");
+	for (i = 1; i < argc; i++) {
+		printf("\t{ ");
+		opgen_string(opgen_basename(argv[i]));
+		printf(", %s, oplist%d, %u },\n", isa_enum[isas[i]], i,
+		       counts[i]);
+	}
+	printf("\t{ NULL, 0, NULL, 0 }\n};\n");
+
+	if (fflush(stdout) != 0 || ferror(stdout))
+		fatal(EX_IOERR, "error writing output: %m");
+
+	return 0;
+}
+
+
+/*!
+ * opgen_entry() - Write the initializer for a prefix or opcode.
+ *
+ *	Called by oplist_parsefile() for each entry in the opcode list.
+ */
+void
+opgen_entry(isa_t isa __unused, const struct oplist_entry *ent, void *arg)
+{
+	struct opgen_state *state = arg;
+
+	printf("\t{ %s, ", ent->prefix ? "true" : "false");
+	opgen_string(ent->bitmask);
+	printf(", ");
+	opgen_string(ent->mnemonic);
+	printf(", ");
+	opgen_string(ent->detail);
+	printf(", 0x%02x, %s,\n\t  ", ent->args,
+	       opext_enum[ent->extension]);
+	opgen_bytes(ent->mask);
+	printf(", ");
+	opgen_bytes(ent->match);
+	printf(" },\n");
+
+	state->nentries++;
+}
+
+
+/*!
+ * opgen_string() - Write a string as a C string literal, or NULL.
+ */
+void
+opgen_string(const char *str)
+{
+
+	if (str == NULL) {
+		printf("NULL");
+		return;
+	}
+
+	putchar('"');
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if (*str < ' ' || *str > '~')
+			printf("\\%03o", (unsigned char)*str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+
+/*!
+ * opgen_bytes() - Write an OPKEY_LEN byte array initializer, omitting
+ *		   trailing zero bytes.
+ *
+ *	An array of all zero bytes is written as { 0 } as an empty
+ *	initializer is not standard C.
+ */
+void
+opgen_bytes(const uint8_t *bytes)
+{
+	int len, i;
+
+	for (len = OPKEY_LEN; len > 0 && bytes[len - 1] == 0; len--)
+		continue;
+
+	if (len == 0) {
+		printf("{ 0 }");
+		return;
+	}
+
+	printf("{ ");
+	for (i = 0; i < len; i++)
+		printf("%s0x%02x", (i == 0) ? "" : ", ", bytes[i]);
+	printf(" }");
+}
+
+
+/*!
+ * opgen_basename() - Get the final component of a path.
+ */
+const char *
+opgen_basename(const char *filepath)
+{
+	const char *slash;
+
+	slash = strrchr(filepath, '/');
+	return (slash != NULL) ? slash + 1 : filepath;
+}
@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2004,2005 Kelly Yancey
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * $kbyanc$
+ */
+
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dyntrace.h"
+#include "optree.h"
+
+/*!
+ * @file
+ *
+ * Instruction length decoding.
+ *
+ * The opcode lists identify which opcode an instruction is, but not how
+ * many bytes it occupies: the bit strings only cover the bytes needed to
+ * tell opcodes apart and the <arg> elements name operand kinds without
+ * giving their encoded sizes.  The length is instead derived from the
+ * instruction's structure, which is regular enough to be table-driven:
+ * prefixes, one to three opcode bytes (or a VEX, EVEX or XOP prefix and
+ * an opcode byte), then an optional ModR/M byte with its SIB byte and
+ * displacement, then an immediate whose size is fixed by the opcode and
+ * the effective operand and address sizes.
+ */
+
+
+#define	OPLEN_MAX		15	/* Architectural instruction limit. */
+
+/* Flags describing each opcode in the opcode maps. */
+#define	L_MODRM			0x0001	/* ModR/M byte follows. */
+#define	L_IMM8			0x0002	/* 8-bit immediate. */
+#define	L_IMM16			0x0004	/* 16-bit immediate. */
+#define	L_IMMZ			0x0008	/* 16 or 32-bit immediate. */
+#define	L_IMMV			0x0010	/* 16, 32 or 64-bit immediate. */
+#define	L_MOFFS			0x0020	/* Address-sized memory offset. */
+#define	L_FARPTR		0x0040	/* Selector and 16 or 32-bit offset. */
+#define	L_GROUP3		0x0080	/* Immediate only if ModR/M.reg < 2. */
+#define	L_BRANCH		0x0100	/* May not fall through. */
+#define	L_BRANCHRM		0x0200	/* Branch if ModR/M.reg is 2 to 5. */
+#define	L_INVALID		0x0400	/* Undefined opcode. */
+#define	L_INVALID64		0x0800	/* Undefined in 64-bit mode. */
+#define	L_REGONLY		0x1000	/* ModR/M.mod is taken to be 11. */
+
+/* Shorthands for the opcode maps below. */
+#define	M	L_MODRM
+#define	I8	L_IMM8
+#define	IZ	L_IMMZ
+#define	G3	L_GROUP3
+#define	BR	L_BRANCH
+#define	X	L_INVALID
+#define	X64	L_INVALID64
+#define	R	L_REGONLY
+
+/*
+ * Single-byte opcodes.  Prefixes and the 0F escape are handled by
+ * oplen_decode() before the map is consulted.
+ */
+static const uint16_t oplen_map1[256] = {
+/*	 x0	 x1	 x2	 x3	 x4	 x5	 x6	 x7 */
+/*	 x8	 x9	 xA	 xB	 xC	 xD	 xE	 xF */
+/* 0x */ M,	 M,	 M,	 M,	 I8,	 IZ,	 X64,	 X64,
+	 M,	 M,	 M,	 M,	 I8,	 IZ,	 X64,	 X,
+/* 1x */ M,	 M,	 M,	 M,	 I8,	 IZ,	 X64,	 X64,
+	 M,	 M,	 M,	 M,	 I8,	 IZ,	 X64,	 X64,
+/* 2x */ M,	 M,	 M,	 M,	 I8,	 IZ,	 0,	 X64,
+	 M,	 M,	 M,	 M,	 I8,	 IZ,	 0,	 X64,
+/* 3x */ M,	 M,	 M,	 M,	 I8,	 IZ,	 0,	 X64,
+	 M,	 M,	 M,	 M,	 I8,	 IZ,	 0,	 X64,
+/* 4x */ 0,	 0,	 0,	 0,	 0,	 0,	 0,	 0,
+	 0,	 0,	 0,	 0,	 0,	 0,	 0,	 0,
+/* 5x */ 0,	 0,	 0,	 0,	 0,	 0,	 0,	 0,
+	 0,	 0,	 0,	 0,	 0,	 0,	 0,	 0,
+/* 6x */ X64,	 X64,	 M|X64,	 M,	 0,	 0,	 0,	 0,
+	 IZ,	 M|IZ,	 I8,	 M|I8,	 0,	 0,	 0,	 0,
+/* 7x */ I8|BR,	 I8|BR,	 I8|BR,	 I8|BR,	 I8|BR,	 I8|BR,	 I8|BR,	 I8|BR,
+	 I8|BR,	 I8|BR,	 I8|BR,	 I8|BR,	 I8|BR,	 I8|BR,	 I8|BR,	 I8|BR,
+/* 8x */ M|I8,	 M|IZ,	 M|I8|X64, M|I8, M,	 M,	 M,	 M,
+	 M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+/* 9x */ 0,	 0,	 0,	 0,	 0,	 0,	 0,	 0,
+	 0,	 0,	 L_FARPTR|BR|X64, 0, 0,	 0,	 0,	 0,
+/* Ax */ L_MOFFS, L_MOFFS, L_MOFFS, L_MOFFS, 0, 0,	 0,	 0,
+	 I8,	 IZ,	 0,	 0,	 0,	 0,	 0,	 0,
+/* Bx */ I8,	 I8,	 I8,	 I8,	 I8,	 I8,	 I8,	 I8,
+	 L_IMMV, L_IMMV, L_IMMV, L_IMMV, L_IMMV, L_IMMV, L_IMMV, L_IMMV,
+/* Cx */ M|I8,	 M|I8,	 L_IMM16|BR, BR, M|X64, M|X64,	 M|I8,	 M|IZ,
+	 L_IMM16|I8, 0,	 L_IMM16|BR, BR, BR,	 I8|BR,	 BR|X64, BR,
+/* Dx */ M,	 M,	 M,	 M,	 I8|X64, I8|X64, X64,	 0,
+	 M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+/* Ex */ I8|BR,	 I8|BR,	 I8|BR,	 I8|BR,	 I8,	 I8,	 I8,	 I8,
+	 IZ|BR,	 IZ|BR,	 L_FARPTR|BR|X64, I8|BR, 0, 0,	 0,	 0,
+/* Fx */ 0,	 BR,	 0,	 0,	 0,	 0,	 M|G3|I8, M|G3|IZ,
+	 0,	 0,	 0,	 0,	 0,	 0,	 M,	 M|L_BRANCHRM
+};
+
+/*
+ * Two-byte opcodes (0F xx).  The 0F 38 and 0F 3A escapes are handled by
+ * oplen_decode(); every opcode in those maps has a ModR/M byte and those
+ * in the 0F 3A map also have an 8-bit immediate.
+ */
+static const uint16_t oplen_map2[256] = {
+/*	 x0	 x1	 x2	 x3	 x4	 x5	 x6	 x7 */
+/*	 x8	 x9	 xA	 xB	 xC	 xD	 xE	 xF */
+/* 0x */ M,	 M,	 M,	 M,	 X,	 BR,	 0,	 BR,
+	 0,	 0,	 X,	 BR,	 X,	 M,	 0,	 M|I8,
+/* 1x */ M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+	 M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+/* 2x */ M|R,	 M|R,	 M|R,	 M|R,	 X,	 X,	 X,	 X,
+	 M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+/* 3x */ 0,	 0,	 0,	 0,	 BR,	 BR,	 X,	 0,
+	 X,	 X,	 X,	 X,	 X,	 X,	 X,	 X,
+/* 4x */ M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+	 M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+/* 5x */ M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+	 M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+/* 6x */ M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+	 M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+/* 7x */ M|I8,	 M|I8,	 M|I8,	 M|I8,	 M,	 M,	 M,	 0,
+	 M,	 M,	 X,	 X,	 M,	 M,	 M,	 M,
+/* 8x */ IZ|BR,	 IZ|BR,	 IZ|BR,	 IZ|BR,	 IZ|BR,	 IZ|BR,	 IZ|BR,	 IZ|BR,
+	 IZ|BR,	 IZ|BR,	 IZ|BR,	 IZ|BR,	 IZ|BR,	 IZ|BR,	 IZ|BR,	 IZ|BR,
+/* 9x */ M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+	 M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+/* Ax */ 0,	 0,	 0,	 M,	 M|I8,	 M,	 X,	 X,
+	 0,	 0,	 BR,	 M,	 M|I8,	 M,	 M,	 M,
+/* Bx */ M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+	 M,	 M,	 M|I8,	 M,	 M,	 M,	 M,	 M,
+/* Cx */ M,	 M,	 M|I8,	 M,	 M|I8,	 M|I8,	 M|I8,	 M,
+	 0,	 0,	 0,	 0,	 0,	 0,	 0,	 0,
+/* Dx */ M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+	 M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+/* Ex */ M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+	 M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+/* Fx */ M,	 M,	 M,	 M,	 M,	 M,	 M,	 M,
+	 M,	 M,	 M,	 M,	 M,	 M,	 M,	 M
+};
+
+#undef	M
+#undef	I8
+#undef	IZ
+#undef	G3
+#undef	BR
+#undef	X
+#undef	X64
+#undef	R
+
+
+/*!
+ * oplen_decode() - Determine the length of an instruction.
+ *
+ *	@param	isa	The instruction set the instruction is executed in.
+ *
+ *	@param	text	The instruction text, starting with any prefixes.
+ *
+ *	@param	textlen	Number of bytes of instruction text available.
+ *
+ *	@param	flagsp	Pointer to populate with OPLEN_* flags describing
+ *			the instruction; may be NULL.
+ *
+ *	@return	the length of the instruction in bytes or zero if the
+ *		text does not hold a valid instruction.
+ */
+uint
+oplen_decode(isa_t isa, const void *text, size_t textlen, uint *flagsp)
+{
+	const uint8_t *start = text;
+	const uint8_t *p, *end;
+	uint16_t flags;
+	uint opsize, addrsize;
+	uint map, imm, vex;
+	uint8_t op, modrm, sib;
+	bool rexw = false;
+
+	assert(isa < NUMISAS);
+
+	if (flagsp != NULL)
+		*flagsp = 0;
+
+	if (textlen > OPLEN_MAX)
+		textlen = OPLEN_MAX;
+	end = start + textlen;
+
+	opsize = 4;
+	addrsize = (isa == ISA_AMD64) ? 8 : 4;
+
+	/*
+	 * Skip the prefixes, noting the ones which change the operand and
+	 * address sizes.  In 64-bit mode a REX prefix only takes effect if
+	 * it immediately precedes the opcode.
+	 */
+	for (p = start; ; p++) {
+		if (p == end)
+			return 0;
+
+		if (*p == 0x66)
+			opsize = 2;
+		else if (*p == 0x67)
+			addrsize = (isa == ISA_AMD64) ? 4 : 2;
+		else if (isa == ISA_AMD64 && (*p & 0xf0) == 0x40) {
+			rexw = (*p & 0x08) != 0;
+			continue;
+		}
+		else if (*p != 0xf0 && *p != 0xf2 && *p != 0xf3 &&
+			 *p != 0x26 && *p != 0x2e && *p != 0x36 &&
+			 *p != 0x3e && *p != 0x64 && *p != 0x65)
+			break;
+
+		rexw = false;
+	}
+
+	if (rexw)
+		opsize = 8;
+
+	/*
+	 * Determine which opcode map the opcode byte is from.  VEX and EVEX
+	 * prefixes reuse the encodings of LES, LDS and BOUND; outside of
+	 * 64-bit mode they are only prefixes if the following byte could
+	 * not be a ModR/M byte with a memory operand.  Similarly, AMD's XOP
+	 * prefix is POP with a ModR/M.reg field that POP does not use.
+	 */
+	op = *p++;
+	map = 0;
+	vex = 0;
+	if (op == 0x0f) {
+		if (p == end)
+			return 0;
+		op = *p++;
+		map = 1;
+		if (op == 0x38 || op == 0x3a) {
+			map = (op == 0x38) ? 2 : 3;
+			if (p == end)
+				return 0;
+			op = *p++;
+		}
+	}
+	else if ((op == 0xc4 || op == 0xc5 || op == 0x62) && p < end &&
+		 (isa == ISA_AMD64 || (*p & 0xc0) == 0xc0)) {
+		switch (op) {
+		case 0xc5:
+			map = 1;
+			vex = OPLEN_VEX;
+			if ((p[0] & 0x04) != 0)
+				vex |= OPLEN_VEX256;
+			p += 1;
+			break;
+		case 0xc4:
+			map = *p & 0x1f;
+			if (map < 1 || map > 3)
+				return 0;
+			if (p + 1 == end)
+				return 0;
+			vex = OPLEN_VEX;
+			if ((p[1] & 0x04) != 0)
+				vex |= OPLEN_VEX256;
+			p += 2;
+			break;
+		default:
+			/* EVEX maps 5 and 6 are laid out like 0F 38. */
+			map = *p & 0x07;
+			if (map == 0 || map == 4 || map == 7)
+				return 0;
+			if (map > 3)
+				map = 2;
+			vex = OPLEN_VEX | OPLEN_EVEX;
+			p += 3;
+			break;
+		}
+		if (p >= end)
+			return 0;
+		op = *p++;
+	}
+	else if (op == 0x8f && p < end && (*p & 0x1f) >= 8) {
+		map = *p & 0x1f;
+		if (map > 10)
+			return 0;
+		p += 2;
+		if (p >= end)
+			return 0;
+		op = *p++;
+	}
+
+	switch (map) {
+	case 0:
+		flags = oplen_map1[op];
+		break;
+	case 1:
+		flags = oplen_map2[op];
+		break;
+	case 2:
+	case 9:
+		flags = L_MODRM;
+		break;
+	case 10:
+		flags = L_MODRM | L_IMMZ;
+		break;
+	default:
+		flags = L_MODRM | L_IMM8;
+		break;
+	}
+
+	if ((flags & L_INVALID) != 0 ||
+	    ((flags & L_INVALID64) != 0 && isa == ISA_AMD64))
+		return 0;
+
+	/*
+	 * The ModR/M byte selects between a register operand and a memory
+	 * operand; the latter may need a SIB byte and a displacement.
+	 */
+	if ((flags & L_MODRM) != 0) {
+		if (p == end)
+			return 0;
+		modrm = *p++;
+
+		if ((flags & L_GROUP3) != 0 && (modrm & 0x38) >= 0x10)
+			flags &= ~(L_IMM8 | L_IMMZ);
+		if ((flags & L_BRANCHRM) != 0 &&
+		    (modrm & 0x38) >= 0x10 && (modrm & 0x38) <= 0x28)
+			flags |= L_BRANCH;
+
+		switch ((flags & L_REGONLY) != 0 ? 3 : modrm >> 6) {
+		case 0:
+			if (addrsize == 2) {
+				if ((modrm & 0x07) == 0x06)
+					p += 2;
+				break;
+			}
+			if ((modrm & 0x07) == 0x05)
+				p += 4;
+			else if ((modrm & 0x07) == 0x04) {
+				if (p == end)
+					return 0;
+				sib = *p++;
+				if ((sib & 0x07) == 0x05)
+					p += 4;
+			}
+			break;
+		case 1:
+			if (addrsize != 2 && (modrm & 0x07) == 0x04)
+				p++;
+			p += 1;
+			break;
+		case 2:
+			if (addrsize != 2 && (modrm & 0x07) == 0x04)
+				p++;
+			p += (addrsize == 2) ? 2 : 4;
+			break;
+		default:
+			break;
+		}
+	}
+
+	/*
+	 * Add the immediate.  Relative branches in 64-bit mode always have
+	 * a 32-bit displacement regardless of the operand size.
+	 */
+	imm = 0;
+	if ((flags & L_IMM8) != 0)
+		imm += 1;
+	if ((flags & L_IMM16) != 0)
+		imm += 2;
+	if ((flags & L_IMMZ) != 0) {
+		if (isa == ISA_AMD64 && (flags & L_BRANCH) != 0)
+			imm += 4;
+		else
+			imm += (opsize == 2) ? 2 : 4;
+	}
+	if ((flags & L_IMMV) != 0)
+		imm += opsize;
+	if ((flags & L_MOFFS) != 0)
+		imm += addrsize;
+	if ((flags & L_FARPTR) != 0)
+		imm += (opsize == 2) ? 4 : 6;
+	p += imm;
+
+	if (p > end)
+		return 0;
+
+	if (flagsp != NULL) {
+		if ((flags & L_BRANCH) != 0)
+			*flagsp |= OPLEN_BRANCH;
+		*flagsp |= vex;
+
+		/* SYSCALL, SYSENTER, INT n and far CALL (the lcall gate). */
+		if (vex == 0 &&
+		    ((map == 1 && (op == 0x05 || op == 0x34)) ||
+		     (map == 0 && (op == 0xcd || op == 0x9a))))
+			*flagsp |= OPLEN_SYSCALL;
+	}
+
+	return p - start;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2004,2005 Kelly Yancey
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $kbyanc$
+ */
+
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include "dyntrace.h"
+#include "optree.h"
+
+/*!
+ * @file
+ *
+ * oplentest: check the instruction length decoder against known lengths.
+ *
+ * Reads test cases, one per line, each giving an instruction set, the
+ * expected length of an instruction and the instruction's text in hex.
+ * Blank lines and text following a '#' are ignored.  Every instruction
+ * is decoded with oplen_decode() and any whose length differs from the
+ * expected one is reported.  Run by "make check" on oplentest.txt.
+ *
+ * Usage: oplentest [file]
+ */
+
+
+/* Longest instruction text accepted in a test case. */
+#define	OPLENTEST_MAXTEXT	32
+
+
+bool opt_debug = false;
+
+/* Names of the isa_t values, as used in the test cases. */
+static const char *isa_names[NUMISAS] = {
+	"x86",
+	"amd64"
+};
+
+
+static bool	 oplentest_parse(char *line, isa_t *isap, uint *lenp,
+				 uint8_t *text, size_t *textlenp);
+
+
+int
+main(int argc, char *argv[])
+{
+	char path[1024];
+	char line[256];
+	uint8_t text[OPLENTEST_MAXTEXT];
+	const char *srcdir;
+	size_t textlen;
+	uint lineno, ntests, nfailed;
+	uint expected, len;
+	isa_t isa;
+	FILE *fp;
+
+	if (argc > 2)
+		fatal(EX_USAGE, "usage: oplentest [file]");
+
+	/* Under "make check", the test cases are found in the source tree. */
+	if (argc == 2)
+		strlcpy(path, argv[1], sizeof(path));
+	else {
+		srcdir = getenv("srcdir");
+		snprintf(path, sizeof(path), "%s/oplentest.txt",
+			 (srcdir != NULL) ? srcdir : ".");
+	}
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		fatal(EX_NOINPUT, "unable to open %s: %m", path);
+
+	lineno = 0;
+	ntests = 0;
+	nfailed = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if (!oplentest_parse(line, &isa, &expected, text, &textlen)) {
+			fatal(EX_DATAERR, "%s:%u: malformed test case", path,
+			      lineno);
+		}
+		if (textlen == 0)
+			continue;
+
+		ntests++;
+		len = oplen_decode(isa, text, textlen, NULL);
+		if (len != expected) {
+			warn("%s:%u: decoded length %u, expected %u", path,
+			     lineno, len, expected);
+			nfailed++;
+		}
+	}
+	fclose(fp);
+
+	printf("%u of %u instruction lengths correct\n", ntests - nfailed,
+	       ntests);
+	return (nfailed == 0) ? EX_OK : EX_SOFTWARE;
+}
+
+
+/*!
+ * oplentest_parse() - Parse a test case.
+ *
+ *	@param	line		The line of text to parse; modified.
+ *
+ *	@param	isap		Pointer to populate with the instruction set.
+ *
+ *	@param	lenp		Pointer to populate with the expected length.
+ *
+ *	@param	text		Buffer of OPLENTEST_MAXTEXT bytes to populate
+ *				with the instruction text.
+ *
+ *	@param	textlenp	Pointer to populate with the number of bytes
+ *				of instruction text, or zero if the line is
+ *				blank.
+ *
+ *	@return	true if the line was parsed, false if it is malformed.
+ */
+bool
+oplentest_parse(char *line, isa_t *isap, uint *lenp, uint8_t *text,
+		size_t *textlenp)
+{
+	const char *isastr, *lenstr, *hex;
+	char *p, *end;
+	isa_t isa;
+
+	*textlenp = 0;
+
+	p = strchr(line, '#');
+	if (p != NULL)
+		*p = '\0';
+
+	isastr = strtok(line, " \t\n");
+	if (isastr == NULL)
+		return true;
+	lenstr = strtok(NULL, " \t\n");
+	hex = strtok(NULL, " \t\n");
+	if (lenstr == NULL || hex == NULL || strtok(NULL, " \t\n") != NULL)
+		return false;
+
+	for (isa = 0; isa < NUMISAS; isa++) {
+		if (strcmp(isastr, isa_names[isa]) == 0)
+			break;
+	}
+	if (isa == NUMISAS)
+		return false;
+	*isap = isa;
+
+	*lenp = strtoul(lenstr, &end, 10);
+	if (*end != '\0')
+		return false;
+
+	if (strlen(hex) % 2 != 0 || strlen(hex) / 2 > OPLENTEST_MAXTEXT)
+		return false;
+	for (; *hex != '\0'; hex += 2) {
+		if (!isxdigit((unsigned char)hex[0]) ||
+		    !isxdigit((unsigned char)hex[1]))
+			return false;
+		text[(*textlenp)++] = (digittoint(hex[0]) << 4) |
+				      digittoint(hex[1]);
+	}
+
+	return *textlenp != 0;
+}
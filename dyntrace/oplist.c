@@ -0,0 +1,943 @@
+/*
+ * Copyright (c) 2004,2005 Kelly Yancey
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $kbyanc$
+ */
+
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libxml/xmlreader.h>
+
+#include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "dyntrace.h"
+#include "optree.h"
+
+/*!
+ * @file
+ *
+ * Parser for the XML opcode list format described by oplist.dtd.
+ *
+ * The parser only extracts the prefixes and opcodes from the file, handing
+ * each to a caller-supplied function; it is shared by dyntrace itself (to
+ * load opcode lists specified with -f) and by the opgen utility which
+ * compiles the distributed opcode lists into the dyntrace binary.
+ *
+ * Since parsing XML is slow relative to the runtime of a short trace,
+ * oplist_load() saves the parsed opcode list in a binary image next to the
+ * XML file (with OPLIST_CACHE_SUFFIX appended to its name).  The image
+ * records a hash of the XML it was built from; later runs mmap(2) the image
+ * and, if the hash still matches, use the entries and strings in it
+ * directly.  The image is only a cache: if it cannot be written, or is
+ * stale or damaged, the XML is parsed as usual.
+ */
+
+
+#define	OPLIST_CACHE_SUFFIX	".cache"
+#define	OPLIST_CACHE_MAGIC	"dtoplst"
+#define	OPLIST_CACHE_VERSION	4
+#define	OPLIST_CACHE_NOSTR	UINT32_MAX	/* String offset for NULL. */
+
+
+/*!
+ * @struct oplist_cache_header
+ *
+ *	Header of a binary opcode list image.  The header is followed by
+ *	an array of nentries struct oplist_cache_entry and then by strsize
+ *	bytes of NUL-terminated strings.  Images are only valid on the
+ *	host they were built on; the fields are in host byte order.
+ *
+ *	@param	keylen		OPKEY_LEN of the dyntrace that built the image.
+ *
+ *	@param	hash		Hash of the XML the image was built from; see
+ *				oplist_hash().
+ */
+struct oplist_cache_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 keylen;
+	uint64_t	 hash;
+	uint32_t	 isa;
+	uint32_t	 nentries;
+	uint32_t	 strsize;
+	uint32_t	 reserved;
+};
+
+
+/*!
+ * @struct oplist_cache_entry
+ *
+ *	A prefix or opcode in a binary opcode list image.  Strings are
+ *	stored as offsets into the image's string pool.
+ */
+struct oplist_cache_entry {
+	uint32_t	 bitmask;
+	uint32_t	 mnemonic;
+	uint32_t	 detail;
+	uint8_t		 prefix;
+	uint8_t		 args;
+	uint8_t		 extension;
+	uint8_t		 mask[OPKEY_LEN];
+	uint8_t		 match[OPKEY_LEN];
+};
+
+
+/*!
+ * @struct oplist_image
+ *
+ *	A binary opcode list image under construction.
+ */
+struct oplist_image {
+	struct oplist_cache_entry *entries;
+	uint		 nentries;
+	uint		 entsize;	/* Entries allocated. */
+
+	char		*strings;
+	size_t		 strsize;
+	size_t		 stralloc;	/* String pool bytes allocated. */
+
+	uint32_t	*strhash;	/* Offsets of pooled strings + 1. */
+	uint		 strhashsize;	/* Power of two. */
+	uint		 nstrings;
+};
+
+
+const char *isa_name[NUMISAS] = {
+	"x86",
+	"amd64"
+};
+
+const char *opext_name[NUMOPEXTS] = {
+	"base",
+	"x87",
+	"mmx",
+	"sse",
+	"sse2",
+	"sse3",
+	"ssse3",
+	"sse4.1",
+	"sse4.2",
+	"avx-128",
+	"avx-256",
+	"avx-512"
+};
+
+
+static isa_t	 oplist_parse(xmlTextReaderPtr reader, const char *filepath,
+			      oplist_handler_t *handler, void *arg);
+static isa_t	 oplist_parse_isa(xmlTextReaderPtr reader,
+				  const char *filepath);
+static void	 oplist_parse_entry(xmlNode *node, isa_t isa,
+				    oplist_handler_t *handler, void *arg);
+static uint8_t	 oplist_parse_args(xmlNode *node, const char *mnemonic);
+static bool	 oplist_is_store(const char *mnemonic);
+
+static uint64_t	 oplist_hash(const void *data, size_t len);
+static void	*oplist_cache_map(const char *cachepath, uint64_t hash,
+				  size_t *sizep);
+static void	*oplist_cache_build(const char *filepath, const void *xml,
+				    size_t xmlsize, uint64_t hash,
+				    size_t *sizep);
+static void	 oplist_cache_add(isa_t isa, const struct oplist_entry *ent,
+				  void *arg);
+static uint32_t	 oplist_cache_string(struct oplist_image *im,
+				     const char *str);
+static void	 oplist_cache_write(const char *cachepath,
+				    const void *image, size_t size);
+static bool	 oplist_cache_valid(const void *image, size_t size);
+
+
+/*!
+ * oplist_parsefile() - Parse an opcode list file.
+ *
+ *	@param	filepath	Path of the opcode list to parse.
+ *
+ *	@param	handler		Function to call for each prefix and opcode
+ *				in the file, in the order they appear.
+ *
+ *	@param	arg		Argument to pass to \a handler.
+ *
+ *	@return	the instruction set the opcode list describes.
+ *
+ *	Errors in the opcode list are fatal.
+ */
+isa_t
+oplist_parsefile(const char *filepath, oplist_handler_t *handler, void *arg)
+{
+	xmlTextReaderPtr reader;
+
+	LIBXML_TEST_VERSION
+
+	reader = xmlNewTextReaderFilename(filepath);
+	if (reader == NULL)
+		fatal(EX_NOINPUT, "unable to open %s for reading", filepath);
+
+	return oplist_parse(reader, filepath, handler, arg);
+}
+
+
+/*!
+ * oplist_parse() - Internal routine to parse an opcode list.
+ *
+ *	@param	reader		XML reader to read the opcode list from.  It
+ *				is freed once the opcode list is parsed.
+ *
+ *	@param	filepath	Path of the opcode list; for error reporting.
+ *
+ *	@param	handler		Function to call for each prefix and opcode.
+ *
+ *	@param	arg		Argument to pass to \a handler.
+ *
+ *	@return	the instruction set the opcode list describes.
+ */
+isa_t
+oplist_parse(xmlTextReaderPtr reader, const char *filepath,
+	     oplist_handler_t *handler, void *arg)
+{
+	isa_t isa = ISA_X86;
+	int ret;
+
+	while ((ret = xmlTextReaderRead(reader)) > 0) {
+		xmlNode *node;
+
+		if (xmlTextReaderNodeType(reader) != XML_ELEMENT_NODE)
+			continue;
+
+		/*
+		 * The root element names the instruction set the opcodes
+		 * describe; it must be examined before it is expanded
+		 * as expanding it would read the entire document.
+		 */
+		if (xmlTextReaderDepth(reader) == 0) {
+			isa = oplist_parse_isa(reader, filepath);
+			continue;
+		}
+
+		node = xmlTextReaderExpand(reader);
+
+		if (strcmp(node->name, "prefix") == 0 ||
+		    strcmp(node->name, "op") == 0)
+			oplist_parse_entry(node, isa, handler, arg);
+	}
+
+	if (ret != 0)
+		fatal(EX_DATAERR, "failed to parse %s", filepath);
+
+	xmlFreeTextReader(reader);
+
+	return isa;
+}
+
+
+/*!
+ * oplist_load() - Load an opcode list, using its binary image if it is
+ *		   up to date.
+ *
+ *	@param	filepath	Path of the opcode list to load.
+ *
+ *	@param	handler		Function to call for each prefix and opcode
+ *				in the file, in the order they appear.
+ *
+ *	@param	arg		Argument to pass to \a handler.
+ *
+ *	@return	the instruction set the opcode list describes.
+ *
+ *	Unlike oplist_parsefile(), the strings in the entries passed to the
+ *	handler remain valid for the life of the process.
+ */
+isa_t
+oplist_load(const char *filepath, oplist_handler_t *handler, void *arg)
+{
+	const struct oplist_cache_header *hdr;
+	const struct oplist_cache_entry *cent;
+	struct oplist_entry ent;
+	struct stat sb;
+	const char *strings;
+	char *cachepath;
+	void *xml, *image;
+	uint64_t hash;
+	size_t size;
+	uint i;
+	int fd;
+
+	/*
+	 * Map the XML so it can be hashed and, if need be, parsed without
+	 * reading it twice.
+	 */
+	fd = open(filepath, O_RDONLY);
+	if (fd < 0)
+		fatal(EX_NOINPUT, "unable to open %s for reading: %m",
+		      filepath);
+	if (fstat(fd, &sb) != 0)
+		fatal(EX_IOERR, "fstat %s: %m", filepath);
+	if (sb.st_size == 0)
+		fatal(EX_DATAERR, "failed to parse %s", filepath);
+
+	xml = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (xml == MAP_FAILED)
+		fatal(EX_IOERR, "mmap %s: %m", filepath);
+	close(fd);
+
+	hash = oplist_hash(xml, sb.st_size);
+
+	if (asprintf(&cachepath, "%s%s", filepath, OPLIST_CACHE_SUFFIX) < 0)
+		fatal(EX_OSERR, "malloc: %m");
+
+	image = oplist_cache_map(cachepath, hash, &size);
+	if (image != NULL)
+		debug("using opcode list image %s", cachepath);
+	else {
+		image = oplist_cache_build(filepath, xml, sb.st_size, hash,
+					   &size);
+		oplist_cache_write(cachepath, image, size);
+	}
+
+	munmap(xml, sb.st_size);
+	free(cachepath);
+
+	/*
+	 * The image (whether mapped or built) is never released so the
+	 * strings in it can be referenced directly.
+	 */
+	hdr = image;
+	cent = (const void *)(hdr + 1);
+	strings = (const char *)(cent + hdr->nentries);
+
+	for (i = 0; i < hdr->nentries; i++, cent++) {
+		ent.prefix = cent->prefix;
+		ent.args = cent->args;
+		ent.extension = cent->extension;
+		ent.bitmask = strings + cent->bitmask;
+		ent.mnemonic = (cent->mnemonic == OPLIST_CACHE_NOSTR) ?
+			       NULL : strings + cent->mnemonic;
+		ent.detail = (cent->detail == OPLIST_CACHE_NOSTR) ?
+			     NULL : strings + cent->detail;
+		memcpy(ent.mask, cent->mask, OPKEY_LEN);
+		memcpy(ent.match, cent->match, OPKEY_LEN);
+
+		handler(hdr->isa, &ent, arg);
+	}
+
+	return hdr->isa;
+}
+
+
+/*!
+ * oplist_hash() - Compute the hash identifying the XML an image was built
+ *		   from (64-bit FNV-1a).
+ */
+uint64_t
+oplist_hash(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (len-- > 0) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+
+/*!
+ * oplist_cache_map() - Map an opcode list's binary image.
+ *
+ *	@param	cachepath	Path of the image.
+ *
+ *	@param	hash		Hash of the XML the image must be built from.
+ *
+ *	@param	sizep		Pointer to store the size of the image at.
+ *
+ *	@return	pointer to the read-only image or NULL if there is no
+ *		usable image.
+ */
+void *
+oplist_cache_map(const char *cachepath, uint64_t hash, size_t *sizep)
+{
+	const struct oplist_cache_header *hdr;
+	struct stat sb;
+	void *image;
+	int fd;
+
+	fd = open(cachepath, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &sb) != 0 ||
+	    sb.st_size < (off_t)sizeof(struct oplist_cache_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	image = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+		return NULL;
+
+	hdr = image;
+	if (hdr->hash != hash || !oplist_cache_valid(image, sb.st_size)) {
+		debug("ignoring stale opcode list image %s", cachepath);
+		munmap(image, sb.st_size);
+		return NULL;
+	}
+
+	*sizep = sb.st_size;
+	return image;
+}
+
+
+/*!
+ * oplist_cache_valid() - Sanity check an opcode list image.
+ *
+ *	@return	true if the image was built by this version of dyntrace,
+ *		all of its string references are within the string pool and
+ *		all of its instruction set extensions are known.
+ */
+bool
+oplist_cache_valid(const void *image, size_t size)
+{
+	const struct oplist_cache_header *hdr = image;
+	const struct oplist_cache_entry *cent;
+	const char *strings;
+	uint i;
+
+	if (memcmp(hdr->magic, OPLIST_CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != OPLIST_CACHE_VERSION ||
+	    hdr->keylen != OPKEY_LEN || hdr->isa >= NUMISAS ||
+	    hdr->strsize == 0)
+		return false;
+
+	if (hdr->nentries > (size - sizeof(*hdr)) / sizeof(*cent) ||
+	    size != sizeof(*hdr) + hdr->nentries * sizeof(*cent) +
+		    hdr->strsize)
+		return false;
+
+	cent = (const void *)(hdr + 1);
+	strings = (const char *)(cent + hdr->nentries);
+	if (strings[hdr->strsize - 1] != '\0')
+		return false;
+
+	for (i = 0; i < hdr->nentries; i++, cent++) {
+		if (cent->bitmask >= hdr->strsize)
+			return false;
+		if (cent->mnemonic >= hdr->strsize &&
+		    (cent->mnemonic != OPLIST_CACHE_NOSTR || !cent->prefix))
+			return false;
+		if (cent->detail >= hdr->strsize &&
+		    cent->detail != OPLIST_CACHE_NOSTR)
+			return false;
+		if (cent->extension >= NUMOPEXTS)
+			return false;
+	}
+
+	return true;
+}
+
+
+/*!
+ * oplist_cache_build() - Parse an opcode list into a binary image.
+ *
+ *	@param	filepath	Path of the opcode list; for error reporting.
+ *
+ *	@param	xml		The contents of the opcode list.
+ *
+ *	@param	xmlsize		Length of \a xml in bytes.
+ *
+ *	@param	hash		Hash of \a xml.
+ *
+ *	@param	sizep		Pointer to store the size of the image at.
+ *
+ *	@return	pointer to the malloc(3)'ed image.
+ */
+void *
+oplist_cache_build(const char *filepath, const void *xml, size_t xmlsize,
+		   uint64_t hash, size_t *sizep)
+{
+	struct oplist_cache_header hdr;
+	struct oplist_image im;
+	xmlTextReaderPtr reader;
+	size_t entbytes;
+	char *image;
+
+	LIBXML_TEST_VERSION
+
+	reader = xmlReaderForMemory(xml, xmlsize, filepath, NULL, 0);
+	if (reader == NULL)
+		fatal(EX_NOINPUT, "unable to open %s for reading", filepath);
+
+	memset(&im, 0, sizeof(im));
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.isa = oplist_parse(reader, filepath, oplist_cache_add, &im);
+
+	/* Guarantee the string pool is never empty. */
+	oplist_cache_string(&im, "");
+
+	memcpy(hdr.magic, OPLIST_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = OPLIST_CACHE_VERSION;
+	hdr.keylen = OPKEY_LEN;
+	hdr.hash = hash;
+	hdr.nentries = im.nentries;
+	hdr.strsize = im.strsize;
+
+	entbytes = im.nentries * sizeof(*im.entries);
+	*sizep = sizeof(hdr) + entbytes + im.strsize;
+
+	image = malloc(*sizep);
+	if (image == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+	memcpy(image, &hdr, sizeof(hdr));
+	memcpy(image + sizeof(hdr), im.entries, entbytes);
+	memcpy(image + sizeof(hdr) + entbytes, im.strings, im.strsize);
+
+	free(im.entries);
+	free(im.strings);
+	free(im.strhash);
+
+	assert(oplist_cache_valid(image, *sizep));
+	return image;
+}
+
+
+/*!
+ * oplist_cache_add() - Add a prefix or opcode to a binary image under
+ *			construction.
+ *
+ *	Called by oplist_parse() for each entry in the opcode list.
+ */
+void
+oplist_cache_add(isa_t isa __unused, const struct oplist_entry *ent,
+		 void *arg)
+{
+	struct oplist_image *im = arg;
+	struct oplist_cache_entry *cent;
+
+	if (im->nentries == im->entsize) {
+		im->entsize = (im->entsize == 0) ? 256 : im->entsize * 2;
+		im->entries = realloc(im->entries,
+				      im->entsize * sizeof(*im->entries));
+		if (im->entries == NULL)
+			fatal(EX_OSERR, "realloc: %m");
+	}
+
+	cent = &im->entries[im->nentries++];
+	memset(cent, 0, sizeof(*cent));
+
+	cent->prefix = ent->prefix;
+	cent->args = ent->args;
+	cent->extension = ent->extension;
+	cent->bitmask = oplist_cache_string(im, ent->bitmask);
+	cent->mnemonic = oplist_cache_string(im, ent->mnemonic);
+	cent->detail = oplist_cache_string(im, ent->detail);
+	memcpy(cent->mask, ent->mask, OPKEY_LEN);
+	memcpy(cent->match, ent->match, OPKEY_LEN);
+}
+
+
+/*!
+ * oplist_cache_string() - Add a string to a binary image's string pool.
+ *
+ *	@return	offset of the string in the pool, or OPLIST_CACHE_NOSTR if
+ *		\a str is NULL.
+ *
+ *	Each distinct string is stored once; many opcodes share mnemonics
+ *	(e.g. the CMOVcc and Jcc forms) and details.  Pooled strings are
+ *	found through an open-addressed hash table kept at most half full.
+ */
+uint32_t
+oplist_cache_string(struct oplist_image *im, const char *str)
+{
+	uint32_t *oldhash;
+	uint oldsize, i, j;
+	size_t len;
+	uint32_t offset;
+
+	if (str == NULL)
+		return OPLIST_CACHE_NOSTR;
+
+	len = strlen(str) + 1;
+
+	if ((im->nstrings + 1) * 2 > im->strhashsize) {
+		oldhash = im->strhash;
+		oldsize = im->strhashsize;
+		im->strhashsize = (oldsize == 0) ? 1024 : oldsize * 2;
+		im->strhash = calloc(im->strhashsize, sizeof(*im->strhash));
+		if (im->strhash == NULL)
+			fatal(EX_OSERR, "malloc: %m");
+		for (i = 0; i < oldsize; i++) {
+			if (oldhash[i] == 0)
+				continue;
+			offset = oldhash[i] - 1;
+			j = oplist_hash(im->strings + offset,
+					strlen(im->strings + offset));
+			while (im->strhash[j & (im->strhashsize - 1)] != 0)
+				j++;
+			im->strhash[j & (im->strhashsize - 1)] = offset + 1;
+		}
+		free(oldhash);
+	}
+
+	for (i = oplist_hash(str, len - 1); ; i++) {
+		i &= im->strhashsize - 1;
+		if (im->strhash[i] == 0)
+			break;
+		offset = im->strhash[i] - 1;
+		if (strcmp(im->strings + offset, str) == 0)
+			return offset;
+	}
+
+	while (im->strsize + len > im->stralloc) {
+		im->stralloc = (im->stralloc == 0) ? 4096 : im->stralloc * 2;
+		im->strings = realloc(im->strings, im->stralloc);
+		if (im->strings == NULL)
+			fatal(EX_OSERR, "realloc: %m");
+	}
+
+	offset = im->strsize;
+	memcpy(im->strings + offset, str, len);
+	im->strsize += len;
+
+	im->strhash[i] = offset + 1;
+	im->nstrings++;
+
+	return offset;
+}
+
+
+/*!
+ * oplist_cache_write() - Save a binary image next to its opcode list.
+ *
+ *	The image is written to a temporary file which is then renamed into
+ *	place so concurrent runs never see a partial image.  Failure is not
+ *	an error; the opcode list will just be parsed again next time.
+ */
+void
+oplist_cache_write(const char *cachepath, const void *image, size_t size)
+{
+	char *tmppath;
+	ssize_t len;
+	int fd;
+
+	if (asprintf(&tmppath, "%s.%d", cachepath, (int)getpid()) < 0)
+		fatal(EX_OSERR, "malloc: %m");
+
+	fd = open(tmppath, O_WRONLY|O_CREAT|O_EXCL, 0644);
+	if (fd < 0) {
+		debug("unable to write opcode list image %s: %m", cachepath);
+		free(tmppath);
+		return;
+	}
+
+	len = write(fd, image, size);
+	if (close(fd) != 0)
+		len = -1;
+
+	if (len != (ssize_t)size || rename(tmppath, cachepath) != 0) {
+		debug("unable to write opcode list image %s: %m", cachepath);
+		unlink(tmppath);
+	}
+	else
+		debug("wrote opcode list image %s", cachepath);
+
+	free(tmppath);
+}
+
+
+/*!
+ * oplist_parse_isa() - Determine the instruction set an opcode list
+ *			describes.
+ *
+ *	@param	reader		The XML reader, positioned on the root element
+ *				of the opcode list.
+ *
+ *	@param	filepath	Path of the opcode list; for error reporting.
+ *
+ *	@return	the instruction set named by the isa attribute of the root
+ *		element.  Opcode lists without an isa attribute describe IA-32.
+ */
+isa_t
+oplist_parse_isa(xmlTextReaderPtr reader, const char *filepath)
+{
+	xmlChar *value;
+	isa_t isa;
+
+	value = xmlTextReaderGetAttribute(reader, "isa");
+	if (value == NULL)
+		return ISA_X86;
+
+	for (isa = 0; isa < NUMISAS; isa++) {
+		if (strcmp(value, isa_name[isa]) == 0)
+			break;
+	}
+
+	if (isa == NUMISAS) {
+		fatal(EX_DATAERR, "%s: unknown instruction set \"%s\"",
+		      filepath, value);
+	}
+
+	xmlFree(value);
+	return isa;
+}
+
+
+/*!
+ * oplist_parse_entry() - Parse a prefix or opcode element.
+ *
+ *	The strings in the entry passed to the handler point into the XML
+ *	document and are only valid for the duration of the call.
+ */
+void
+oplist_parse_entry(xmlNode *node, isa_t isa, oplist_handler_t *handler,
+		   void *arg)
+{
+	struct oplist_entry ent;
+	const xmlAttr *attr;
+	opext_t ext;
+
+	memset(&ent, 0, sizeof(ent));
+	ent.prefix = (strcmp(node->name, "prefix") == 0);
+
+	for (attr = node->properties; attr != NULL; attr = attr->next) {
+		const char *name = attr->name;
+		const char *value = XML_GET_CONTENT(attr->children);
+
+		if (strcmp(name, "bitmask") == 0)
+			ent.bitmask = value;
+		else if (strcmp(name, "mnemonic") == 0 && !ent.prefix)
+			ent.mnemonic = value;
+		else if (strcmp(name, "detail") == 0)
+			ent.detail = value;
+		else if (strcmp(name, "extension") == 0 && !ent.prefix) {
+			for (ext = 0; ext < NUMOPEXTS; ext++) {
+				if (strcmp(value, opext_name[ext]) == 0)
+					break;
+			}
+			if (ext == NUMOPEXTS) {
+				fatal(EX_DATAERR,
+				      "unknown extension \"%s\" at %ld",
+				      value, XML_GET_LINE(node));
+			}
+			ent.extension = ext;
+		}
+	}
+
+	/*
+	 * Verify the entry looks complete.
+	 */
+	if (ent.bitmask == NULL) {
+		fatal(EX_DATAERR, "bitmask missing at %ld",
+		      XML_GET_LINE(node));
+	}
+	if (ent.mnemonic == NULL && !ent.prefix) {
+		fatal(EX_DATAERR, "mnemonic missing at %ld",
+		      XML_GET_LINE(node));
+	}
+
+	oplist_parse_bitmask(ent.bitmask, ent.mask, ent.match);
+
+	if (!ent.prefix)
+		ent.args = oplist_parse_args(node, ent.mnemonic);
+
+	handler(isa, &ent, arg);
+}
+
+
+/*!
+ * oplist_parse_args() - Internal routine to classify an opcode's operands.
+ *
+ *	@param	node		The opcode's element in the opcode list.
+ *
+ *	@param	mnemonic	The opcode's mnemonic.
+ *
+ *	@return	OPARG_* flags for the operands described by the element's
+ *		<arg> children.
+ *
+ *	The opcode lists mark the destination of read-modify-write forms
+ *	(e.g. ADD to memory) as an output only, so a memory output is taken
+ *	to be read as well unless the opcode is a pure store; see
+ *	oplist_is_store().  A direction of "inout" is also understood.
+ */
+uint8_t
+oplist_parse_args(xmlNode *node, const char *mnemonic)
+{
+	static const char * const simdtypes[] = {
+		"mmreg", "mmxreg", "xmm", "xmmeg", "xmmreg", NULL
+	};
+	const char * const *tp;
+	const xmlNode *child;
+	const xmlAttr *attr;
+	uint8_t args = 0;
+	uint nregs = 0;
+
+	for (child = node->children; child != NULL; child = child->next) {
+		const char *dir = NULL;
+		const char *type = NULL;
+
+		if (child->type != XML_ELEMENT_NODE ||
+		    strcmp(child->name, "arg") != 0)
+			continue;
+
+		for (attr = child->properties; attr != NULL;
+		     attr = attr->next) {
+			const char *name = attr->name;
+			const char *value = XML_GET_CONTENT(attr->children);
+
+			if (strcmp(name, "direction") == 0)
+				dir = value;
+			else if (strcmp(name, "type") == 0)
+				type = value;
+		}
+
+		if (dir == NULL || type == NULL) {
+			fatal(EX_DATAERR,
+			      "arg direction or type missing at %ld",
+			      XML_GET_LINE(child));
+		}
+
+		/*
+		 * The lists spell memory operands several ways; anything
+		 * that is not memory, an immediate, or an MMX/SSE register
+		 * is some kind of register.
+		 */
+		if (strcmp(type, "mem") == 0 || strcmp(type, "Memory") == 0 ||
+		    strcmp(type, "xmemory") == 0) {
+			if (strcmp(dir, "input") == 0)
+				args |= OPARG_MEMREAD;
+			else if (strcmp(dir, "output") == 0 &&
+				 oplist_is_store(mnemonic))
+				args |= OPARG_MEMWRITE;
+			else
+				args |= OPARG_MEMREAD | OPARG_MEMWRITE;
+			continue;
+		}
+		if (strcmp(type, "imm") == 0) {
+			args |= OPARG_IMM;
+			continue;
+		}
+		for (tp = simdtypes; *tp != NULL; tp++) {
+			if (strcmp(type, *tp) == 0)
+				break;
+		}
+		args |= (*tp != NULL) ? OPARG_SIMD : OPARG_REG;
+		nregs++;
+	}
+
+	if (nregs > 1)
+		args |= OPARG_REGS;
+
+	return args;
+}
+
+
+/*!
+ * oplist_is_store() - Internal routine to determine whether an opcode only
+ *		       writes its memory operand.
+ *
+ *	@param	mnemonic	The opcode's mnemonic.
+ *
+ *	@return	true if the opcode overwrites its memory destination without
+ *		reading it (moves, stores and the like), false otherwise.
+ */
+bool
+oplist_is_store(const char *mnemonic)
+{
+	static const char * const stores[] = {
+		"FBSTP", "FIST", "FISTP", "FISTTP", "FNSAVE", "FNSTCW",
+		"FNSTENV", "FNSTSW", "FSAVE", "FST", "FSTCW", "FSTENV",
+		"FSTP", "FSTSW", "FXSAVE", "POP", "SETcc", "SGDT", "SIDT",
+		"SLDT", "SMSW", "STMXCSR", "STOS", "STR", NULL
+	};
+	const char * const *sp;
+
+	/* MOV and all of its MMX and SSE variants. */
+	if (strncmp(mnemonic, "MOV", 3) == 0 ||
+	    strncmp(mnemonic, "MASKMOV", 7) == 0)
+		return true;
+
+	for (sp = stores; *sp != NULL; sp++) {
+		if (strcmp(mnemonic, *sp) == 0)
+			return true;
+	}
+	return false;
+}
+
+
+/*!
+ * oplist_parse_bitmask() - Convert an opcode bit string to the mask and
+ *			    match values used to identify it.
+ *
+ *	@param	bitstr	String of '0', '1' and 'x' (don't care) characters.
+ *
+ *	@param	mask	OPKEY_LEN bytes to store the significant bits in.
+ *
+ *	@param	match	OPKEY_LEN bytes to store the significant bits' values
+ *			in.
+ */
+void
+oplist_parse_bitmask(const char *bitstr, uint8_t *mask, uint8_t *match)
+{
+	uint i;
+
+	memset(mask, 0, OPKEY_LEN);
+	memset(match, 0, OPKEY_LEN);
+
+	/*
+	 * The bit string is stored in the same order as the instruction
+	 * text it describes: the first character is the high bit of the
+	 * first byte.
+	 */
+	for (i = 0; bitstr[i] != '\0'; i++) {
+		uint8_t bit = 0x80 >> (i % 8);
+
+		if (i >= OPKEY_LEN * 8) {
+			fatal(EX_DATAERR, "bitstr \"%s\" longer than %d bits",
+			      bitstr, OPKEY_LEN * 8);
+		}
+
+		if (strchr("01xX", bitstr[i]) == NULL) {
+			fatal(EX_DATAERR, "character '%c' not allowed in "
+			      "bitstr", bitstr[i]);
+		}
+
+		if (tolower(bitstr[i]) != 'x')
+			mask[i / 8] |= bit;
+		if (bitstr[i] == '1')
+			match[i / 8] |= bit;
+	}
+}
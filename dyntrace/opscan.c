@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2004,2005 Kelly Yancey
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $kbyanc$
+ */
+
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#if defined(HAVE_IMMINTRIN_H) && defined(__GNUC__) && \
+    (defined(__i386__) || defined(__amd64__) || defined(__x86_64__))
+#define	OPSCAN_AVX2	1
+#include <immintrin.h>
+#endif
+
+#include "dyntrace.h"
+#include "optree.h"
+
+/*!
+ * @file
+ *
+ * Brute-force opcode decoding.
+ *
+ * The opcode sets are small enough (a thousand or so mask/match pairs) that
+ * simply testing the instruction text against every opcode in turn is
+ * competitive with walking the radix tree, particularly when the tests can
+ * be performed several at a time with vector instructions.  The opcodes
+ * are sorted by the number of significant bits in their masks so that the
+ * first opcode to match is the most specific one.
+ *
+ * The radix tree does not strictly rank matches that way though: when the
+ * masks of two matching opcodes overlap without one containing the other,
+ * which of them it returns depends on the path its search takes.  Such
+ * opcodes are flagged at compile time and, should one of them be the first
+ * match, the result is taken from the reference decoder instead.  With the
+ * distributed opcode lists this affects a handful of x87 and MMX encodings.
+ *
+ * Only the first 32 bits of each opcode are tested in the scan loop, eight
+ * opcodes at once using AVX2 when the processor supports it or one at a
+ * time otherwise.  The few opcodes with significant bits beyond the first
+ * 32 are flagged so the rest of their bit string can be checked when they
+ * match; if it does not match, the scan resumes with the next opcode.
+ */
+
+
+#define	OPSCAN_WIDTH		8	/* Opcodes tested per vector. */
+
+/* Flags describing each opcode in the scan arrays. */
+#define	OPSCAN_AMBIGUOUS	0x01	/* Defer to the reference decoder. */
+#define	OPSCAN_LONGKEY		0x02	/* Significant bits beyond the head. */
+
+
+/*!
+ * @struct OpScan
+ *
+ *	The compiled scan arrays for a single instruction set.  The first
+ *	32 bits of each opcode's mask and match are stored in separate
+ *	arrays, padded to a multiple of OPSCAN_WIDTH entries, so they can be
+ *	loaded directly into vector registers.
+ *
+ *	@param	flags		Per-entry OPSCAN_* flags.
+ */
+struct OpScan {
+	uint32_t	*masks;
+	uint32_t	*matches;
+	struct OpTreeNode **nodes;
+	uint8_t		*flags;
+	uint		 n;
+
+	optree_lookup_t	*lookup;
+};
+
+
+static struct OpScan opscan[NUMISAS];
+static uint	(*opscan_find)(const struct OpScan *os, uint32_t head,
+			       uint start);
+
+static uint	 opscan_bits(const struct bitval *mask);
+static int	 opscan_rank_cmp(const void *a, const void *b);
+static bool	 opscan_ambiguous(const struct OpScan *os, uint i);
+static uint	 opscan_find_scalar(const struct OpScan *os, uint32_t head,
+				    uint start);
+#ifdef OPSCAN_AVX2
+static uint	 opscan_find_avx2(const struct OpScan *os, uint32_t head,
+				  uint start);
+#endif
+
+
+/*!
+ * opscan_bits() - Count the significant bits in an opcode's mask.
+ */
+uint
+opscan_bits(const struct bitval *mask)
+{
+	uint bits = 0;
+	uint i;
+
+	for (i = 0; i < OPKEY_LEN; i++)
+		bits += __builtin_popcount(mask->val[i]);
+
+	return bits;
+}
+
+
+/*!
+ * opscan_rank_cmp() - qsort(3) comparison routine for ordering opcodes
+ *		       from most to least significant bits.
+ */
+int
+opscan_rank_cmp(const void *a, const void *b)
+{
+	const struct OpTreeNode *na = *(struct OpTreeNode * const *)a;
+	const struct OpTreeNode *nb = *(struct OpTreeNode * const *)b;
+	int bitsa, bitsb;
+	int cmp;
+
+	bitsa = (na->mask.len != 0) ? (int)opscan_bits(&na->mask) : -1;
+	bitsb = (nb->mask.len != 0) ? (int)opscan_bits(&nb->mask) : -1;
+	if (bitsa != bitsb)
+		return bitsb - bitsa;
+
+	/* Break ties by bit string so the order is deterministic. */
+	cmp = memcmp(na->match.val, nb->match.val, OPKEY_LEN);
+	if (cmp == 0)
+		cmp = memcmp(na->mask.val, nb->mask.val, OPKEY_LEN);
+	return cmp;
+}
+
+
+/*!
+ * opscan_ambiguous() - Determine whether an opcode being the first match
+ *			is enough to decide the decode result.
+ *
+ *	@param	os	The scan arrays being compiled.
+ *
+ *	@param	i	Index of the opcode to examine.
+ *
+ *	@return	true if some later opcode can match the same instruction
+ *		text but tests bits the opcode does not.
+ */
+bool
+opscan_ambiguous(const struct OpScan *os, uint i)
+{
+	const struct bitval *mask = &os->nodes[i]->mask;
+	const struct bitval *match = &os->nodes[i]->match;
+	const struct OpTreeNode *other;
+	bool disjoint, contained;
+	uint j, k;
+
+	for (j = i + 1; j < os->n; j++) {
+		other = os->nodes[j];
+		if (other->mask.len == 0)
+			continue;	/* The default never conflicts. */
+
+		disjoint = false;
+		contained = true;
+		for (k = 0; k < OPKEY_LEN; k++) {
+			uint8_t common = mask->val[k] & other->mask.val[k];
+
+			if (((match->val[k] ^ other->match.val[k]) &
+			     common) != 0)
+				disjoint = true;
+			if ((other->mask.val[k] & ~mask->val[k]) != 0)
+				contained = false;
+		}
+
+		if (!disjoint && !contained)
+			return true;
+	}
+
+	return false;
+}
+
+
+/*!
+ * opscan_compile() - Compile the scan arrays for an instruction set.
+ *
+ *	@param	isa	The instruction set the opcodes describe.
+ *
+ *	@param	nodes	Array of all opcodes and prefixes in the instruction
+ *			set, including the catch-all default opcode.
+ *
+ *	@param	nnodes	Number of entries in \a nodes.
+ *
+ *	@param	lookup	The reference decoder to defer ambiguous matches to.
+ *
+ *	Any arrays previously compiled for the instruction set are discarded.
+ */
+void
+opscan_compile(isa_t isa, struct OpTreeNode * const *nodes, uint nnodes,
+	       optree_lookup_t *lookup)
+{
+	struct OpScan *os = &opscan[isa];
+	uint nambiguous = 0, nlong = 0;
+	uint npadded;
+	uint i, k;
+
+	assert(isa < NUMISAS);
+	assert(nnodes > 0);
+
+	if (opscan_find == NULL) {
+		opscan_find = opscan_find_scalar;
+#ifdef OPSCAN_AVX2
+		if (__builtin_cpu_supports("avx2"))
+			opscan_find = opscan_find_avx2;
+#endif
+	}
+
+	free(os->masks);
+	free(os->matches);
+	free(os->nodes);
+	free(os->flags);
+	memset(os, 0, sizeof(*os));
+
+	npadded = (nnodes + OPSCAN_WIDTH - 1) & ~(OPSCAN_WIDTH - 1);
+
+	if (posix_memalign((void **)&os->masks, 32,
+			   npadded * sizeof(*os->masks)) != 0 ||
+	    posix_memalign((void **)&os->matches, 32,
+			   npadded * sizeof(*os->matches)) != 0)
+		fatal(EX_OSERR, "posix_memalign: %m");
+	os->nodes = malloc(nnodes * sizeof(*os->nodes));
+	os->flags = calloc(nnodes, sizeof(*os->flags));
+	if (os->nodes == NULL || os->flags == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+
+	memcpy(os->nodes, nodes, nnodes * sizeof(*os->nodes));
+	qsort(os->nodes, nnodes, sizeof(*os->nodes), opscan_rank_cmp);
+	os->n = nnodes;
+	os->lookup = lookup;
+
+	/*
+	 * The default opcode sorts last and, having an empty mask, matches
+	 * anything.  So the scan always terminates on or before it and the
+	 * padding is never reached.
+	 */
+	for (i = 0; i < npadded; i++) {
+		const struct OpTreeNode *node;
+
+		node = os->nodes[(i < nnodes) ? i : nnodes - 1];
+		os->masks[i] = os->matches[i] = 0;
+		if (node->mask.len != 0) {
+			memcpy(&os->masks[i], node->mask.val,
+			       sizeof(os->masks[i]));
+			memcpy(&os->matches[i], node->match.val,
+			       sizeof(os->matches[i]));
+		}
+	}
+	assert(os->masks[nnodes - 1] == 0);
+
+	for (i = 0; i < nnodes; i++) {
+		const struct OpTreeNode *node = os->nodes[i];
+
+		if (opscan_ambiguous(os, i)) {
+			os->flags[i] |= OPSCAN_AMBIGUOUS;
+			nambiguous++;
+		}
+
+		for (k = sizeof(os->masks[i]); k < OPKEY_LEN; k++) {
+			if (node->mask.val[k] != 0) {
+				os->flags[i] |= OPSCAN_LONGKEY;
+				nlong++;
+				break;
+			}
+		}
+	}
+
+	debug("compiled %u %s opcodes into scan arrays "
+	      "(%s, %u ambiguous, %u longer than 32 bits)",
+	      nnodes, isa_name[isa],
+	      (opscan_find == opscan_find_scalar) ? "scalar" : "avx2",
+	      nambiguous, nlong);
+}
+
+
+/*!
+ * opscan_find_scalar() - Find the first opcode whose first 32 bits match
+ *			  the instruction text, one opcode at a time.
+ *
+ *	@param	os	The scan arrays to search.
+ *
+ *	@param	head	The first 32 bits of instruction text.
+ *
+ *	@param	start	Index of the first opcode to test.
+ */
+uint
+opscan_find_scalar(const struct OpScan *os, uint32_t head, uint start)
+{
+	uint i;
+
+	for (i = start; (head & os->masks[i]) != os->matches[i]; i++)
+		continue;
+
+	return i;
+}
+
+
+#ifdef OPSCAN_AVX2
+/*!
+ * opscan_find_avx2() - Find the first opcode whose first 32 bits match
+ *			the instruction text, OPSCAN_WIDTH opcodes at a time.
+ *
+ *	@param	os	The scan arrays to search.
+ *
+ *	@param	head	The first 32 bits of instruction text.
+ *
+ *	@param	start	Index of the first opcode to test.
+ */
+__attribute__((target("avx2")))
+uint
+opscan_find_avx2(const struct OpScan *os, uint32_t head, uint start)
+{
+	__m256i vhead = _mm256_set1_epi32(head);
+	__m256i vmask, vmatch, veq;
+	uint skip = start % OPSCAN_WIDTH;
+	uint bits;
+	uint i;
+
+	for (i = start - skip;; i += OPSCAN_WIDTH) {
+		vmask = _mm256_load_si256((const __m256i *)&os->masks[i]);
+		vmatch = _mm256_load_si256((const __m256i *)&os->matches[i]);
+		veq = _mm256_cmpeq_epi32(_mm256_and_si256(vhead, vmask),
+					 vmatch);
+		bits = _mm256_movemask_ps(_mm256_castsi256_ps(veq));
+
+		/* Ignore opcodes before the starting point. */
+		bits &= ~0U << skip;
+		skip = 0;
+
+		if (bits != 0)
+			return i + __builtin_ctz(bits);
+	}
+}
+#endif
+
+
+/*!
+ * opscan_lookup() - Decode the opcode or prefix at the start of a string
+ *		     of instruction text.
+ *
+ *	@param	isa	The instruction set to decode the text as.
+ *
+ *	@param	keyptr	Pointer to OPKEY_LEN bytes of instruction text.
+ *
+ *	@return	the opcode or prefix matching the text.
+ *
+ *	@pre	opscan_compile() has been called for \a isa.
+ */
+struct OpTreeNode *
+opscan_lookup(isa_t isa, const void *keyptr)
+{
+	const struct OpScan *os = &opscan[isa];
+	const uint8_t *text = keyptr;
+	const struct OpTreeNode *node;
+	uint32_t head;
+	uint i, k;
+
+	assert(os->nodes != NULL);
+
+	memcpy(&head, text, sizeof(head));
+
+	for (i = 0;; i++) {
+		i = opscan_find(os, head, i);
+		assert(i < os->n);
+
+		if ((os->flags[i] & OPSCAN_LONGKEY) == 0)
+			break;
+
+		/* Check the rest of the opcode's bit string. */
+		node = os->nodes[i];
+		for (k = sizeof(head); k < OPKEY_LEN; k++) {
+			if ((text[k] & node->mask.val[k]) !=
+			    node->match.val[k])
+				break;
+		}
+		if (k == OPKEY_LEN)
+			break;
+	}
+
+	if ((os->flags[i] & OPSCAN_AMBIGUOUS) != 0)
+		return os->lookup(isa, keyptr);
+	return os->nodes[i];
+}
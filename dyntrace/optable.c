@@ -0,0 +1,495 @@
+/*
+ * Copyright (c) 2004,2005 Kelly Yancey
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $kbyanc$
+ */
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include "dyntrace.h"
+#include "optree.h"
+
+/*!
+ * @file
+ *
+ * Compiled, byte-indexed opcode decode tables.
+ *
+ * The radix tree in optree.c is well suited to building the opcode set as it
+ * detects duplicate bit strings and provides best-match semantics, but each
+ * lookup is a bit-by-bit walk with backtracking.  Once the opcode lists have
+ * been loaded, optable_compile() flattens the tree into a set of 256-entry
+ * tables, one level per byte of instruction text.  Decoding an instruction
+ * is then one array index per byte examined; most opcodes (and all prefixes)
+ * are resolved by the root table alone.
+ *
+ * Each table entry is either the index of the decode result in the node
+ * array or, if OPTABLE_NEXT is set, the index of the table to consult with
+ * the next byte of instruction text.  A cell only refers to another table if
+ * some opcode consistent with the bytes examined so far has significant bits
+ * in later bytes.  Identical tables are shared, so the tables stay small
+ * (and their indices fit in 15 bits).
+ *
+ * The radix tree's notion of the best match is not simply the opcode with
+ * the most significant bits: for overlapping, non-contiguous masks it
+ * depends on where the search through the tree lands.  So rather than
+ * second-guess it, the decode result of each cell is obtained by asking the
+ * radix tree itself, guaranteeing both decoders give identical results.
+ */
+
+
+typedef uint16_t optable_entry_t;
+
+#define	OPTABLE_NEXT		0x8000
+#define	OPTABLE_MAXINDEX	(OPTABLE_NEXT - 1)
+
+
+/*!
+ * @struct OpTable
+ *
+ *	The compiled decode tables for a single instruction set.
+ *
+ *	@param	nodes		Array of decode results, sorted by address
+ *				so they can be located with bsearch(3) while
+ *				compiling.
+ *
+ *	@param	tables		Array of 256-entry tables; the root table
+ *				is always tables[0].
+ *
+ *	@param	hashes		Hash of each table's contents; only used
+ *				while compiling to share identical tables.
+ */
+struct OpTable {
+	struct OpTreeNode **nodes;
+	uint		 nnodes;
+
+	optable_entry_t	(*tables)[256];
+	uint		 ntables;
+	uint		 tablesize;	/* Tables allocated. */
+
+	uint		*hashes;
+};
+
+
+static struct OpTable optable[NUMISAS];
+
+static int	 optable_node_cmp(const void *a, const void *b);
+static optable_entry_t optable_node_index(const struct OpTable *ot,
+					  struct OpTreeNode *node);
+static uint	 optable_build(struct OpTable *ot, optree_lookup_t *lookup,
+			       isa_t isa, uint8_t *key, uint level,
+			       const uint *cand, uint ncand);
+static uint	 optable_share(struct OpTable *ot,
+			       const optable_entry_t *entries);
+static bool	 optable_decided(const struct OpTreeNode *node, uint level);
+static bool	 optable_resolve(const struct OpTable *ot, const uint *cand,
+				 uint ncand, optable_entry_t *entryp);
+
+
+/*!
+ * optable_node_cmp() - qsort(3) and bsearch(3) comparison routine for
+ *			ordering opcode tree nodes by address.
+ */
+int
+optable_node_cmp(const void *a, const void *b)
+{
+	uintptr_t na = (uintptr_t)*(struct OpTreeNode * const *)a;
+	uintptr_t nb = (uintptr_t)*(struct OpTreeNode * const *)b;
+
+	return (na > nb) - (na < nb);
+}
+
+
+/*!
+ * optable_node_index() - Get the index of a node in the node array.
+ */
+optable_entry_t
+optable_node_index(const struct OpTable *ot, struct OpTreeNode *node)
+{
+	struct OpTreeNode **np;
+
+	np = bsearch(&node, ot->nodes, ot->nnodes, sizeof(*ot->nodes),
+		     optable_node_cmp);
+	assert(np != NULL);
+
+	return np - ot->nodes;
+}
+
+
+/*!
+ * optable_decided() - Determine whether an opcode's significant bits all lie
+ *		       within the first level+1 bytes of instruction text.
+ *
+ *	@param	node	The opcode or prefix to examine.
+ *
+ *	@param	level	The index of the last byte examined.
+ */
+bool
+optable_decided(const struct OpTreeNode *node, uint level)
+{
+	uint i;
+
+	if (node->mask.len == 0)
+		return true;
+
+	for (i = level + 1; i < OPKEY_LEN; i++) {
+		if (node->mask.val[i] != 0)
+			return false;
+	}
+
+	return true;
+}
+
+
+/*!
+ * optable_resolve() - Determine the decode result for a set of matching
+ *		       opcodes without consulting the reference decoder.
+ *
+ *	If one opcode's mask contains the masks of all of the others then
+ *	it is the best match regardless of how the radix tree is searched.
+ *	Otherwise, the result depends on the radix tree and must be looked
+ *	up.  This is purely an optimization since lookups in the radix tree
+ *	account for most of the time taken to compile the decode tables.
+ *
+ *	@param	ot	The decode tables being compiled.
+ *
+ *	@param	cand	Indices of the opcodes which match the instruction
+ *			text.
+ *
+ *	@param	ncand	Number of entries in \a cand.
+ *
+ *	@param	entryp	Pointer to store the index of the best match at.
+ *
+ *	@return	true if the best match was determined.
+ */
+bool
+optable_resolve(const struct OpTable *ot, const uint *cand, uint ncand,
+		optable_entry_t *entryp)
+{
+	const struct OpTreeNode *best, *node;
+	uint bits, bestbits = 0;
+	uint besti = 0;
+	uint i, k;
+
+	/* The opcode with the most significant bits is the only contender. */
+	best = NULL;
+	for (i = 0; i < ncand; i++) {
+		node = ot->nodes[cand[i]];
+		if (node->mask.len == 0)
+			continue;
+
+		bits = 0;
+		for (k = 0; k < OPKEY_LEN; k++)
+			bits += __builtin_popcount(node->mask.val[k]);
+
+		if (best == NULL || bits > bestbits) {
+			best = node;
+			bestbits = bits;
+			besti = i;
+		}
+	}
+
+	if (best == NULL) {
+		/* Only the default opcode matches. */
+		*entryp = cand[0];
+		return true;
+	}
+
+	for (i = 0; i < ncand; i++) {
+		node = ot->nodes[cand[i]];
+		if (node->mask.len == 0 || i == besti)
+			continue;
+		for (k = 0; k < OPKEY_LEN; k++) {
+			if ((node->mask.val[k] & ~best->mask.val[k]) != 0)
+				return false;
+		}
+	}
+
+	*entryp = cand[besti];
+	return true;
+}
+
+
+/*!
+ * optable_compile() - Compile decode tables for an instruction set.
+ *
+ *	@param	isa	The instruction set the opcodes describe.
+ *
+ *	@param	nodes	Array of all opcodes and prefixes in the instruction
+ *			set, including the catch-all default opcode.
+ *
+ *	@param	nnodes	Number of entries in \a nodes.
+ *
+ *	@param	lookup	The reference decoder to take decode results from.
+ *
+ *	Any tables previously compiled for the instruction set are discarded.
+ */
+void
+optable_compile(isa_t isa, struct OpTreeNode * const *nodes, uint nnodes,
+		optree_lookup_t *lookup)
+{
+	struct OpTable *ot = &optable[isa];
+	uint8_t key[OPKEY_LEN];
+	uint *cand;
+	uint root;
+	uint i;
+
+	assert(isa < NUMISAS);
+	assert(nnodes > 0 && nnodes <= OPTABLE_MAXINDEX);
+
+	if (ot->nodes != NULL)
+		free(ot->nodes);
+	if (ot->tables != NULL)
+		free(ot->tables);
+	memset(ot, 0, sizeof(*ot));
+
+	ot->nodes = malloc(nnodes * sizeof(*ot->nodes));
+	if (ot->nodes == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+	memcpy(ot->nodes, nodes, nnodes * sizeof(*ot->nodes));
+	qsort(ot->nodes, nnodes, sizeof(*ot->nodes), optable_node_cmp);
+	ot->nnodes = nnodes;
+
+	/*
+	 * Reserve the first table for the root; it is the last one to be
+	 * completed as it refers to all of the others.
+	 */
+	optable_share(ot, NULL);
+
+	/* Initially, every opcode is a candidate. */
+	cand = malloc(nnodes * sizeof(*cand));
+	if (cand == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+	for (i = 0; i < nnodes; i++)
+		cand[i] = i;
+
+	memset(key, 0, sizeof(key));
+	root = optable_build(ot, lookup, isa, key, 0, cand, nnodes);
+	assert(root == 0);
+
+	free(cand);
+	free(ot->hashes);
+	ot->hashes = NULL;
+
+	debug("compiled %u %s opcodes into %u decode tables (%zu bytes)",
+	      nnodes, isa_name[isa], ot->ntables,
+	      ot->ntables * sizeof(*ot->tables));
+}
+
+
+/*!
+ * optable_build() - Internal routine to build the decode table for a set of
+ *		     candidate opcodes.
+ *
+ *	@param	ot	The decode tables being compiled.
+ *
+ *	@param	lookup	The reference decoder.
+ *
+ *	@param	isa	The instruction set being compiled.
+ *
+ *	@param	key	Instruction text examined so far.  Bytes from
+ *			\a level onwards are scratch space.
+ *
+ *	@param	level	Index of the byte of instruction text the table is
+ *			indexed by.
+ *
+ *	@param	cand	Indices of the opcodes consistent with all previous
+ *			bytes of instruction text.
+ *
+ *	@param	ncand	Number of entries in \a cand.
+ *
+ *	@return	index of the table.
+ */
+uint
+optable_build(struct OpTable *ot, optree_lookup_t *lookup, isa_t isa,
+	      uint8_t *key, uint level, const uint *cand, uint ncand)
+{
+	optable_entry_t entries[256];
+	struct OpTreeNode *node;
+	bool decided;
+	uint *subcand, *prevcand;
+	uint nsub, nprev;
+	uint i;
+	uint b;
+
+	assert(level < OPKEY_LEN);
+
+	subcand = malloc(2 * ncand * sizeof(*subcand));
+	if (subcand == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+	prevcand = subcand + ncand;
+	nprev = 0;
+
+	for (b = 0; b < 256; b++) {
+		key[level] = b;
+
+		/*
+		 * Narrow the candidates to those matching this byte value.
+		 * The default opcode matches everything so there is always
+		 * at least one candidate.
+		 */
+		nsub = 0;
+		decided = true;
+		for (i = 0; i < ncand; i++) {
+			node = ot->nodes[cand[i]];
+			if (node->mask.len != 0 &&
+			    (b & node->mask.val[level]) !=
+			    node->match.val[level])
+				continue;
+			subcand[nsub++] = cand[i];
+			decided = decided && optable_decided(node, level);
+		}
+		assert(nsub > 0);
+
+		/*
+		 * Runs of byte values often leave the same candidates (e.g.
+		 * operand bits no opcode cares about); those decode the same
+		 * way so reuse the result for the previous byte value.
+		 */
+		if (nsub == nprev &&
+		    memcmp(subcand, prevcand, nsub * sizeof(*subcand)) == 0) {
+			entries[b] = entries[b - 1];
+			continue;
+		}
+		memcpy(prevcand, subcand, nsub * sizeof(*subcand));
+		nprev = nsub;
+
+		/*
+		 * If none of the remaining candidates depend on any later
+		 * bytes, the decode result is the same no matter what
+		 * follows.  Otherwise, later bytes must be examined.
+		 */
+		if (decided || level + 1 == OPKEY_LEN) {
+			if (optable_resolve(ot, subcand, nsub, &entries[b]))
+				continue;
+			memset(key + level + 1, 0, OPKEY_LEN - level - 1);
+			node = lookup(isa, key);
+			entries[b] = optable_node_index(ot, node);
+		}
+		else {
+			entries[b] = optable_build(ot, lookup, isa, key,
+						   level + 1, subcand, nsub);
+			entries[b] |= OPTABLE_NEXT;
+		}
+	}
+
+	free(subcand);
+
+	/* The root table's slot was reserved by optable_compile(). */
+	if (level == 0) {
+		memcpy(ot->tables[0], entries, sizeof(entries));
+		return 0;
+	}
+
+	return optable_share(ot, entries);
+}
+
+
+/*!
+ * optable_share() - Internal routine to add a table to the decode tables,
+ *		     sharing an existing identical table if there is one.
+ *
+ *	@param	ot	The decode tables being compiled.
+ *
+ *	@param	entries	The contents of the table or NULL to allocate an
+ *			uninitialized table.
+ *
+ *	@return	index of the table.
+ */
+uint
+optable_share(struct OpTable *ot, const optable_entry_t *entries)
+{
+	uint hash = 0;
+	uint t, b;
+
+	if (entries != NULL) {
+		for (b = 0; b < 256; b++)
+			hash = (hash * 33) ^ entries[b];
+
+		for (t = 0; t < ot->ntables; t++) {
+			if (ot->hashes[t] == hash &&
+			    memcmp(ot->tables[t], entries,
+				   sizeof(ot->tables[t])) == 0)
+				return t;
+		}
+	}
+
+	if (ot->ntables == ot->tablesize) {
+		ot->tablesize = (ot->tablesize == 0) ? 64 : ot->tablesize * 2;
+		ot->tables = realloc(ot->tables,
+				     ot->tablesize * sizeof(*ot->tables));
+		ot->hashes = realloc(ot->hashes,
+				     ot->tablesize * sizeof(*ot->hashes));
+		if (ot->tables == NULL || ot->hashes == NULL)
+			fatal(EX_OSERR, "realloc: %m");
+	}
+
+	t = ot->ntables++;
+	if (t > OPTABLE_MAXINDEX)
+		fatal(EX_SOFTWARE, "too many opcode decode tables");
+
+	ot->hashes[t] = hash;
+	if (entries != NULL)
+		memcpy(ot->tables[t], entries, sizeof(ot->tables[t]));
+
+	return t;
+}
+
+
+/*!
+ * optable_lookup() - Decode the opcode or prefix at the start of a string
+ *		      of instruction text.
+ *
+ *	@param	isa	The instruction set to decode the text as.
+ *
+ *	@param	keyptr	Pointer to OPKEY_LEN bytes of instruction text.
+ *
+ *	@return	the opcode or prefix matching the text.
+ *
+ *	@pre	optable_compile() has been called for \a isa.
+ */
+struct OpTreeNode *
+optable_lookup(isa_t isa, const void *keyptr)
+{
+	const struct OpTable *ot = &optable[isa];
+	const uint8_t *text = keyptr;
+	optable_entry_t entry;
+
+	assert(ot->tables != NULL);
+
+	entry = ot->tables[0][*text];
+	while ((entry & OPTABLE_NEXT) != 0) {
+		text++;
+		entry = ot->tables[entry & ~OPTABLE_NEXT][*text];
+	}
+
+	return ot->nodes[entry];
+}
@@ -26,11 +26,12 @@
  * $kbyanc: dyntrace/dyntrace/optree.c,v 1.15 2005/04/27 04:32:14 kbyanc Exp $
  */
 
-#include <libxml/xmlreader.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
 #include <libxml/xmlwriter.h>
 
 #include <assert.h>
-#include <ctype.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdbool.h>
@@ -40,11 +41,8 @@
 #include <sysexits.h>
 #include <unistd.h>
 
-#if defined(__FreeBSD__) && __FreeBSD__ >= 5
-#include <arpa/inet.h>	/* for htonl() */
-#endif
-
 #include "dyntrace.h"
+#include "optree.h"
 #include "radix.h"
 
 /*!
@@ -61,170 +59,361 @@
  * Gary R. Wright and W. Richard Stevens. TCP/IP Illustrated, Volume 2:
  * The Implementation, chapter 18.
  *
+ * A separate radix tree is kept for each instruction set architecture (see
+ * isa_t) since the same bytes decode differently in, say, IA-32 and amd64
+ * 64-bit mode.  Each opcode list file declares which ISA it describes via
+ * the isa attribute of its root element and is loaded into the corresponding
+ * tree.  Each ISA also has its own prefix index (prefix_index[isa]), so
+ * an ISA's prefixes can use all MAX_PREFIXES bits of a counter's prefix
+ * mask.  Prefix identifiers are therefore only unique within an ISA; they
+ * are kept unambiguous in the output by tagging each <prefix> element, and
+ * each region of instructions from an ISA other than IA-32, with the ISA
+ * they belong to.
+ *
+ * The radix trees are only used to build the opcode sets (detecting
+ * duplicate bit strings) and to enumerate them for output.  Once all opcode
+ * lists are loaded, optree_compile() flattens each tree into byte-indexed
+ * decode tables (see optable.c) which are used to identify instructions
+ * while tracing.  Alternatively, a brute-force scan decoder (see opscan.c)
+ * or the radix trees themselves can be used; optree_set_decoder() selects
+ * the decoder engine and optree_set_checker() names a second engine to
+ * check it against on every instruction.
+ *
+ */
+
+
+/*
+ * Number of bytes of instruction text to fetch at a time.  Each lookup
+ * examines OPKEY_LEN bytes and an x86 instruction's prefixes occupy at most
+ * OPKEY_LEN - 1 bytes, so this (2 * OPKEY_LEN - 1, rounded up) is enough to
+ * decode any instruction from a single fetch.
+ */
+#define	TEXT_FETCH_LEN		32
+
+/*
+ * Instructions following a newly-decoded one in a read-only text region are
+ * decoded ahead of time up to the end of the page of this size.
+ */
+#define	PREDECODE_PAGE		4096
+
+/*
+ * Maximum number of instruction keys optree_benchmark() decodes, and the
+ * total number of lookups to time for each decoder.
+ */
+#define	BENCHMARK_KEYS		(1 << 16)
+#define	BENCHMARK_LOOKUPS	(1 << 22)
+
+/*
+ * Cycle histograms have a bucket per power of two, each divided into
+ * 2^histogram_bits linear sub-buckets (as in HDR histograms), with values
+ * less than 2^histogram_bits counted exactly.  Cycle counts are 32 bits,
+ * so there are (33 - bits) << bits buckets.
+ */
+#define	HISTOGRAM_MAXBITS	7
+#define	HISTOGRAM_BUCKETS(bits)	((33 - (bits)) << (bits))
+
+/*
+ * Sequences of consecutively executed instructions counted when n-gram
+ * statistics are enabled (see optree_set_ngrams()): pairs up to sequences
+ * of NGRAM_MAX instructions.
  */
+#define	NGRAM_MAX		3
+
+/* Identification of instruction corpus files. */
+#define	CORPUS_MAGIC		"dtcorps"
+#define	CORPUS_VERSION		1
 
 
 /*!
- * @struct bitval
- *
- * Data structure representing a string of bits up to 32 bits long.  Used as a
- * key for radix tree lookups so the first byte must include the length of the
- * structure in bytes (simulating a BSD sockaddr structure for which the radix
- * code was originally designed).  Furthermore, the bit string itself is
- * aligned on a word boundary to improve performance.  There will likely be
- * compiler-added padding between the len and val members.
- *
- *	@param	len		Length of the structure in bytes. 
- *				Same as sizeof(struct bitval).
+ * @struct nodelist
  *
- *	@param	val		Storage for bit string.  Aligned to word
- *				boundary to allow for fast word-sized access.
+ *	Growable array of opcode tree nodes, populated by optree_collect().
  */
-struct bitval {
-	uint8_t		 len;
-	uint32_t	 val;		/* XXX Should be uint_fast32_t. */
+struct nodelist {
+	struct OpTreeNode **nodes;
+	uint		 n;
+	uint		 size;
 };
 
 
 /*!
- * @struct OpTreeNode
+ * @struct sample
  *
- * Data structure representing a single opcode.  This is used as an entry in
- * the radix tree so the first 2 fields must be pointers to radix tree nodes
- * (simulating a BSD rtentry structure).
+ *	Instruction text recorded by optree_update() for optree_benchmark().
  */
-struct OpTreeNode {
-	struct radix_node rn[2];
-	struct bitval	 match; 
-	struct bitval	 mask;
-	enum { OPCODE, PREFIX } type;
+struct sample {
+	isa_t		 isa;
+	uint8_t		 key[OPKEY_LEN];
 };
 
 
-typedef uint prefixmask_t;
-#define	PREFIXMASK_EMPTY	0
-#define	MAX_PREFIXES		(sizeof(prefixmask_t) * 8)
-
-struct Prefix {
-	struct OpTreeNode node;
-
-	uint8_t		 len;
-	uint8_t		 id;
-	prefixmask_t	 mask;
-	char		*bitmask;
-	char		*detail;
+/*!
+ * @struct corpus_header
+ *
+ *	Header of an instruction corpus file written by optree_corpus_save().
+ *	The header is followed by nsamples records, each one byte holding
+ *	the instruction set followed by keylen bytes of instruction text.
+ *	The fields are in host byte order.
+ */
+struct corpus_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 keylen;
+	uint32_t	 nsamples;
+	uint32_t	 reserved;
 };
 
 
 /*!
- * @struct counter
- *
- *	Each opcode has a list of counters per memory region type.  Each
- *	counter in the list represents the usage count and timing for the
- *	opcode with a given set of prefixes.  Since the most common case
- *	is an opcode unadorned with prefix bytes, the first counter in the
- *	list is embedded within the opcode structure itself and has a nul
- *	prefix mask.
- *
- *	@param	next		Pointer to next counter in list.
- *
- *	@param	prefixmask	Prefix mask this counter is for.
+ * @struct ngram
  *
- *	@param	count		The number of times the opcode has been
- *				executed with our list of prefixes.
- *
- *	@param	cycles_total	The total number of CPU cycles accumulated
- *				across all executions.
- *
- *	@param	cycles_min	The minimum number of CPU cycles for any
- *				single execution.
- *
- *	@param	cycles_max	The maximum number of CPU cycles for any
- *				single execution.
+ *	Number of times a sequence of instructions was executed, identified
+ *	by the counters of its instructions, oldest first.  Sequences shorter
+ *	than NGRAM_MAX have the trailing identifiers zero.
  */
-struct counter {
-	struct counter	*next;
-	prefixmask_t	 prefixmask;
-
+struct ngram {
+	uint32_t	 id[NGRAM_MAX];
 	uint64_t	 n;
-	uint64_t	 cycles_total;
-	uint		 cycles_min;
-	uint		 cycles_max;
 };
 
 
 /*!
- * @struct Opcode
+ * @struct object_use
+ *
+ *	Instruction sets each object's instructions were executed in, and
+ *	the type of the region the first of them was executed in, which is
+ *	reported as the type of the object.
+ */
+struct object_use {
+	bool		 isa[NUMISAS];
+	region_type_t	 regiontype;
+};
+
+
+/*
+ * Classes of opcodes by operand kind, totalled per region in the output.
  */
-struct Opcode {
-	struct OpTreeNode node;
+enum opclass {
+	OPCLASS_LOAD,
+	OPCLASS_STORE,
+	OPCLASS_RMW,
+	OPCLASS_REGISTER,
+	OPCLASS_SINGLEREG,
+	OPCLASS_IMMEDIATE,
+	OPCLASS_OTHER,
+	OPCLASS_SIMD,		/* Overlaps the classes above. */
+	NUMOPCLASSES
+};
 
-	struct counter	 count_head[NUMREGIONTYPES];
-	struct counter	*count_end[NUMREGIONTYPES];
+/*!
+ * @struct print_walk
+ *
+ *	Totals per class (see opclass_of()) and per extension accumulated
+ *	while writing a region's counters.
+ */
+struct print_walk {
+	uint64_t	 n[NUMOPCLASSES];
+	uint64_t	 cycles[NUMOPCLASSES];
+	uint64_t	 ext_n[NUMOPEXTS];
+	uint64_t	 ext_cycles[NUMOPEXTS];
+};
 
-	char		*bitmask;
-	char		*mnemonic;
-	char		*detail;
+static const char * const opclass_name[NUMOPCLASSES] = {
+	"load", "store", "rmw", "reg-reg", "reg", "immediate", "other",
+	"simd"
 };
 
 
-static struct radix_node_head *op_rnh = NULL;
-static struct Prefix prefix_index[MAX_PREFIXES];
-static uint	 prefix_count = 0;
+static struct radix_node_head *op_rnh[NUMISAS];
+static arena_t	 op_arena;		/* Opcodes, for the process's life. */
+static struct Opcode *vex_op[NUMISAS][NUMOPEXTS];
+static bool	 op_loaded[NUMISAS];
+static struct Prefix prefix_index[NUMISAS][MAX_PREFIXES];
+static uint	 prefix_count[NUMISAS];	/* Prefix masks are per ISA. */
 static xmlTextWriterPtr writer = NULL;
 static int	 writer_fd = -1;
-static bool	 region_type_use[NUMREGIONTYPES];
+static bool	 region_type_use[NUMISAS][NUMREGIONTYPES];
+static struct object_use *object_use = NULL;	/* Indexed by object - 1. */
+static uint	 nobject_use = 0;
+static bool	 optree_initialized = false;
+static struct sample *samples = NULL;
+static uint	 nsamples = 0;
+static uint	 maxsamples = 0;
+static bool	 verify_lengths = false;
+static uint64_t	 verify_agreed = 0;
+static uint64_t	 verify_disagreed = 0;
+static uint64_t	 verify_undecodable = 0;
+static struct counter *counters = NULL;	/* Indexed by identifier - 1. */
+static uint32_t	 ncounters = 0;
+static uint32_t	 maxcounters = 0;
+static uint32_t	*counter_hash = NULL;	/* Counter identifiers, or zero. */
+static uint32_t	 counter_hash_size = 0;	/* Power of two. */
+static uint32_t	*counter_order = NULL;	/* Sorted by counter_sort(). */
+static uint64_t	*histograms = NULL;	/* Indexed by (id - 1) * buckets. */
+static uint32_t	 nhistograms = 0;
+static uint32_t	 maxhistograms = 0;
+static uint	 histogram_bits = 0;
+static uint	 ngram_top = 0;		/* Reported per region; 0 = off. */
+static uint32_t	 ngram_history[NGRAM_MAX - 1];	/* Newest last. */
+static struct ngram *ngrams = NULL;	/* Indexed by identifier - 1. */
+static uint32_t	 nngrams = 0;
+static uint32_t	 maxngrams = 0;
+static uint32_t	*ngram_hash = NULL;	/* N-gram identifiers, or zero. */
+static uint32_t	 ngram_hash_size = 0;	/* Power of two. */
+static uint32_t	*ngram_order = NULL;	/* Sorted by ngram_sort(). */
+static struct Opcode **op_order[NUMISAS];	/* Set by optree_number(). */
+static uint	 nop_order[NUMISAS];
+static uint64_t	 decode_hits = 0;
+static uint64_t	 decode_misses = 0;
+static uint64_t	 predecoded = 0;
 
 
 static void	 optree_init(void);
-static bool	 optree_insert(struct OpTreeNode *op);
-static struct OpTreeNode *optree_lookup(const void *keyptr);
-static int	 optree_print_node(struct radix_node *rn, void *arg);
+static bool	 optree_insert(isa_t isa, struct OpTreeNode *op);
+static struct OpTreeNode *optree_lookup(isa_t isa, const void *keyptr);
+static void	 optree_collect(isa_t isa, struct nodelist *list);
+static int	 optree_collect_node(struct radix_node *rn, void *arg);
+static xmlTextWriterPtr optree_writer_new(int fd, const char *filepath);
+static void	 optree_write(const char *filepath, bool hotspots);
+static void	 optree_write_hotspots(void);
+static void	 optree_use_object(isa_t isa, region_type_t regiontype,
+				   uint object);
+static void	 optree_number(void);
+static void	 optree_print_region(isa_t isa, region_type_t regiontype,
+				     uint object);
+static void	 optree_print_counter(struct print_walk *walk,
+				      const struct Opcode *op,
+				      const struct counter *c);
+static void	 optree_print_classes(const struct print_walk *walk);
+static void	 optree_print_extensions(const struct print_walk *walk);
+static void	 optree_print_ngrams(isa_t isa, uint bucket);
+static void	 optree_print_hotspots(void);
+static enum opclass opclass_of(uint8_t args);
+
+static void	 optree_parse_entry(isa_t isa, const struct oplist_entry *ent,
+				    void *arg);
+static bool	 optree_add(isa_t isa, const struct oplist_entry *ent);
 
 static struct Opcode *opcode_alloc(void);
-static void	 opcode_parse(xmlNode *node);
-static void	 opcode_free(struct Opcode **opp);
+static bool	 opcode_add(isa_t isa, const struct oplist_entry *ent);
+
+static void	 optree_verify_length(target_t targ, region_t region,
+				      isa_t isa, vm_offset_t pc);
+static struct counter *optree_decode(target_t targ, region_t region,
+				      isa_t isa, vm_offset_t pc, bool execute,
+				      uint *lenp, uint *flagsp);
+static void	 optree_predecode(target_t targ, region_t region, isa_t isa,
+				  vm_offset_t pc);
+static void	 counter_add(struct counter *c, uint cycles);
+static uint	 histogram_bucket(uint cycles);
+static uint	 histogram_value(uint bucket);
+static uint	 histogram_percentile(const struct counter *c, uint percent);
+static uint32_t	 counter_id(struct counter *c);
+static uint	 counter_bucket(region_type_t regiontype, uint object);
+static uint32_t	 counter_hashval(const struct Opcode *op, uint bucket,
+				 prefixmask_t prefixmask);
+static struct counter *counter_find(struct Opcode *op, uint bucket,
+				    prefixmask_t prefixmask, bool create);
+static void	 counter_rehash(void);
+static void	 counter_sort(void);
+static int	 counter_compare(const void *a, const void *b);
+static void	 ngram_add(uint32_t id);
+static void	 ngram_count(const uint32_t *key);
+static uint32_t	 ngram_hashval(const uint32_t *key);
+static void	 ngram_rehash(void);
+static void	 ngram_sort(void);
+static int	 ngram_compare(const void *a, const void *b);
+static uint	 ngram_len(const struct ngram *ng);
 
 static const char *prefix_string(prefixmask_t prefixmask);
-static void	 prefix_parse(xmlNode *node);
-static void	 prefix_free(struct Prefix **prefixp);
+static bool	 prefix_add(isa_t isa, const struct oplist_entry *ent);
+
 
-static void	 parse_bitmask(const char *bitstr,
-			       uint32_t *mask, uint32_t *match);
+/*
+ * The decoder engines.  The radix tree must be first as it is the reference
+ * the others are checked against by optree_benchmark().
+ */
+static struct decoder decoders[] = {
+	{ "radix", NULL,	    optree_lookup,  oplen_decode, false },
+	{ "table", optable_compile, optable_lookup, oplen_decode, false },
+	{ "scan",  opscan_compile,  opscan_lookup,  oplen_decode, false },
+	{ NULL,	   NULL,	    NULL,	    NULL,	  false }
+};
+
+static struct decoder *optree_decoder = &decoders[1];	/* table */
+static struct decoder *optree_checker = NULL;
+
+static struct decoder *optree_find_decoder(const char *name);
+static void	 optree_init_decoder(struct decoder *d);
+static void	 optree_check(isa_t isa, vm_offset_t pc, const uint8_t *text,
+			      size_t textlen, struct OpTreeNode *node);
+static const char *optree_node_name(const struct OpTreeNode *node);
 
 
 
 /*!
- * optree_init() - Initialize radix tree routines for use as opcode lookup tree.
+ * optree_init() - Initialize radix tree routines for use as opcode lookup
+ *		   trees.
  */
 void
 optree_init(void)
 {
 	struct Opcode *op;
+	opext_t ext;
+	isa_t isa;
 
-	assert(op_rnh == NULL);
+	assert(!optree_initialized);
+	optree_initialized = true;
 
 	/*
 	 * Set the maximum key length and initialize the radix tree library.
-	 * Tell rn_inithead() at which byte offset to find significant key
-	 * bits.
 	 */
 	max_keylen = sizeof(struct bitval);
 	rn_init();
-	rn_inithead((void **)&op_rnh, offsetof(struct bitval, val));
 
-	assert(op_rnh != NULL);
+	op_arena = arena_new();
 
-	/*
-	 * Add a catch-all default opcode entry.
-	 */
-	op = opcode_alloc();
-	op->bitmask = strdup("");
-	op->mnemonic = strdup("(unknown)");
-	op->detail = NULL;
-	op->node.match.len = op->node.mask.len = 0;
-	op_rnh->rnh_addaddr(&op->node.match, &op->node.mask, op_rnh,
-			    (void *)op);
+	for (isa = 0; isa < NUMISAS; isa++) {
+		/*
+		 * Tell rn_inithead() at which byte offset to find significant
+		 * key bits.
+		 */
+		op_rnh[isa] = NULL;
+		rn_inithead((void **)&op_rnh[isa],
+			    offsetof(struct bitval, val));
+
+		assert(op_rnh[isa] != NULL);
+
+		/*
+		 * Add a catch-all default opcode entry.
+		 */
+		op = opcode_alloc();
+		op->bitmask = "";
+		op->mnemonic = "(unknown)";
+		op->detail = NULL;
+		op->node.match.len = op->node.mask.len = 0;
+		op_rnh[isa]->rnh_addaddr(&op->node.match, &op->node.mask,
+					 op_rnh[isa], (void *)op);
+
+		/*
+		 * The opcode lists do not describe VEX or EVEX encoded
+		 * instructions, but the length decoder recognizes them.
+		 * Count them against separate unknown opcodes, one for each
+		 * AVX extension, which are not in the tree.
+		 */
+		for (ext = OPEXT_AVX128; ext <= OPEXT_AVX512; ext++) {
+			op = opcode_alloc();
+			op->bitmask = "";
+			op->mnemonic = "(unknown)";
+			op->detail = (ext == OPEXT_AVX128) ? "VEX.128" :
+				     (ext == OPEXT_AVX256) ? "VEX.256" : "EVEX";
+			op->extension = ext;
+			op->node.match.len = op->node.mask.len = 0;
+			vex_op[isa][ext] = op;
+		}
+
+		op_loaded[isa] = false;
+	}
 
 	/* Clear our per-region use flags. */
 	memset(region_type_use, 0, sizeof(region_type_use));
@@ -234,22 +423,24 @@ optree_init(void)
 /*!
  * optree_insert() - Add opcode to tree.
  *
+ *	@param	isa		Instruction set whose tree to add the node to.
+ *
  *	@param	node		Pointer to node to add to tree.
  *
  *	@return	Boolean indicating whether or not the opcode was successfully
  *		added to the tree.
  */
 bool
-optree_insert(struct OpTreeNode *node)
+optree_insert(isa_t isa, struct OpTreeNode *node)
 {
+	struct radix_node_head *rnh = op_rnh[isa];
 	struct radix_node *rn;
 	struct OpTreeNode *xnode;
 
 	assert(node->match.len == sizeof(node->match) &&
 	       node->mask.len == sizeof(node->mask));
 
-	rn = op_rnh->rnh_addaddr(&node->match, &node->mask, op_rnh,
-				 (void *)node);
+	rn = rnh->rnh_addaddr(&node->match, &node->mask, rnh, (void *)node);
 	if (rn != NULL)
 		return true;
 
@@ -259,7 +450,7 @@ optree_insert(struct OpTreeNode *node)
 	 * node it is so we can inform the user.
 	 */
 
-	xnode = optree_lookup(&node->match.val);
+	xnode = optree_lookup(isa, node->match.val);
 	assert (xnode != NULL && xnode != node);
 
 #ifdef XXXX
@@ -278,301 +469,1955 @@ optree_insert(struct OpTreeNode *node)
  *
  *	
  *
+ *	@param	isa		Instruction set to decode the key as.
+ *
  *	@param	keyptr		Pointer to XXX.
  *
  */
 struct OpTreeNode *
-optree_lookup(const void *keyptr)
+optree_lookup(isa_t isa, const void *keyptr)
 {
+	struct radix_node_head *rnh = op_rnh[isa];
 	struct bitval key;
 	struct OpTreeNode *op;
 
 	key.len = sizeof(key);
-	memcpy(&key.val, keyptr, sizeof(key.val));
+	memcpy(key.val, keyptr, sizeof(key.val));
 
-	op = (struct OpTreeNode *)op_rnh->rnh_lookup(&key, NULL, op_rnh);
+	op = (struct OpTreeNode *)rnh->rnh_lookup(&key, NULL, rnh);
 	return op;
 }
 
 
-void
-optree_update(target_t targ, region_t region, vm_offset_t pc, uint cycles)
+/*!
+ * optree_isa_loaded() - Determine whether opcodes have been loaded for an
+ *			 instruction set.
+ *
+ *	@param	isa		The instruction set to check.
+ *
+ *	@return	boolean true if an opcode list describing \a isa has been
+ *		loaded by optree_parsefile().
+ */
+bool
+optree_isa_loaded(isa_t isa)
 {
-	struct OpTreeNode *node;
-	struct Prefix *prefix;
-	struct Opcode *op;
-	struct counter *c;
-	region_type_t regiontype;
-	prefixmask_t prefixmask = PREFIXMASK_EMPTY;
-	uint32_t text;
-
-	assert(region != NULL);
-
-	regiontype = region_get_type(region);
-	assert(regiontype < NUMREGIONTYPES);
-
-	region_type_use[regiontype] = true;
 
-	/*
-	 * First, build mask of all prefixes before the opcode.
-	 */
-	for (;;) {
-		text = 0;
-		region_read(targ, region, pc, &text, sizeof(text));
-
-		node = optree_lookup(&text);
-		assert(node != NULL);
-		if (node->type != PREFIX)
-			break;
+	assert(isa < NUMISAS);
+	return optree_initialized && op_loaded[isa];
+}
 
-		prefix = (struct Prefix *)node;
 
-		pc += prefix->len;
-		prefixmask |= prefix->mask;
-	}
+/*!
+ * optree_compile() - Initialize the selected decoder engines for all
+ *		      instruction sets.
+ *
+ *	Must be called after all opcode lists have been loaded and before
+ *	the first call to optree_update().
+ */
+void
+optree_compile(void)
+{
+	if (!optree_initialized)
+		optree_init();
 
-	assert(node->type == OPCODE);
-	op = (struct Opcode *)node;
+	optree_init_decoder(optree_decoder);
+	if (optree_checker != NULL)
+		optree_init_decoder(optree_checker);
+}
 
-	/*
-	 * Locate the counter to update by its prefix mask.
-	 */
-	for (c = &op->count_head[regiontype]; c != NULL; c = c->next) {
-		if (c->prefixmask == prefixmask)
-			break;
-	}
 
-	/*
-	 * If there is no existing counter for the current prefix mask,
-	 * append a new counter to the end of the list.
-	 */
-	if (c == NULL) {
-		c = calloc(1, sizeof(*c));
-		if (c == NULL)
-			fatal(EX_OSERR, "malloc: %m");
-		op->count_end[regiontype]->next = c;
-		c->next = NULL;
-		c->prefixmask = prefixmask;
-	}
+/*!
+ * optree_init_decoder() - Initialize a decoder engine for all instruction
+ *			   sets, if it has not been already.
+ */
+void
+optree_init_decoder(struct decoder *d)
+{
+	struct nodelist list;
+	isa_t isa;
 
-	c->n++;
-	if (c->n == 1) {
-		c->cycles_total = c->cycles_min = c->cycles_max = cycles;
-	}
-	else {
-		c->cycles_total += cycles;
-		if (cycles < c->cycles_min)
-			c->cycles_min = cycles;
-		else if (cycles > c->cycles_max)
-			c->cycles_max = cycles;
-	}
+	if (d->initialized)
+		return;
 
-	/*
-	 * Warn about instructions which match the default opcode.
-	 * In order to reduce verbosity, we only print the warning when
-	 * the current program counter differs from the last program counter
-	 * at which we found an unknown opcode.
-	 */
-	if (op->node.match.len == 0) {
-		static vm_offset_t prevpc = 0;
-		if (pc != prevpc) {
-			warn("unknown opcode at pc 0x%08x: 0x%08x", pc, text);
-			prevpc = pc;
+	if (d->init != NULL) {
+		for (isa = 0; isa < NUMISAS; isa++) {
+			optree_collect(isa, &list);
+			d->init(isa, list.nodes, list.n, optree_lookup);
+			free(list.nodes);
 		}
 	}
+
+	d->initialized = true;
 }
 
 
+/*!
+ * optree_collect() - Build an array of all opcodes and prefixes in an
+ *		      instruction set's opcode tree.
+ *
+ *	@param	isa	The instruction set whose tree to enumerate.
+ *
+ *	@param	list	Node list to populate.  The caller is responsible
+ *			for freeing list->nodes.
+ */
 void
-optree_output_open(void)
+optree_collect(isa_t isa, struct nodelist *list)
 {
-	xmlOutputBufferPtr out;
-
-	assert(opt_outfile != NULL);
-	assert(writer == NULL);
+	struct radix_node_head *rnh = op_rnh[isa];
 
-	/*
-	 * Open the output file for writing.  We keep the output file open
-	 * across multiple calls, overwriting the contents of the file each
-	 * time we are called (e.g. checkpointing).  We only truncate the
-	 * output file when we first open the file, after that the file can
-	 * only get longer each time we write it as we either find new
-	 * instructions or the instruction counts grow.
-	 */
-	if (writer_fd < 0) {
-		writer_fd = open(opt_outfile, O_WRONLY|O_CREAT|O_TRUNC, 0666);
-		if (writer_fd < 0) {
-			fatal(EX_OSERR, "unable to open %s for writing: %m",
-			      opt_outfile);
-		}
-	}
+	list->n = 0;
+	list->size = 1024;
+	list->nodes = malloc(list->size * sizeof(*list->nodes));
+	if (list->nodes == NULL)
+		fatal(EX_OSERR, "malloc: %m");
 
-	lseek(writer_fd, 0, SEEK_SET);
+	rnh->rnh_walktree(rnh, optree_collect_node, list);
+}
 
-	out = xmlOutputBufferCreateFd(writer_fd, NULL);
-	if (out == NULL) {
-		fatal(EX_CANTCREAT, "unable to open %s for writing: %m",
-		      opt_outfile);
-	}
 
-	writer = xmlNewTextWriter(out);
-	if (writer == NULL) {
-		xmlOutputBufferClose(out);
-		fatal(EX_CANTCREAT, "unable to open %s for writing: %m",
-		      opt_outfile);
+int
+optree_collect_node(struct radix_node *rn, void *arg)
+{
+	struct nodelist *list = arg;
+
+	if (list->n == list->size) {
+		list->size *= 2;
+		list->nodes = realloc(list->nodes,
+				      list->size * sizeof(*list->nodes));
+		if (list->nodes == NULL)
+			fatal(EX_OSERR, "realloc: %m");
 	}
 
-	xmlTextWriterSetIndent(writer, 4);
+	list->nodes[list->n++] = (struct OpTreeNode *)rn;
+	return 0;
 }
 
 
-void
-optree_output(void)
+/*!
+ * optree_set_decoder() - Select the decoder used to identify instructions.
+ *
+ *	@param	name	Name of the decoder; one of "radix", "table" or
+ *			"scan".
+ *
+ *	@return	true if the decoder was selected, false if there is no
+ *		decoder by that name.
+ */
+bool
+optree_set_decoder(const char *name)
 {
-	const struct Prefix *prefix;
-	region_type_t regiontype;
-	uint i;
+	struct decoder *d;
 
-	assert(writer != NULL);
-
-	if (xmlTextWriterStartDocument(writer, NULL, "utf-8", NULL) < 0)
-		fatal(EX_IOERR, "failed to write to %s: %m", opt_outfile);
+	d = optree_find_decoder(name);
+	if (d == NULL)
+		return false;
 
-	xmlTextWriterStartElement(writer, "dyntrace");
+	optree_decoder = d;
+	return true;
+}
 
-	/* First, output a list of prefixes. */
-	for (i = 0; i < prefix_count; i++) {
-		prefix = &prefix_index[i];
-		xmlTextWriterStartElement(writer, "prefix");
-		xmlTextWriterWriteAttribute(writer, "id",
-					    prefix_string(prefix->mask));
-		xmlTextWriterWriteAttribute(writer, "bitmask", prefix->bitmask);
-		xmlTextWriterWriteAttribute(writer, "detail", prefix->detail);
-		xmlTextWriterEndElement(writer /* prefix */);
-	}
 
-	xmlTextWriterStartElement(writer, "program");
-	xmlTextWriterWriteAttribute(writer, "name", "N/A");	/* XXX */
+/*!
+ * optree_set_checker() - Select a decoder to check the results of the
+ *			  selected decoder against.
+ *
+ *	@param	name	Name of the decoder; one of "radix", "table" or
+ *			"scan".
+ *
+ *	@return	true if the decoder was selected, false if there is no
+ *		decoder by that name.
+ *
+ *	Every instruction executed is decoded by both decoders rather than
+ *	being looked up in the decode caches.  Any disagreement between
+ *	them is fatal.
+ */
+bool
+optree_set_checker(const char *name)
+{
+	struct decoder *d;
 
-	/*
-	 * Iterate through the region types, outputting the opcodes in each
-	 * region.
-	 */
-	for (regiontype = 0; regiontype < NUMREGIONTYPES; regiontype++) {
+	d = optree_find_decoder(name);
+	if (d == NULL)
+		return false;
 
-		if (!region_type_use[regiontype])
-			continue;
+	optree_checker = d;
+	return true;
+}
 
-		xmlTextWriterStartElement(writer, "region");
-		xmlTextWriterWriteAttribute(writer, "type",
-					    region_type_name[regiontype]);
 
-		op_rnh->rnh_walktree(op_rnh, optree_print_node, &regiontype);
+/*!
+ * optree_find_decoder() - Internal routine to look up a decoder engine by
+ *			   name.
+ *
+ *	@return	the decoder or NULL if there is no decoder by that name.
+ */
+struct decoder *
+optree_find_decoder(const char *name)
+{
+	struct decoder *d;
 
-		xmlTextWriterEndElement(writer /* "region */);
+	for (d = decoders; d->name != NULL; d++) {
+		if (strcmp(d->name, name) == 0)
+			return d;
 	}
 
-	xmlTextWriterEndElement(writer /* "program" */);
-	xmlTextWriterEndElement(writer /* "dyntrace" */);
-	xmlTextWriterEndDocument(writer);
-	xmlFreeTextWriter(writer);
-
-	writer = NULL;
-
-	/* Ensure the results are written to disk. */
-	fsync(writer_fd);
+	return NULL;
 }
 
 
+/*!
+ * optree_node_name() - Internal routine to name an opcode or prefix in
+ *			diagnostics.
+ */
 const char *
-prefix_string(prefixmask_t prefixmask)
+optree_node_name(const struct OpTreeNode *node)
 {
-	static char buffer[100];
-	size_t len;
-	prefixmask_t checkmask;
-	int id;
+	const struct Prefix *prefix;
 
-	/* No instruction prefix is the most common case. */
-	if (prefixmask == 0)
-		return "";
+	if (node->type == OPCODE)
+		return ((const struct Opcode *)node)->mnemonic;
 
-	len = 0;
+	prefix = (const struct Prefix *)node;
+	return (prefix->detail != NULL) ? prefix->detail : "prefix";
+}
 
-	for (id = 0, checkmask = 1; prefixmask != 0; id++, checkmask <<= 1) {
-		char idstr[3] = { 'A', '\0', '\0' };
-		size_t idstrlen = 1;
 
-		if ((prefixmask & checkmask) == 0)
-			continue;
-		prefixmask &= ~checkmask;
+/*!
+ * optree_check() - Internal routine to check the selected decoder's result
+ *		    against the checking decoder.
+ *
+ *	@param	isa	Instruction set the instruction is executed in.
+ *
+ *	@param	pc	Address of the instruction text.
+ *
+ *	@param	text	The instruction text; at least OPKEY_LEN bytes.
+ *
+ *	@param	textlen	Number of bytes of \a text fetched from the target.
+ *
+ *	@param	node	The opcode or prefix identified by the selected
+ *			decoder.
+ */
+void
+optree_check(isa_t isa, vm_offset_t pc, const uint8_t *text, size_t textlen,
+	     struct OpTreeNode *node)
+{
+	struct OpTreeNode *expect;
+	uint len, expectlen;
+	uint flags;
+	char hex[OPKEY_LEN * 2 + 1];
+	uint i;
 
-		if (id < 26)
-			idstr[0] += id;
-		else {
-			idstr[1] = 'A' + id - 26;
-			idstrlen++;
+	expect = optree_checker->lookup(isa, text);
+	len = optree_decoder->len(isa, text, textlen, &flags);
+	expectlen = optree_checker->len(isa, text, textlen, &flags);
+	if (node == expect && len == expectlen)
+		return;
+
+	for (i = 0; i < OPKEY_LEN; i++)
+		sprintf(hex + i * 2, "%02x", text[i]);
+
+	if (node != expect) {
+		fatal(EX_SOFTWARE, "%s and %s decoders disagree at pc %#jx: "
+		      "0x%s is %s vs. %s",
+		      optree_decoder->name, optree_checker->name,
+		      (uintmax_t)pc, hex, optree_node_name(node),
+		      optree_node_name(expect));
+	}
+
+	fatal(EX_SOFTWARE, "%s and %s decoders disagree at pc %#jx: "
+	      "0x%s is %u vs. %u bytes long", optree_decoder->name,
+	      optree_checker->name, (uintmax_t)pc, hex, len, expectlen);
+}
+
+
+/*!
+ * optree_benchmark_sample() - Record instruction text decoded while tracing
+ *			       for use by optree_benchmark().
+ *
+ *	Only the first BENCHMARK_KEYS keys are recorded.
+ */
+void
+optree_benchmark_sample(void)
+{
+
+	samples = calloc(BENCHMARK_KEYS, sizeof(*samples));
+	if (samples == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+	maxsamples = BENCHMARK_KEYS;
+}
+
+
+/*!
+ * optree_corpus_save() - Save the instruction text recorded while tracing
+ *			  to a corpus file.
+ *
+ *	@param	filepath	Path of the corpus file to write.
+ *
+ *	The corpus can be loaded with optree_corpus_load() to benchmark the
+ *	decoders on the same instructions later.
+ */
+void
+optree_corpus_save(const char *filepath)
+{
+	struct corpus_header hdr;
+	uint8_t isa;
+	FILE *fp;
+	uint i;
+
+	fp = fopen(filepath, "w");
+	if (fp == NULL)
+		fatal(EX_CANTCREAT, "failed to open %s: %m", filepath);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CORPUS_MAGIC, sizeof(hdr.magic));
+	hdr.version = CORPUS_VERSION;
+	hdr.keylen = OPKEY_LEN;
+	hdr.nsamples = nsamples;
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	for (i = 0; i < nsamples; i++) {
+		isa = samples[i].isa;
+		fwrite(&isa, sizeof(isa), 1, fp);
+		fwrite(samples[i].key, OPKEY_LEN, 1, fp);
+	}
+
+	if (ferror(fp) || fclose(fp) != 0)
+		fatal(EX_IOERR, "failed to write %s: %m", filepath);
+
+	debug("saved %u instructions to %s", nsamples, filepath);
+}
+
+
+/*!
+ * optree_corpus_load() - Load instruction text for optree_benchmark() from
+ *			  a corpus file written by optree_corpus_save().
+ *
+ *	@param	filepath	Path of the corpus file to read.
+ */
+void
+optree_corpus_load(const char *filepath)
+{
+	struct corpus_header hdr;
+	uint8_t isa;
+	FILE *fp;
+	uint i;
+
+	fp = fopen(filepath, "r");
+	if (fp == NULL)
+		fatal(EX_NOINPUT, "failed to open %s: %m", filepath);
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, CORPUS_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != CORPUS_VERSION || hdr.keylen != OPKEY_LEN)
+		fatal(EX_DATAERR, "%s: not an instruction corpus", filepath);
+
+	if (hdr.nsamples > BENCHMARK_KEYS)
+		hdr.nsamples = BENCHMARK_KEYS;
+
+	free(samples);
+	samples = calloc(hdr.nsamples + 1, sizeof(*samples));
+	if (samples == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+
+	for (i = 0; i < hdr.nsamples; i++) {
+		if (fread(&isa, sizeof(isa), 1, fp) != 1 ||
+		    fread(samples[i].key, OPKEY_LEN, 1, fp) != 1 ||
+		    isa >= NUMISAS)
+			fatal(EX_DATAERR, "%s: truncated or corrupt",
+			      filepath);
+		samples[i].isa = isa;
+	}
+	fclose(fp);
+
+	nsamples = maxsamples = hdr.nsamples;
+	debug("loaded %u instructions from %s", nsamples, filepath);
+}
+
+
+/*!
+ * optree_verify_lengths() - Check the instruction length decoder against
+ *			     the instructions executed while tracing.
+ *
+ *	The results are reported by optree_verify_report().
+ */
+void
+optree_verify_lengths(void)
+{
+
+	verify_lengths = true;
+}
+
+
+/*!
+ * optree_cache_report() - Report the effectiveness of the decode caches.
+ */
+void
+optree_cache_report(void)
+{
+	uint64_t lookups = decode_hits + decode_misses;
+
+	if (lookups == 0)
+		return;
+
+	debug("decode cache: %llu hits, %llu misses (%.1f%% hit rate), "
+	      "%llu instructions predecoded",
+	      (unsigned long long)decode_hits,
+	      (unsigned long long)decode_misses,
+	      decode_hits * 100.0 / lookups,
+	      (unsigned long long)predecoded);
+}
+
+
+/*!
+ * optree_verify_report() - Report the results of checking the instruction
+ *			    length decoder.
+ */
+void
+optree_verify_report(void)
+{
+
+	if (!verify_lengths)
+		return;
+
+	warn("instruction lengths: %llu agreed, %llu disagreed, "
+	     "%llu undecodable",
+	     (unsigned long long)verify_agreed,
+	     (unsigned long long)verify_disagreed,
+	     (unsigned long long)verify_undecodable);
+}
+
+
+/*!
+ * optree_verify_length() - Internal routine to check the length decoder
+ *			    against the instruction boundaries seen while
+ *			    single-stepping.
+ *
+ *	@param	targ	The target process.
+ *
+ *	@param	region	The memory region containing the instruction.
+ *
+ *	@param	isa	Instruction set the instruction is executed in.
+ *
+ *	@param	pc	Address of the instruction about to be executed.
+ *
+ *	Unless the previous instruction could have branched, the current
+ *	instruction is expected to start where the length decoder said the
+ *	previous one ended.  Repeated string instructions execute at the
+ *	same address until done so are only checked once they finish.
+ *	Signal delivery also moves the program counter and is reported as a
+ *	disagreement.
+ */
+void
+optree_verify_length(target_t targ, region_t region, isa_t isa,
+		     vm_offset_t pc)
+{
+	static uint8_t prevtext[OPKEY_LEN];
+	static vm_offset_t prevpc = 0;
+	static vm_offset_t nextpc = 0;
+	static uint prevlen = 0;
+	uint8_t text[OPKEY_LEN];
+	size_t textlen;
+	vm_offset_t end;
+	uint flags;
+
+	if (pc == prevpc)
+		return;
+
+	if (nextpc != 0) {
+		if (pc == nextpc)
+			verify_agreed++;
+		else {
+			char hex[OPKEY_LEN * 2 + 1];
+			uint i;
+
+			verify_disagreed++;
+			for (i = 0; i < OPKEY_LEN; i++)
+				sprintf(hex + i * 2, "%02x", prevtext[i]);
+			warn("instruction at pc %#jx decoded as %u bytes but "
+			     "followed by pc %#jx: 0x%s", (uintmax_t)prevpc,
+			     prevlen, (uintmax_t)pc, hex);
+		}
+	}
+
+	region_get_range(region, NULL, &end);
+
+	memset(text, 0, sizeof(text));
+	textlen = sizeof(text);
+	if (textlen > end - pc)
+		textlen = end - pc;
+	if (textlen > 0)
+		region_read(targ, region, pc, text, textlen);
+
+	prevpc = pc;
+	prevlen = optree_decoder->len(isa, text, textlen, &flags);
+	memcpy(prevtext, text, sizeof(prevtext));
+
+	if (prevlen == 0) {
+		verify_undecodable++;
+		nextpc = 0;
+	}
+	else if ((flags & OPLEN_BRANCH) != 0)
+		nextpc = 0;
+	else
+		nextpc = pc + prevlen;
+}
+
+
+/*!
+ * optree_benchmark() - Measure the speed of the opcode decoders.
+ *
+ *	Decodes a set of instruction keys with each decoder, reporting the
+ *	time taken per lookup and any keys a decoder identifies differently
+ *	than the radix tree on stderr.  If instruction text was recorded
+ *	while tracing (see optree_benchmark_sample()), that is decoded;
+ *	otherwise, random keys are built from the bit strings of the loaded
+ *	opcodes with their don't-care bits randomized.
+ *
+ *	@pre	optree_compile() has been called.
+ */
+void
+optree_benchmark(void)
+{
+	struct timeval start, stop;
+	struct decoder *d;
+	struct OpTreeNode *node;
+	struct nodelist list;
+	struct bitval *keys;
+	uintptr_t sink = 0;
+	uint64_t usecs, radix_usecs = 0;
+	uint mismatches;
+	uint nkeys, rounds;
+	uint i, k;
+	isa_t isa;
+
+	keys = malloc(BENCHMARK_KEYS * sizeof(*keys));
+	if (keys == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+
+	for (d = decoders; d->name != NULL; d++)
+		optree_init_decoder(d);
+
+	for (isa = 0; isa < NUMISAS; isa++) {
+		if (!op_loaded[isa])
+			continue;
+
+		nkeys = 0;
+		if (samples != NULL) {
+			for (i = 0; i < nsamples; i++) {
+				if (samples[i].isa != isa)
+					continue;
+				memcpy(keys[nkeys++].val, samples[i].key,
+				       OPKEY_LEN);
+			}
+		}
+		else {
+			optree_collect(isa, &list);
+
+			srandom(1);
+			for (i = 0; i < BENCHMARK_KEYS; i++) {
+				uint8_t *key = keys[i].val;
+
+				node = list.nodes[random() % list.n];
+				for (k = 0; k < OPKEY_LEN; k++) {
+					key[k] = random();
+					if (node->mask.len != 0) {
+						key[k] &= ~node->mask.val[k];
+						key[k] |= node->match.val[k];
+					}
+				}
+			}
+			nkeys = BENCHMARK_KEYS;
+			free(list.nodes);
+		}
+
+		if (nkeys == 0)
+			continue;
+		rounds = (BENCHMARK_LOOKUPS + nkeys - 1) / nkeys;
+
+		warn("%s: decoding %u %s instructions %u times", isa_name[isa],
+		     nkeys, (samples != NULL) ? "traced" : "random", rounds);
+
+		for (d = decoders; d->name != NULL; d++) {
+			/*
+			 * Every decoder must agree with the radix tree for
+			 * the comparison to be meaningful.
+			 */
+			mismatches = 0;
+			for (i = 0; i < nkeys; i++) {
+				if (d->lookup(isa, keys[i].val) !=
+				    optree_lookup(isa, keys[i].val))
+					mismatches++;
+			}
+			if (mismatches != 0) {
+				warn("%s: %s decoder disagrees on %u of %u "
+				     "instructions", isa_name[isa], d->name,
+				     mismatches, nkeys);
+			}
+
+			gettimeofday(&start, NULL);
+			for (k = 0; k < rounds; k++) {
+				for (i = 0; i < nkeys; i++) {
+					node = d->lookup(isa, keys[i].val);
+					sink += (uintptr_t)node;
+				}
+			}
+			gettimeofday(&stop, NULL);
+
+			usecs = (stop.tv_sec - start.tv_sec) * 1000000 +
+				(stop.tv_usec - start.tv_usec);
+			if (usecs == 0)
+				usecs = 1;
+			if (d == decoders)
+				radix_usecs = usecs;
+
+			warn("%s: %-5s %7.1f ns/lookup %7.1fM lookups/sec "
+			     "(%.1fx radix)", isa_name[isa], d->name,
+			     usecs * 1000.0 / ((uint64_t)nkeys * rounds),
+			     (double)nkeys * rounds / usecs,
+			     (double)radix_usecs / usecs);
+		}
+	}
+
+	/* Keep the compiler from optimizing the lookups away. */
+	debug("benchmark checksum %lx", (unsigned long)sink);
+
+	free(keys);
+}
+
+
+/*!
+ * counter_add() - Internal routine to count an execution of an instruction.
+ *
+ *	@param	c	The counter for the instruction's opcode, prefixes
+ *			and region type.
+ *
+ *	@param	cycles	Number of cycles the instruction took to execute.
+ */
+void
+counter_add(struct counter *c, uint cycles)
+{
+	uint64_t *hist;
+
+	c->n++;
+	if (c->n == 1) {
+		c->cycles_total = c->cycles_min = c->cycles_max = cycles;
+	}
+	else {
+		c->cycles_total += cycles;
+		if (cycles < c->cycles_min)
+			c->cycles_min = cycles;
+		else if (cycles > c->cycles_max)
+			c->cycles_max = cycles;
+	}
+
+	/*
+	 * The histogram is allocated when the counter first records any
+	 * cycles; every earlier execution must have taken none.
+	 */
+	if (c->hist == 0) {
+		if (cycles == 0)
+			return;
+		if (nhistograms == maxhistograms) {
+			maxhistograms = (maxhistograms == 0) ? 256 :
+					maxhistograms * 2;
+			histograms = realloc(histograms, maxhistograms *
+				HISTOGRAM_BUCKETS(histogram_bits) *
+				sizeof(*histograms));
+			if (histograms == NULL)
+				fatal(EX_OSERR, "realloc: %m");
+		}
+		c->hist = ++nhistograms;
+		hist = histograms + (c->hist - 1) *
+		       HISTOGRAM_BUCKETS(histogram_bits);
+		memset(hist, 0, HISTOGRAM_BUCKETS(histogram_bits) *
+		       sizeof(*hist));
+		hist[0] = c->n - 1;
+	}
+	else {
+		hist = histograms + (c->hist - 1) *
+		       HISTOGRAM_BUCKETS(histogram_bits);
+	}
+
+	hist[histogram_bucket(cycles)]++;
+}
+
+
+/*!
+ * histogram_bucket() - Internal routine to get the histogram bucket which
+ *			counts the given number of cycles.
+ */
+uint
+histogram_bucket(uint cycles)
+{
+	uint exp;
+
+	if (cycles < (1U << histogram_bits))
+		return cycles;
+
+	exp = 31 - __builtin_clz(cycles);
+	return ((exp - histogram_bits + 1) << histogram_bits) +
+	       ((cycles >> (exp - histogram_bits)) &
+		((1U << histogram_bits) - 1));
+}
+
+
+/*!
+ * histogram_value() - Internal routine to get the largest number of cycles
+ *		       counted by a histogram bucket.
+ */
+uint
+histogram_value(uint bucket)
+{
+	uint exp, sub;
+
+	if (bucket < (1U << histogram_bits))
+		return bucket;
+
+	exp = (bucket >> histogram_bits) + histogram_bits - 1;
+	sub = bucket & ((1U << histogram_bits) - 1);
+	return (((1U << histogram_bits) + sub) << (exp - histogram_bits)) +
+	       ((1U << (exp - histogram_bits)) - 1);
+}
+
+
+/*!
+ * histogram_percentile() - Internal routine to estimate a percentile of the
+ *			    cycles taken by a counter's executions.
+ *
+ *	@param	c	The counter, which must have a histogram.
+ *
+ *	@param	percent	The percentile to estimate.
+ *
+ *	@return	the largest number of cycles counted by the histogram bucket
+ *		holding the percentile, limited to the range of cycles
+ *		actually seen.  It is exact if the bucket counts a single
+ *		value.
+ */
+uint
+histogram_percentile(const struct counter *c, uint percent)
+{
+	const uint64_t *hist;
+	uint64_t rank, seen;
+	uint bucket, value;
+
+	assert(c->hist != 0);
+	hist = histograms + (c->hist - 1) * HISTOGRAM_BUCKETS(histogram_bits);
+
+	/* The rank of the percentile, counting from one. */
+	rank = (c->n * percent + 99) / 100;
+	if (rank == 0)
+		rank = 1;
+
+	seen = 0;
+	for (bucket = 0; bucket < HISTOGRAM_BUCKETS(histogram_bits) - 1;
+	     bucket++) {
+		seen += hist[bucket];
+		if (seen >= rank)
+			break;
+	}
+
+	value = histogram_value(bucket);
+	if (value > c->cycles_max)
+		value = c->cycles_max;
+	if (value < c->cycles_min)
+		value = c->cycles_min;
+	return value;
+}
+
+
+/*!
+ * optree_set_histogram_bits() - Set the precision of cycle histograms.
+ *
+ *	@param	bits	Number of bits of each cycle count which are kept
+ *			exactly; each power of two range of cycle counts is
+ *			divided into 2^bits buckets.
+ *
+ *	@return	true if the precision was set, false if it is out of range.
+ *
+ *	Must be called before tracing starts.  Each histogram takes
+ *	(33 - bits) * 2^bits * 8 bytes.
+ */
+bool
+optree_set_histogram_bits(uint bits)
+{
+
+	assert(nhistograms == 0);
+
+	if (bits > HISTOGRAM_MAXBITS)
+		return false;
+	histogram_bits = bits;
+	return true;
+}
+
+
+/*!
+ * counter_id() - Internal routine to get the identifier of a counter for
+ *		  the region decode caches.
+ *
+ *	@param	c	The counter to identify.
+ *
+ *	@return	the non-zero identifier; counters[id - 1] is \a c.
+ */
+uint32_t
+counter_id(struct counter *c)
+{
+
+	return c - counters + 1;
+}
+
+
+/*!
+ * counter_bucket() - Internal routine to get the bucket counters for
+ *		      instructions in a region are kept in.
+ *
+ *	@param	regiontype	Type of the region.
+ *
+ *	@param	object		Identifier of the region's object, or zero.
+ *
+ *	@return	the region type, or a bucket past all region types for
+ *		regions belonging to an object.
+ */
+uint
+counter_bucket(region_type_t regiontype, uint object)
+{
+
+	return (object == 0) ? regiontype : NUMREGIONTYPES + object - 1;
+}
+
+
+/*!
+ * counter_hashval() - Internal routine to hash a counter's key.
+ */
+uint32_t
+counter_hashval(const struct Opcode *op, uint bucket, prefixmask_t prefixmask)
+{
+	uint64_t h;
+
+	h = (uintptr_t)op;
+	h = (h ^ (h >> 29) ^ ((uint64_t)bucket << 32) ^ prefixmask) *
+	    0x9e3779b97f4a7c15ULL;
+	return h >> 32;
+}
+
+
+/*!
+ * counter_find() - Internal routine to locate the counter for an opcode.
+ *
+ *	@param	op		The opcode executed.
+ *
+ *	@param	bucket		Bucket of the region executed in; see
+ *				counter_bucket().
+ *
+ *	@param	prefixmask	Prefixes the opcode was executed with.
+ *
+ *	@param	create		Whether to create the counter if there is
+ *				none.
+ *
+ *	@return	the counter, or NULL if there is none and \a create is false.
+ *		The pointer is only valid until the next counter is created.
+ *
+ *	Counters are found by linear probing of an open-addressed hash table
+ *	of counter identifiers which is kept at most half full.
+ */
+struct counter *
+counter_find(struct Opcode *op, uint bucket, prefixmask_t prefixmask,
+	     bool create)
+{
+	struct counter *c;
+	uint32_t i, id;
+
+	if (counter_hash_size != 0) {
+		i = counter_hashval(op, bucket, prefixmask);
+		for (;;) {
+			i &= counter_hash_size - 1;
+			id = counter_hash[i];
+			if (id == 0)
+				break;
+			c = &counters[id - 1];
+			if (c->op == op && c->bucket == bucket &&
+			    c->prefixmask == prefixmask)
+				return c;
+			i++;
+		}
+	}
+
+	if (!create)
+		return NULL;
+
+	if (ncounters == maxcounters) {
+		maxcounters = (maxcounters == 0) ? 1024 : maxcounters * 2;
+		counters = realloc(counters, maxcounters * sizeof(*counters));
+		if (counters == NULL)
+			fatal(EX_OSERR, "realloc: %m");
+	}
+	if ((ncounters + 1) * 2 > counter_hash_size)
+		counter_rehash();
+
+	c = &counters[ncounters++];
+	memset(c, 0, sizeof(*c));
+	c->op = op;
+	c->bucket = bucket;
+	c->prefixmask = prefixmask;
+
+	i = counter_hashval(op, bucket, prefixmask);
+	for (;;) {
+		i &= counter_hash_size - 1;
+		if (counter_hash[i] == 0)
+			break;
+		i++;
+	}
+	counter_hash[i] = ncounters;
+
+	return c;
+}
+
+
+/*!
+ * counter_rehash() - Internal routine to double the size of the counter
+ *		      hash table.
+ */
+void
+counter_rehash(void)
+{
+	struct counter *c;
+	uint32_t i, id;
+
+	counter_hash_size = (counter_hash_size == 0) ? 2048 :
+			    counter_hash_size * 2;
+	free(counter_hash);
+	counter_hash = calloc(counter_hash_size, sizeof(*counter_hash));
+	if (counter_hash == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+
+	for (id = 1; id <= ncounters; id++) {
+		c = &counters[id - 1];
+		i = counter_hashval(c->op, c->bucket, c->prefixmask);
+		for (;;) {
+			i &= counter_hash_size - 1;
+			if (counter_hash[i] == 0)
+				break;
+			i++;
+		}
+		counter_hash[i] = id;
+	}
+}
+
+
+/*!
+ * counter_sort() - Internal routine to sort the counters in output order.
+ *
+ *	@post	counter_order holds the indexes of all counters, ordered by
+ *		instruction set, bucket, and then opcode in the order of the
+ *		opcode tree.  Each opcode's counter with no prefixes is first,
+ *		followed by the others in the order they were created.
+ */
+void
+counter_sort(void)
+{
+	uint32_t i;
+
+	free(counter_order);
+	counter_order = malloc((ncounters + 1) * sizeof(*counter_order));
+	if (counter_order == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+
+	for (i = 0; i < ncounters; i++)
+		counter_order[i] = i;
+	qsort(counter_order, ncounters, sizeof(*counter_order),
+	      counter_compare);
+}
+
+
+int
+counter_compare(const void *a, const void *b)
+{
+	uint32_t ia = *(const uint32_t *)a;
+	uint32_t ib = *(const uint32_t *)b;
+	const struct counter *ca = &counters[ia];
+	const struct counter *cb = &counters[ib];
+
+	if (ca->op->isa != cb->op->isa)
+		return (ca->op->isa < cb->op->isa) ? -1 : 1;
+	if (ca->bucket != cb->bucket)
+		return (ca->bucket < cb->bucket) ? -1 : 1;
+	if (ca->op->order != cb->op->order)
+		return (ca->op->order < cb->op->order) ? -1 : 1;
+	if ((ca->prefixmask == 0) != (cb->prefixmask == 0))
+		return (ca->prefixmask == 0) ? -1 : 1;
+	return (ia < ib) ? -1 : (ia > ib);
+}
+
+
+/*!
+ * optree_set_ngrams() - Enable counting of sequences of instructions.
+ *
+ *	@param	top	Number of the most frequently executed sequences of
+ *			each length to report per region; zero disables
+ *			counting them.
+ *
+ *	Pairs and triples of consecutively executed instructions are counted,
+ *	each identified by the opcodes and prefixes of its instructions and
+ *	reported in the region its last instruction was executed in.
+ */
+void
+optree_set_ngrams(uint top)
+{
+
+	ngram_top = top;
+}
+
+
+/*!
+ * ngram_add() - Internal routine to count the sequences ending with an
+ *		 instruction executed.
+ *
+ *	@param	id	Identifier of the instruction's counter.
+ */
+void
+ngram_add(uint32_t id)
+{
+	uint32_t key[NGRAM_MAX];
+	uint len, i;
+
+	for (len = 2; len <= NGRAM_MAX; len++) {
+		if (ngram_history[NGRAM_MAX - len] == 0)
+			break;
+		for (i = 0; i < len - 1; i++)
+			key[i] = ngram_history[NGRAM_MAX - len + i];
+		key[len - 1] = id;
+		for (i = len; i < NGRAM_MAX; i++)
+			key[i] = 0;
+		ngram_count(key);
+	}
+
+	for (i = 0; i < NGRAM_MAX - 2; i++)
+		ngram_history[i] = ngram_history[i + 1];
+	ngram_history[NGRAM_MAX - 2] = id;
+}
+
+
+/*!
+ * ngram_count() - Internal routine to count a sequence of instructions.
+ *
+ *	@param	key	Identifiers of the counters of the instructions,
+ *			oldest first and padded with zeroes.
+ *
+ *	Sequences are found by linear probing of an open-addressed hash
+ *	table of sequence identifiers which is kept at most half full, like
+ *	the counters.
+ */
+void
+ngram_count(const uint32_t *key)
+{
+	struct ngram *ng;
+	uint32_t i, id;
+
+	if (ngram_hash_size != 0) {
+		i = ngram_hashval(key);
+		for (;;) {
+			i &= ngram_hash_size - 1;
+			id = ngram_hash[i];
+			if (id == 0)
+				break;
+			ng = &ngrams[id - 1];
+			if (memcmp(ng->id, key, sizeof(ng->id)) == 0) {
+				ng->n++;
+				return;
+			}
+			i++;
+		}
+	}
+
+	if (nngrams == maxngrams) {
+		maxngrams = (maxngrams == 0) ? 4096 : maxngrams * 2;
+		ngrams = realloc(ngrams, maxngrams * sizeof(*ngrams));
+		if (ngrams == NULL)
+			fatal(EX_OSERR, "realloc: %m");
+	}
+	if ((nngrams + 1) * 2 > ngram_hash_size)
+		ngram_rehash();
+
+	ng = &ngrams[nngrams++];
+	memcpy(ng->id, key, sizeof(ng->id));
+	ng->n = 1;
+
+	i = ngram_hashval(key);
+	for (;;) {
+		i &= ngram_hash_size - 1;
+		if (ngram_hash[i] == 0)
+			break;
+		i++;
+	}
+	ngram_hash[i] = nngrams;
+}
+
+
+/*!
+ * ngram_hashval() - Internal routine to hash a sequence's key.
+ */
+uint32_t
+ngram_hashval(const uint32_t *key)
+{
+	uint64_t h = 0;
+	uint i;
+
+	for (i = 0; i < NGRAM_MAX; i++)
+		h = (h ^ key[i]) * 0x9e3779b97f4a7c15ULL;
+	return h >> 32;
+}
+
+
+/*!
+ * ngram_rehash() - Internal routine to double the size of the sequence
+ *		    hash table.
+ */
+void
+ngram_rehash(void)
+{
+	uint32_t i, id;
+
+	ngram_hash_size = (ngram_hash_size == 0) ? 8192 : ngram_hash_size * 2;
+	free(ngram_hash);
+	ngram_hash = calloc(ngram_hash_size, sizeof(*ngram_hash));
+	if (ngram_hash == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+
+	for (id = 1; id <= nngrams; id++) {
+		i = ngram_hashval(ngrams[id - 1].id);
+		for (;;) {
+			i &= ngram_hash_size - 1;
+			if (ngram_hash[i] == 0)
+				break;
+			i++;
+		}
+		ngram_hash[i] = id;
+	}
+}
+
+
+/*!
+ * ngram_len() - Internal routine to get the number of instructions in a
+ *		 sequence.
+ */
+uint
+ngram_len(const struct ngram *ng)
+{
+	uint len = NGRAM_MAX;
+
+	while (ng->id[len - 1] == 0)
+		len--;
+	return len;
+}
+
+
+/*!
+ * ngram_sort() - Internal routine to sort the sequences in output order.
+ *
+ *	@pre	The opcodes have been numbered by optree_number().
+ *
+ *	@post	ngram_order holds the indexes of all sequences, ordered by
+ *		the instruction set and bucket of their last instruction,
+ *		then by length and most frequently executed first.
+ */
+void
+ngram_sort(void)
+{
+	uint32_t i;
+
+	free(ngram_order);
+	ngram_order = malloc((nngrams + 1) * sizeof(*ngram_order));
+	if (ngram_order == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+
+	for (i = 0; i < nngrams; i++)
+		ngram_order[i] = i;
+	qsort(ngram_order, nngrams, sizeof(*ngram_order), ngram_compare);
+}
+
+
+int
+ngram_compare(const void *a, const void *b)
+{
+	uint32_t ia = *(const uint32_t *)a;
+	uint32_t ib = *(const uint32_t *)b;
+	const struct ngram *na = &ngrams[ia];
+	const struct ngram *nb = &ngrams[ib];
+	uint lena = ngram_len(na);
+	uint lenb = ngram_len(nb);
+	const struct counter *ca = &counters[na->id[lena - 1] - 1];
+	const struct counter *cb = &counters[nb->id[lenb - 1] - 1];
+
+	if (ca->op->isa != cb->op->isa)
+		return (ca->op->isa < cb->op->isa) ? -1 : 1;
+	if (ca->bucket != cb->bucket)
+		return (ca->bucket < cb->bucket) ? -1 : 1;
+	if (lena != lenb)
+		return (lena < lenb) ? -1 : 1;
+	if (na->n != nb->n)
+		return (na->n > nb->n) ? -1 : 1;
+	return (ia < ib) ? -1 : (ia > ib);
+}
+
+
+/*!
+ * optree_update() - Count the execution of the instruction at the given
+ *		     address.
+ *
+ *	@return	true if the instruction may be a system call gate.  Such
+ *		instructions are never kept in the region decode caches so
+ *		they are always decoded and identified.
+ */
+bool
+optree_update(target_t targ, region_t region, isa_t isa, vm_offset_t pc,
+	      uint cycles)
+{
+	struct counter *c;
+	region_type_t regiontype;
+	uint32_t id;
+	uint len, flags, object;
+
+	assert(region != NULL);
+	assert(isa < NUMISAS);
+
+	regiontype = region_get_type(region);
+	assert(regiontype < NUMREGIONTYPES);
+
+	object = region_get_object(region);
+	if (object == 0)
+		region_type_use[isa][regiontype] = true;
+	else
+		optree_use_object(isa, regiontype, object);
+
+	if (verify_lengths)
+		optree_verify_length(targ, region, isa, pc);
+
+	/*
+	 * If the instruction has been decoded before and the region's
+	 * contents cannot have changed since, go straight to its counter.
+	 * The cache is bypassed while instructions are being sampled for
+	 * the benchmark or checked against a second decoder so that every
+	 * instruction executed is decoded.
+	 */
+	if (nsamples >= maxsamples && optree_checker == NULL) {
+		id = region_decode_lookup(region, pc, isa);
+		if (id != 0) {
+			decode_hits++;
+			counter_add(&counters[id - 1], cycles);
+			hotspot_add(pc, id, cycles);
+			if (ngram_top != 0)
+				ngram_add(id);
+			return false;
+		}
+		decode_misses++;
+	}
+
+	c = optree_decode(targ, region, isa, pc, true, &len, &flags);
+	counter_add(c, cycles);
+	hotspot_add(pc, counter_id(c), cycles);
+	if (ngram_top != 0)
+		ngram_add(counter_id(c));
+
+	if ((flags & OPLEN_SYSCALL) != 0)
+		return true;
+
+	/*
+	 * Record the decode result if the region's contents cannot change
+	 * and, while we are at it, decode the instructions that follow.
+	 */
+	if (region_decode_store(region, pc, isa, counter_id(c)) &&
+	    len != 0 && (flags & OPLEN_BRANCH) == 0)
+		optree_predecode(targ, region, isa, pc + len);
+
+	return false;
+}
+
+
+/*!
+ * optree_decode() - Internal routine to decode an instruction.
+ *
+ *	@param	targ	The target process.
+ *
+ *	@param	region	The memory region containing the instruction.
+ *
+ *	@param	isa	Instruction set the instruction is executed in.
+ *
+ *	@param	pc	Address of the instruction.
+ *
+ *	@param	execute	Whether the instruction is being executed, as
+ *			opposed to being decoded ahead of time.
+ *
+ *	@param	lenp	Pointer to populate with the length of the
+ *			instruction, or zero if it could not be determined.
+ *
+ *	@param	flagsp	Pointer to populate with OPLEN_* flags for the
+ *			instruction.
+ *
+ *	@return	the counter for the instruction's opcode, prefixes, region
+ *		type and object.  Instructions decoded ahead of time are not
+ *		given new counters nor reported if unknown; NULL is returned
+ *		instead.
+ */
+struct counter *
+optree_decode(target_t targ, region_t region, isa_t isa, vm_offset_t pc,
+	      bool execute, uint *lenp, uint *flagsp)
+{
+	struct OpTreeNode *node;
+	struct Prefix *prefix;
+	struct Opcode *op;
+	struct counter *c;
+	region_type_t regiontype;
+	prefixmask_t prefixmask = PREFIXMASK_EMPTY;
+	uint8_t text[TEXT_FETCH_LEN];
+	size_t textlen, offset;
+	vm_offset_t end;
+	uint object;
+	bool first = true;
+
+	regiontype = region_get_type(region);
+	object = region_get_object(region);
+	region_get_range(region, NULL, &end);
+
+	/*
+	 * First, build mask of all prefixes before the opcode.  Instruction
+	 * text is fetched in chunks large enough to hold the prefixes and
+	 * the opcode, but never beyond the end of the region; any bytes we
+	 * could not fetch are decoded as zeros.  The first chunk holds the
+	 * whole instruction so its length is determined from that.
+	 */
+	textlen = offset = 0;
+	for (;;) {
+		if (textlen - offset < OPKEY_LEN) {
+			pc += offset;
+			offset = 0;
+
+			memset(text, 0, sizeof(text));
+			textlen = sizeof(text);
+			if (textlen > end - pc)
+				textlen = end - pc;
+			if (textlen > 0)
+				region_read(targ, region, pc, text, textlen);
+			if (first) {
+				*lenp = optree_decoder->len(isa, text, textlen,
+							    flagsp);
+				first = false;
+			}
+			if (textlen < OPKEY_LEN)
+				textlen = OPKEY_LEN;
+		}
+
+		if (execute && nsamples < maxsamples) {
+			samples[nsamples].isa = isa;
+			memcpy(samples[nsamples].key, text + offset, OPKEY_LEN);
+			nsamples++;
+		}
+
+		node = optree_decoder->lookup(isa, text + offset);
+		assert(node != NULL);
+		if (optree_checker != NULL) {
+			optree_check(isa, pc + offset, text + offset,
+				     textlen - offset, node);
 		}
+		if (node->type != PREFIX)
+			break;
+
+		prefix = (struct Prefix *)node;
+
+		offset += prefix->len;
+		prefixmask |= prefix->mask;
+	}
+
+	pc += offset;
+
+	assert(node->type == OPCODE);
+	op = (struct Opcode *)node;
+
+	/*
+	 * Unknown instructions which the length decoder recognizes as VEX
+	 * or EVEX encoded are counted by their AVX extension.
+	 */
+	if (op->node.match.len == 0 && (*flagsp & OPLEN_VEX) != 0) {
+		if ((*flagsp & OPLEN_EVEX) != 0)
+			op = vex_op[isa][OPEXT_AVX512];
+		else if ((*flagsp & OPLEN_VEX256) != 0)
+			op = vex_op[isa][OPEXT_AVX256];
+		else
+			op = vex_op[isa][OPEXT_AVX128];
+	}
+
+	/*
+	 * Unknown instructions are only reported when executed, so leave
+	 * them to be decoded then.
+	 */
+	if (!execute && op->node.match.len == 0)
+		return NULL;
+
+	/*
+	 * Locate the counter to update by its prefix mask and bucket,
+	 * creating one if the instruction is being executed.
+	 */
+	c = counter_find(op, counter_bucket(regiontype, object), prefixmask,
+			 execute);
+	if (c == NULL)
+		return NULL;
+
+	/*
+	 * Warn about instructions which match the default opcode.
+	 * In order to reduce verbosity, we only print the warning when
+	 * the current program counter differs from the last program counter
+	 * at which we found an unknown opcode.
+	 */
+	if (op->node.match.len == 0) {
+		static vm_offset_t prevpc = 0;
+		static bool isa_warned[NUMISAS];
+
+		/*
+		 * If no opcodes were loaded for the instruction set at all,
+		 * then every instruction is unknown; say so once rather
+		 * than warning about each of them.
+		 */
+		if (!op_loaded[isa]) {
+			if (!isa_warned[isa]) {
+				warn("no opcode list loaded for %s; "
+				     "instructions will be reported as unknown",
+				     isa_name[isa]);
+				isa_warned[isa] = true;
+			}
+		}
+		else if (pc != prevpc) {
+			char hex[OPKEY_LEN * 2 + 1];
+			uint i;
+
+			for (i = 0; i < OPKEY_LEN; i++)
+				sprintf(hex + i * 2, "%02x", text[offset + i]);
+			warn("unknown opcode at pc %#jx: 0x%s",
+			     (uintmax_t)pc, hex);
+			prevpc = pc;
+		}
+	}
+
+	return c;
+}
+
+
+/*!
+ * optree_predecode() - Internal routine to decode the instructions in a
+ *			read-only text region ahead of their execution.
+ *
+ *	@param	targ	The target process.
+ *
+ *	@param	region	The memory region containing the instructions.
+ *
+ *	@param	isa	Instruction set the instructions are executed in.
+ *
+ *	@param	pc	Address of the first instruction to decode.
+ *
+ *	Instructions are decoded in sequence and their decode results
+ *	recorded until one which may branch, one which has already been
+ *	decoded, one which cannot be decoded ahead of time (including system
+ *	call gates), or the end of the page.  When the program runs on into
+ *	the following instructions they are counted without being decoded
+ *	again.
+ */
+void
+optree_predecode(target_t targ, region_t region, isa_t isa, vm_offset_t pc)
+{
+	struct counter *c;
+	vm_offset_t end, pageend;
+	uint len, flags;
+
+	region_get_range(region, NULL, &end);
+
+	pageend = (pc | (PREDECODE_PAGE - 1)) + 1;
+	if (pageend > end || pageend == 0)
+		pageend = end;
+
+	while (pc < pageend && region_decode_lookup(region, pc, isa) == 0) {
+		c = optree_decode(targ, region, isa, pc, false, &len, &flags);
+		if (c == NULL || (flags & OPLEN_SYSCALL) != 0)
+			break;
+
+		region_decode_store(region, pc, isa, counter_id(c));
+		predecoded++;
+
+		if (len == 0 || (flags & OPLEN_BRANCH) != 0)
+			break;
+		pc += len;
+	}
+}
+
+
+void
+optree_output_open(void)
+{
+	xmlOutputBufferPtr out;
+
+	assert(opt_outfile != NULL);
+	assert(writer == NULL);
+
+	/*
+	 * Open the output file for writing.  We keep the output file open
+	 * across multiple calls, overwriting the contents of the file each
+	 * time we are called (e.g. checkpointing).  The output does not
+	 * only grow: percentiles can fall and the hotspots and n-grams
+	 * reported can be replaced by ones with shorter descriptions, so
+	 * optree_output() truncates the file to the length just written.
+	 */
+	if (writer_fd < 0) {
+		writer_fd = open(opt_outfile, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+		if (writer_fd < 0) {
+			fatal(EX_OSERR, "unable to open %s for writing: %m",
+			      opt_outfile);
+		}
+	}
+
+	lseek(writer_fd, 0, SEEK_SET);
+
+	out = xmlOutputBufferCreateFd(writer_fd, NULL);
+	if (out == NULL) {
+		fatal(EX_CANTCREAT, "unable to open %s for writing: %m",
+		      opt_outfile);
+	}
+
+	writer = xmlNewTextWriter(out);
+	if (writer == NULL) {
+		xmlOutputBufferClose(out);
+		fatal(EX_CANTCREAT, "unable to open %s for writing: %m",
+		      opt_outfile);
+	}
+
+	xmlTextWriterSetIndent(writer, 4);
+}
+
+
+void
+optree_output(void)
+{
+
+	assert(writer != NULL);
+
+	optree_write(opt_outfile, opt_hotspotfile == NULL);
+
+	/* Discard anything left over from a longer, earlier write. */
+	if (ftruncate(writer_fd, lseek(writer_fd, 0, SEEK_CUR)) < 0)
+		fatal(EX_IOERR, "failed to write to %s: %m", opt_outfile);
+
+	/* Ensure the results are written to disk. */
+	fsync(writer_fd);
+
+	if (opt_hotspotfile != NULL)
+		optree_write_hotspots();
+}
+
+
+/*!
+ * optree_output_file() - Write a complete snapshot of the execution profile
+ *			  to a separate file.
+ *
+ *	@param	filepath	Path of the file to write the snapshot to.
+ *				The file is created or truncated.
+ *
+ *	Unlike optree_output(), this does not disturb the output file opened
+ *	by optree_output_open() so it can be called at any time during the
+ *	trace.  The per-address profile is always written inline, since a
+ *	separate hotspots file only holds the latest counts.
+ */
+void
+optree_output_file(const char *filepath)
+{
+	xmlTextWriterPtr saved_writer;
+	int fd;
+
+	fd = open(filepath, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (fd < 0)
+		fatal(EX_OSERR, "unable to open %s for writing: %m", filepath);
+
+	saved_writer = writer;
+	writer = optree_writer_new(fd, filepath);
+	optree_write(filepath, true);
+	writer = saved_writer;
+
+	fsync(fd);
+	close(fd);
+}
+
+
+/*!
+ * optree_write_hotspots() - Internal routine to write the per-address
+ *			     execution profile to its own file.
+ *
+ *	The file is rewritten in full each time, like the output file.
+ */
+void
+optree_write_hotspots(void)
+{
+	xmlTextWriterPtr saved_writer;
+	int fd;
+
+	fd = open(opt_hotspotfile, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (fd < 0) {
+		fatal(EX_OSERR, "unable to open %s for writing: %m",
+		      opt_hotspotfile);
+	}
+
+	saved_writer = writer;
+	writer = optree_writer_new(fd, opt_hotspotfile);
+
+	if (xmlTextWriterStartDocument(writer, NULL, "utf-8", NULL) < 0)
+		fatal(EX_IOERR, "failed to write to %s: %m", opt_hotspotfile);
+
+	xmlTextWriterStartElement(writer, "dyntrace");
+	optree_print_hotspots();
+	xmlTextWriterEndElement(writer /* "dyntrace" */);
+	xmlTextWriterEndDocument(writer);
+	xmlFreeTextWriter(writer);
+	writer = saved_writer;
+
+	fsync(fd);
+	close(fd);
+}
+
+
+/*!
+ * optree_writer_new() - Internal routine to create an XML writer for a
+ *			 file.
+ *
+ *	@param	fd		Descriptor of the file, open for writing.
+ *
+ *	@param	filepath	Path of the file; used for error reporting
+ *				only.
+ *
+ *	@return	the XML writer.  Failure to create it is fatal.
+ */
+xmlTextWriterPtr
+optree_writer_new(int fd, const char *filepath)
+{
+	xmlOutputBufferPtr out;
+	xmlTextWriterPtr w;
+
+	out = xmlOutputBufferCreateFd(fd, NULL);
+	if (out == NULL) {
+		fatal(EX_CANTCREAT, "unable to open %s for writing: %m",
+		      filepath);
+	}
+
+	w = xmlNewTextWriter(out);
+	if (w == NULL) {
+		xmlOutputBufferClose(out);
+		fatal(EX_CANTCREAT, "unable to open %s for writing: %m",
+		      filepath);
+	}
+
+	xmlTextWriterSetIndent(w, 4);
+	return w;
+}
+
+
+/*!
+ * optree_write() - Internal routine to write the execution profile using
+ *		    the current XML writer.
+ *
+ *	@param	filepath	Path of the file being written; used for error
+ *				reporting only.
+ *
+ *	@param	hotspots	Whether to include the per-address profile, if
+ *				it is enabled.
+ *
+ *	@post	The writer is freed and the global writer handle is cleared.
+ */
+void
+optree_write(const char *filepath, bool hotspots)
+{
+	const struct Prefix *prefix;
+	region_type_t regiontype;
+	isa_t isa;
+	uint i;
+
+	if (xmlTextWriterStartDocument(writer, NULL, "utf-8", NULL) < 0)
+		fatal(EX_IOERR, "failed to write to %s: %m", filepath);
+
+	xmlTextWriterStartElement(writer, "dyntrace");
+
+	/*
+	 * First, output a list of prefixes.  Each instruction set numbers
+	 * its prefixes separately, so the identifiers in a region tagged
+	 * with an ISA refer to the prefixes tagged with the same ISA.
+	 */
+	for (isa = 0; isa < NUMISAS; isa++) {
+		for (i = 0; i < prefix_count[isa]; i++) {
+			prefix = &prefix_index[isa][i];
+			xmlTextWriterStartElement(writer, "prefix");
+			xmlTextWriterWriteAttribute(writer, "id",
+			    prefix_string(prefix->mask));
+			if (isa != ISA_X86) {
+				xmlTextWriterWriteAttribute(writer, "isa",
+							    isa_name[isa]);
+			}
+			xmlTextWriterWriteAttribute(writer, "bitmask",
+						    prefix->bitmask);
+			xmlTextWriterWriteAttribute(writer, "detail",
+						    prefix->detail);
+			xmlTextWriterEndElement(writer /* prefix */);
+		}
+	}
+
+	xmlTextWriterStartElement(writer, "program");
+	xmlTextWriterWriteAttribute(writer, "name", "N/A");	/* XXX */
+
+	optree_number();
+	counter_sort();
+	if (ngram_top != 0)
+		ngram_sort();
+
+	/*
+	 * Iterate through the region types, outputting the opcodes in each
+	 * region, followed by each object when counting by object.
+	 * Instructions executed in an instruction set other than IA-32 are
+	 * reported in separate regions tagged with their ISA.
+	 */
+	for (isa = 0; isa < NUMISAS; isa++) {
+		for (regiontype = 0; regiontype < NUMREGIONTYPES;
+		     regiontype++) {
+			if (region_type_use[isa][regiontype])
+				optree_print_region(isa, regiontype, 0);
+		}
+
+		for (i = 0; i < nobject_use; i++) {
+			if (object_use[i].isa[isa])
+				optree_print_region(isa,
+				    object_use[i].regiontype, i + 1);
+		}
+	}
+
+	if (hotspots && hotspot_enabled())
+		optree_print_hotspots();
+
+	xmlTextWriterEndElement(writer /* "program" */);
+	xmlTextWriterEndElement(writer /* "dyntrace" */);
+	xmlTextWriterEndDocument(writer);
+	xmlFreeTextWriter(writer);
+
+	writer = NULL;
+}
+
+
+/*!
+ * optree_use_object() - Internal routine to note that an instruction was
+ *			 executed in an object's region.
+ *
+ *	@param	isa		Instruction set the instruction was executed
+ *				in.
+ *
+ *	@param	regiontype	Type of the region the instruction is in.
+ *
+ *	@param	object		Non-zero identifier of the region's object.
+ */
+void
+optree_use_object(isa_t isa, region_type_t regiontype, uint object)
+{
+	struct object_use *use;
+	uint n;
+
+	if (object > nobject_use) {
+		n = region_object_count();
+		use = realloc(object_use, n * sizeof(*use));
+		if (use == NULL)
+			fatal(EX_OSERR, "realloc: %m");
+		memset(use + nobject_use, 0,
+		       (n - nobject_use) * sizeof(*use));
+		object_use = use;
+		nobject_use = n;
+	}
+
+	use = &object_use[object - 1];
+	if (!use->isa[isa]) {
+		use->isa[isa] = true;
+		use->regiontype = regiontype;
+	}
+}
+
+
+/*!
+ * optree_number() - Internal routine to number the opcodes in the order
+ *		     they are written in.
+ *
+ *	Opcodes are numbered in the order of each instruction set's opcode
+ *	tree, followed by the pseudo-opcodes for VEX and EVEX encoded
+ *	instructions.  This only needs to be done once, the first time the
+ *	execution profile is written.
+ */
+void
+optree_number(void)
+{
+	struct nodelist list;
+	struct Opcode *op;
+	opext_t ext;
+	isa_t isa;
+	uint i;
+
+	for (isa = 0; isa < NUMISAS; isa++) {
+		if (op_order[isa] != NULL)
+			continue;
+
+		optree_collect(isa, &list);
+		for (ext = 0; ext < NUMOPEXTS; ext++) {
+			if (vex_op[isa][ext] != NULL) {
+				optree_collect_node(
+				    (struct radix_node *)vex_op[isa][ext],
+				    &list);
+			}
+		}
+
+		nop_order[isa] = 0;
+		for (i = 0; i < list.n; i++) {
+			if (list.nodes[i]->type != OPCODE)
+				continue;
+			op = (struct Opcode *)list.nodes[i];
+			op->isa = isa;
+			op->order = nop_order[isa];
+			list.nodes[nop_order[isa]++] = &op->node;
+		}
+		op_order[isa] = (struct Opcode **)list.nodes;
+	}
+}
+
+
+/*!
+ * optree_print_region() - Internal routine to write the opcodes executed in
+ *			   a region type or object.
+ *
+ *	@param	isa		Instruction set to write the opcodes of.
+ *
+ *	@param	regiontype	Region type to write the opcodes of, or the
+ *				type to report for the object.
+ *
+ *	@param	object		Object to write the opcodes of, or zero to
+ *				write those executed in regions of the given
+ *				type which do not belong to an object.
+ *
+ *	Only the counters which have been created are visited, found by
+ *	bisection of the sorted counter_order, unless the printzero option
+ *	was specified, in which case every opcode is written.
+ */
+void
+optree_print_region(isa_t isa, region_type_t regiontype, uint object)
+{
+	struct print_walk walk;
+	const struct counter *c;
+	uint bucket;
+	uint32_t lo, hi, mid;
+	uint i;
+
+	xmlTextWriterStartElement(writer, "region");
+	xmlTextWriterWriteAttribute(writer, "type",
+				    region_type_name[regiontype]);
+	if (object != 0) {
+		xmlTextWriterWriteAttribute(writer, "object",
+					    region_object_name(object));
+	}
+	if (isa != ISA_X86)
+		xmlTextWriterWriteAttribute(writer, "isa", isa_name[isa]);
+
+	/* Find the first counter for the region. */
+	bucket = counter_bucket(regiontype, object);
+	lo = 0;
+	hi = ncounters;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		c = &counters[counter_order[mid]];
+		if (c->op->isa < isa ||
+		    (c->op->isa == isa && c->bucket < bucket))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/*
+	 * Write the region's counters.  If zero counts are to be written
+	 * too, each opcode which was not executed without prefixes is
+	 * written with a zero count before any counters it does have.
+	 */
+	memset(&walk, 0, sizeof(walk));
+	i = 0;
+	for (; lo < ncounters; lo++) {
+		c = &counters[counter_order[lo]];
+		if (c->op->isa != isa || c->bucket != bucket)
+			break;
 
-		assert(len + idstrlen + 1 < sizeof(buffer));
-		assert(idstrlen <= 2);
+		if (opt_printzero) {
+			while (i < c->op->order)
+				optree_print_counter(&walk, op_order[isa][i++],
+						     NULL);
+			if (i == c->op->order) {
+				if (c->prefixmask != 0)
+					optree_print_counter(&walk, c->op,
+							     NULL);
+				i++;
+			}
+		}
 
-		if (len > 0)
-			buffer[len++] = ',';
+		optree_print_counter(&walk, c->op, c);
+	}
 
-		buffer[len + 0] = idstr[0];
-		buffer[len + 1] = idstr[1];
-		len += idstrlen;
+	if (opt_printzero) {
+		while (i < nop_order[isa])
+			optree_print_counter(&walk, op_order[isa][i++], NULL);
 	}
 
-	buffer[len] = '\0';
-	return buffer;
+	optree_print_classes(&walk);
+	optree_print_extensions(&walk);
+	if (ngram_top != 0)
+		optree_print_ngrams(isa, bucket);
+
+	xmlTextWriterEndElement(writer /* "region */);
 }
 
 
-int
-optree_print_node(struct radix_node *rn, void *arg)
+/*!
+ * optree_print_counter() - Internal routine to write an opcode counter and
+ *			    add it to the region's totals.
+ *
+ *	@param	walk	The region's totals.
+ *
+ *	@param	op	The opcode counted.
+ *
+ *	@param	c	The counter to write, or NULL to write a zero count
+ *			for the opcode without prefixes.
+ */
+void
+optree_print_counter(struct print_walk *walk, const struct Opcode *op,
+		     const struct counter *c)
 {
-	const struct OpTreeNode *node = (struct OpTreeNode *)rn;
-	const struct Opcode *op = (const struct Opcode *)node;
-	region_type_t regiontype = *(const region_type_t *)arg;
-	const struct counter *c;
+	static const struct counter zero;
+	enum opclass class = opclass_of(op->args);
 	char buffer[32];
 
-	if (node->type != OPCODE)
-		return 0;
+	if (c == NULL)
+		c = &zero;
 
-	for (c = &op->count_head[regiontype]; c != NULL; c = c->next) {
-
-		/*
-		 * Skip counters with zero counts unless the printzero option
-		 * was specified on the command line.
-		 */
-		if (c->n == 0 && !opt_printzero)
-			continue;
+	walk->n[class] += c->n;
+	walk->cycles[class] += c->cycles_total;
+	if ((op->args & OPARG_SIMD) != 0) {
+		walk->n[OPCLASS_SIMD] += c->n;
+		walk->cycles[OPCLASS_SIMD] += c->cycles_total;
+	}
+	walk->ext_n[op->extension] += c->n;
+	walk->ext_cycles[op->extension] += c->cycles_total;
 
-		xmlTextWriterStartElement(writer, "opcount");
-		xmlTextWriterWriteAttribute(writer, "bitmask", op->bitmask);
-		xmlTextWriterWriteAttribute(writer, "mnemonic", op->mnemonic);
-		if (op->detail != NULL) {
-			xmlTextWriterWriteAttribute(writer, "detail",
-						    op->detail);
-		}
+	xmlTextWriterStartElement(writer, "opcount");
+	xmlTextWriterWriteAttribute(writer, "bitmask", op->bitmask);
+	xmlTextWriterWriteAttribute(writer, "mnemonic", op->mnemonic);
+	if (op->detail != NULL)
+		xmlTextWriterWriteAttribute(writer, "detail", op->detail);
 
-		if (c->prefixmask != 0) {
-			xmlTextWriterWriteAttribute(writer, "prefixes",
+	if (c->prefixmask != 0) {
+		xmlTextWriterWriteAttribute(writer, "prefixes",
 					    prefix_string(c->prefixmask));
-		}
-
-		snprintf(buffer, sizeof(buffer), "%llu",
-			 (unsigned long long)c->n);
-		xmlTextWriterWriteAttribute(writer, "n", buffer);
+	}
 
-		/* Only output cycle counts if we have them. */
-		if (c->cycles_total == 0) {
-			xmlTextWriterEndElement(writer /* "opcount" */);
-			continue;
-		}
+	snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long)c->n);
+	xmlTextWriterWriteAttribute(writer, "n", buffer);
 
+	/* Only output cycle counts if we have them. */
+	if (c->cycles_total != 0) {
 		snprintf(buffer, sizeof(buffer), "%llu",
 			 (unsigned long long)c->cycles_total);
 		xmlTextWriterWriteAttribute(writer, "cycles", buffer);
@@ -583,224 +2428,502 @@ optree_print_node(struct radix_node *rn, void *arg)
 		snprintf(buffer, sizeof(buffer), "%u", c->cycles_max);
 		xmlTextWriterWriteAttribute(writer, "max", buffer);
 
-		xmlTextWriterEndElement(writer /* "opcount" */);
+		snprintf(buffer, sizeof(buffer), "%u",
+			 histogram_percentile(c, 50));
+		xmlTextWriterWriteAttribute(writer, "p50", buffer);
+
+		snprintf(buffer, sizeof(buffer), "%u",
+			 histogram_percentile(c, 90));
+		xmlTextWriterWriteAttribute(writer, "p90", buffer);
+
+		snprintf(buffer, sizeof(buffer), "%u",
+			 histogram_percentile(c, 99));
+		xmlTextWriterWriteAttribute(writer, "p99", buffer);
 	}
 
-	return 0;
+	xmlTextWriterEndElement(writer /* "opcount" */);
 }
 
 
+/*!
+ * optree_print_ngrams() - Internal routine to write the sequences of
+ *			   instructions most frequently executed in a region.
+ *
+ *	@param	isa	Instruction set of the region.
+ *
+ *	@param	bucket	Region type or object of the region; see
+ *			counter_bucket().
+ *
+ *	Up to ngram_top sequences of each length are written, found by
+ *	bisection of the sorted ngram_order.  Which sequences make the cut can
+ *	change between checkpoints, so this section may be shorter than in
+ *	the previous write; optree_output() truncates the output file for
+ *	that reason.
+ */
 void
-optree_parsefile(const char *filepath)
+optree_print_ngrams(isa_t isa, uint bucket)
 {
-	xmlTextReaderPtr reader;
-	int ret;
-
-	if (op_rnh == NULL)
-		optree_init();
-
-	LIBXML_TEST_VERSION
-
-	reader = xmlNewTextReaderFilename(filepath);
-	if (reader == NULL)
-		fatal(EX_NOINPUT, "unable to open %s for reading", filepath);
+	const struct ngram *ng;
+	const struct counter *c;
+	char buffer[32];
+	uint32_t lo, hi, mid;
+	uint len, curlen, written, i;
+
+	lo = 0;
+	hi = nngrams;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		ng = &ngrams[ngram_order[mid]];
+		c = &counters[ng->id[ngram_len(ng) - 1] - 1];
+		if (c->op->isa < isa ||
+		    (c->op->isa == isa && c->bucket < bucket))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	while ((ret = xmlTextReaderRead(reader)) > 0) {
-		xmlNode *node;
+	curlen = 0;
+	written = 0;
+	for (; lo < nngrams; lo++) {
+		ng = &ngrams[ngram_order[lo]];
+		len = ngram_len(ng);
+		c = &counters[ng->id[len - 1] - 1];
+		if (c->op->isa != isa || c->bucket != bucket)
+			break;
 
-		if (xmlTextReaderNodeType(reader) != XML_ELEMENT_NODE)
+		if (len != curlen) {
+			if (curlen != 0)
+				xmlTextWriterEndElement(writer /* "ngrams" */);
+			xmlTextWriterStartElement(writer, "ngrams");
+			snprintf(buffer, sizeof(buffer), "%u", len);
+			xmlTextWriterWriteAttribute(writer, "length", buffer);
+			curlen = len;
+			written = 0;
+		}
+		if (written++ >= ngram_top)
 			continue;
 
-		node = xmlTextReaderExpand(reader);
+		xmlTextWriterStartElement(writer, "ngram");
+		snprintf(buffer, sizeof(buffer), "%llu",
+			 (unsigned long long)ng->n);
+		xmlTextWriterWriteAttribute(writer, "n", buffer);
 
-		if (strcmp(node->name, "prefix") == 0)
-			prefix_parse(node);
+		for (i = 0; i < len; i++) {
+			c = &counters[ng->id[i] - 1];
+			xmlTextWriterStartElement(writer, "op");
+			xmlTextWriterWriteAttribute(writer, "mnemonic",
+						    c->op->mnemonic);
+			if (c->op->detail != NULL) {
+				xmlTextWriterWriteAttribute(writer, "detail",
+							    c->op->detail);
+			}
+			if (c->prefixmask != 0) {
+				xmlTextWriterWriteAttribute(writer, "prefixes",
+					    prefix_string(c->prefixmask));
+			}
+			xmlTextWriterEndElement(writer /* "op" */);
+		}
 
-		if (strcmp(node->name, "op") == 0)
-			opcode_parse(node);
+		xmlTextWriterEndElement(writer /* "ngram" */);
 	}
 
-	if (ret != 0)
-		fatal(EX_DATAERR, "failed to parse %s", filepath);
-
-	xmlFreeTextReader(reader);
+	if (curlen != 0)
+		xmlTextWriterEndElement(writer /* "ngrams" */);
 }
 
 
-
+/*!
+ * optree_print_hotspots() - Internal routine to write the per-address
+ *			     execution profile.
+ *
+ *	Addresses are written most frequently executed first, each with the
+ *	opcode last executed there and the region it is in.
+ */
 void
-opcode_parse(xmlNode *node)
+optree_print_hotspots(void)
 {
-	const xmlAttr *attr;
-	struct Opcode *op;
+	const struct hotspot *h;
+	const struct counter *c;
+	region_type_t regiontype;
+	uint object;
+	char buffer[32];
+	uint i, n;
 
-	op = opcode_alloc();
+	xmlTextWriterStartElement(writer, "hotspots");
+	if (hotspot_evicted() != 0) {
+		snprintf(buffer, sizeof(buffer), "%llu",
+			 (unsigned long long)hotspot_evicted());
+		xmlTextWriterWriteAttribute(writer, "evicted", buffer);
+	}
 
-	for (attr = node->properties; attr != NULL; attr = attr->next) {
-		const char *name = attr->name;
-		const char *value = XML_GET_CONTENT(attr->children);
+	n = hotspot_sort();
+	for (i = 0; i < n; i++) {
+		h = hotspot_get(i);
+		c = &counters[h->id - 1];
 
-		if (strcmp(name, "bitmask") == 0)
-			op->bitmask = strdup(value);
-		else if (strcmp(name, "mnemonic") == 0)
-			op->mnemonic = strdup(value);
-		else if (strcmp(name, "detail") == 0)
-			op->detail = strdup(value);
-	}
+		if (c->bucket < NUMREGIONTYPES) {
+			regiontype = c->bucket;
+			object = 0;
+		}
+		else {
+			object = c->bucket - NUMREGIONTYPES + 1;
+			regiontype = object_use[object - 1].regiontype;
+		}
 
-	/*
-	 * Verify the opcode looks complete.
-	 */
-	if (op->bitmask == NULL) {
-		fatal(EX_DATAERR, "bitmask missing at %ld",
-		      XML_GET_LINE(node));
-	}
-	if (op->mnemonic == NULL) {
-		fatal(EX_DATAERR, "mnemonic missing at %ld",
-		      XML_GET_LINE(node));
-	}
+		xmlTextWriterStartElement(writer, "hotspot");
+		snprintf(buffer, sizeof(buffer), "0x%llx",
+			 (unsigned long long)h->pc);
+		xmlTextWriterWriteAttribute(writer, "address", buffer);
+		xmlTextWriterWriteAttribute(writer, "mnemonic",
+					    c->op->mnemonic);
+		if (c->op->detail != NULL) {
+			xmlTextWriterWriteAttribute(writer, "detail",
+						    c->op->detail);
+		}
+		if (c->prefixmask != 0) {
+			xmlTextWriterWriteAttribute(writer, "prefixes",
+					    prefix_string(c->prefixmask));
+		}
+
+		xmlTextWriterWriteAttribute(writer, "region",
+					    region_type_name[regiontype]);
+		if (object != 0) {
+			xmlTextWriterWriteAttribute(writer, "object",
+					    region_object_name(object));
+		}
+		if (c->op->isa != ISA_X86) {
+			xmlTextWriterWriteAttribute(writer, "isa",
+						    isa_name[c->op->isa]);
+		}
+
+		snprintf(buffer, sizeof(buffer), "%llu",
+			 (unsigned long long)h->n);
+		xmlTextWriterWriteAttribute(writer, "n", buffer);
 
-	parse_bitmask(op->bitmask, &op->node.mask.val, &op->node.match.val);
+		if (h->cycles != 0) {
+			snprintf(buffer, sizeof(buffer), "%llu",
+				 (unsigned long long)h->cycles);
+			xmlTextWriterWriteAttribute(writer, "cycles", buffer);
+		}
+
+		if (h->error != 0) {
+			snprintf(buffer, sizeof(buffer), "%llu",
+				 (unsigned long long)h->error);
+			xmlTextWriterWriteAttribute(writer, "error", buffer);
+		}
 
-	if (!optree_insert(&op->node)) {
-		opcode_free(&op);
+		xmlTextWriterEndElement(writer /* "hotspot" */);
 	}
+
+	xmlTextWriterEndElement(writer /* "hotspots" */);
 }
 
 
-struct Opcode *
-opcode_alloc(void)
+const char *
+prefix_string(prefixmask_t prefixmask)
 {
-	struct Opcode *op;
-	region_type_t regiontype;
+	static char buffer[100];
+	size_t len;
+	prefixmask_t checkmask;
+	int id;
 
-	op = calloc(1, sizeof(*op));
-	if (op == NULL)
-		fatal(EX_OSERR, "malloc: %m");
+	/* No instruction prefix is the most common case. */
+	if (prefixmask == 0)
+		return "";
 
-	for (regiontype = 0; regiontype < NUMREGIONTYPES; regiontype++)
-		op->count_end[regiontype] = &op->count_head[regiontype];
+	len = 0;
 
-	op->node.type = OPCODE;
-	op->node.mask.len = sizeof(op->node.mask);
-	op->node.match.len = sizeof(op->node.match);
+	for (id = 0, checkmask = 1; prefixmask != 0; id++, checkmask <<= 1) {
+		char idstr[3] = { 'A', '\0', '\0' };
+		size_t idstrlen = 1;
 
-	return op;
+		if ((prefixmask & checkmask) == 0)
+			continue;
+		prefixmask &= ~checkmask;
+
+		if (id < 26)
+			idstr[0] += id;
+		else {
+			idstr[1] = 'A' + id - 26;
+			idstrlen++;
+		}
+
+		assert(len + idstrlen + 1 < sizeof(buffer));
+		assert(idstrlen <= 2);
+
+		if (len > 0)
+			buffer[len++] = ',';
+
+		buffer[len + 0] = idstr[0];
+		buffer[len + 1] = idstr[1];
+		len += idstrlen;
+	}
+
+	buffer[len] = '\0';
+	return buffer;
 }
 
 
+/*!
+ * optree_print_classes() - Internal routine to write the per-class totals
+ *			    accumulated while writing a region's opcodes.
+ *
+ *	@param	walk	The totals accumulated by optree_print_counter().
+ */
 void
-opcode_free(struct Opcode **opp)
+optree_print_classes(const struct print_walk *walk)
 {
-	struct Opcode *op = *opp;
+	char buffer[32];
+	enum opclass class;
 
-	*opp = NULL;
-	if (op->bitmask != NULL)
-		free(op->bitmask);
-	if (op->mnemonic != NULL)
-		free(op->mnemonic);
-	if (op->detail != NULL)
-		free(op->detail);
-	free(op);
+	for (class = 0; class < NUMOPCLASSES; class++) {
+
+		if (walk->n[class] == 0 && !opt_printzero)
+			continue;
+
+		xmlTextWriterStartElement(writer, "opclass");
+		xmlTextWriterWriteAttribute(writer, "name",
+					    opclass_name[class]);
+
+		snprintf(buffer, sizeof(buffer), "%llu",
+			 (unsigned long long)walk->n[class]);
+		xmlTextWriterWriteAttribute(writer, "n", buffer);
+
+		if (walk->cycles[class] != 0) {
+			snprintf(buffer, sizeof(buffer), "%llu",
+				 (unsigned long long)walk->cycles[class]);
+			xmlTextWriterWriteAttribute(writer, "cycles", buffer);
+		}
+
+		xmlTextWriterEndElement(writer /* "opclass" */);
+	}
 }
 
 
+/*!
+ * optree_print_extensions() - Internal routine to write the per-extension
+ *			       totals accumulated while writing a region's
+ *			       opcodes.
+ *
+ *	@param	walk	The totals accumulated by optree_print_counter().
+ */
 void
-prefix_parse(xmlNode *node)
+optree_print_extensions(const struct print_walk *walk)
 {
-	const xmlAttr *attr;
-	struct Prefix *prefix;
+	char buffer[32];
+	opext_t ext;
 
-	if (prefix_count >= MAX_PREFIXES) {
-		fatal(EX_SOFTWARE, "cannot specify more than %u prefixes",
-		      MAX_PREFIXES);
-	}
+	xmlTextWriterStartElement(writer, "isa");
 
-	prefix = &prefix_index[prefix_count];
+	for (ext = 0; ext < NUMOPEXTS; ext++) {
 
-	for (attr = node->properties; attr != NULL; attr = attr->next) {
-		const char *name = attr->name;
-		const char *value = XML_GET_CONTENT(attr->children);
+		if (walk->ext_n[ext] == 0 && !opt_printzero)
+			continue;
 
-		if (strcmp(name, "bitmask") == 0)
-			prefix->bitmask = strdup(value);
-		else if (strcmp(name, "detail") == 0)
-			prefix->detail = strdup(value);
-	}
+		xmlTextWriterStartElement(writer, "extension");
+		xmlTextWriterWriteAttribute(writer, "name", opext_name[ext]);
 
-	/*
-	 * Verify the prefix looks complete.
-	 */
-	if (prefix->bitmask == NULL) {
-		fatal(EX_DATAERR, "bitmask missing at %ld",
-		      XML_GET_LINE(node));
+		snprintf(buffer, sizeof(buffer), "%llu",
+			 (unsigned long long)walk->ext_n[ext]);
+		xmlTextWriterWriteAttribute(writer, "n", buffer);
+
+		if (walk->ext_cycles[ext] != 0) {
+			snprintf(buffer, sizeof(buffer), "%llu",
+				 (unsigned long long)walk->ext_cycles[ext]);
+			xmlTextWriterWriteAttribute(writer, "cycles", buffer);
+		}
+
+		xmlTextWriterEndElement(writer /* "extension" */);
 	}
 
-	prefix->node.type = PREFIX;
-	prefix->node.mask.len = sizeof(prefix->node.mask);
-	prefix->node.match.len = sizeof(prefix->node.match);
+	xmlTextWriterEndElement(writer /* "isa" */);
+}
 
-	parse_bitmask(prefix->bitmask,
-		      &prefix->node.mask.val, &prefix->node.match.val);
 
-	if (!optree_insert(&prefix->node)) {
-		prefix_free(&prefix);
-		return;
-	}
+/*!
+ * opclass_of() - Internal routine to classify an opcode by its operands.
+ *
+ *	Opcodes that both read and write memory are read-modify-write;
+ *	otherwise any memory operand makes an opcode a load or store.
+ *	Opcodes without memory operands are classed by whether they take an
+ *	immediate and then by whether they have several register operands,
+ *	a single one (e.g. PUSH or INC of a register) or none.
+ *	Whether an opcode uses MMX/SSE registers is tracked separately
+ *	(OPCLASS_SIMD) and does not affect the class returned.
+ *
+ *	@param	args	The opcode's OPARG_* flags.
+ *
+ *	@return	the opcode's class.
+ */
+enum opclass
+opclass_of(uint8_t args)
+{
 
-	prefix->len = (strlen(prefix->bitmask) + 7) / 8;
-	prefix->id = prefix_count;
-	prefix->mask = 1 << prefix_count;
-	prefix_count++;
+	if ((args & (OPARG_MEMREAD | OPARG_MEMWRITE)) ==
+	    (OPARG_MEMREAD | OPARG_MEMWRITE))
+		return OPCLASS_RMW;
+	if ((args & OPARG_MEMWRITE) != 0)
+		return OPCLASS_STORE;
+	if ((args & OPARG_MEMREAD) != 0)
+		return OPCLASS_LOAD;
+	if ((args & OPARG_IMM) != 0)
+		return OPCLASS_IMMEDIATE;
+	if ((args & OPARG_REGS) != 0)
+		return OPCLASS_REGISTER;
+	if ((args & (OPARG_REG | OPARG_SIMD)) != 0)
+		return OPCLASS_SINGLEREG;
+	return OPCLASS_OTHER;
 }
 
 
+/*!
+ * optree_parsefile() - Load the prefixes and opcodes from an opcode list.
+ *
+ *	@param	filepath	Path of the opcode list to load.
+ */
 void
-prefix_free(struct Prefix **prefixp)
+optree_parsefile(const char *filepath)
 {
-	struct Prefix *prefix = *prefixp;
+	isa_t isa;
+
+	if (!optree_initialized)
+		optree_init();
 
-	*prefixp = NULL;
+	isa = oplist_load(filepath, optree_parse_entry, NULL);
 
-	if (prefix->bitmask != NULL)
-		free(prefix->bitmask);
-	if (prefix->detail != NULL)
-		free(prefix->detail);
+	op_loaded[isa] = true;
+	debug("loaded %s opcodes from %s", isa_name[isa], filepath);
 }
 
 
+/*!
+ * optree_parse_entry() - Add a prefix or opcode loaded from an opcode list
+ *			  to the opcode trees.
+ *
+ *	Called by oplist_load() for each entry in the opcode list.
+ */
 void
-parse_bitmask(const char *bitstr, uint32_t *maskp, uint32_t *matchp)
+optree_parse_entry(isa_t isa, const struct oplist_entry *ent,
+		   void *arg __unused)
 {
-	uint32_t mask;
-	uint32_t match;
-	uint32_t i;
 
-	mask = match = 0;
-	i = 1 << ((sizeof(i) * 8) - 1);		/* Set high bit. */
+	optree_add(isa, ent);
+}
 
-	while (*bitstr != '\0') {
-		assert(i != 0);
 
-		if (strchr("01xX", *bitstr) == NULL) {
-			fatal(EX_DATAERR,
-			      "character '%c' not allowed in bitstr", *bitstr);
-		}
+/*!
+ * optree_load_builtin() - Load the opcode lists compiled into the binary.
+ *
+ *	The distributed opcode lists are converted to C by opgen when dyntrace
+ *	is built so they can be loaded without parsing any XML.
+ */
+void
+optree_load_builtin(void)
+{
+	const struct oplist_builtin *ol;
+	uint i;
+
+	if (!optree_initialized)
+		optree_init();
 
-		if (tolower(*bitstr) != 'x')
-			mask |= i;
-		if (*bitstr == '1')
-			match |= i;
+	for (ol = oplist_builtins; ol->name != NULL; ol++) {
+		for (i = 0; i < ol->nentries; i++)
+			optree_add(ol->isa, &ol->entries[i]);
 
-		i >>= 1;
-		bitstr++;
+		op_loaded[ol->isa] = true;
+		debug("loaded %s opcodes from built-in %s",
+		      isa_name[ol->isa], ol->name);
 	}
+}
 
-	/*
-	 * Since the opcodes are defined by a consecutive sequence of bits,
-	 * undo any host byte ordering.
-	 */
-	*maskp = htonl(mask);
-	*matchp = htonl(match);
+
+/*!
+ * optree_add() - Add a prefix or opcode to an instruction set's tree.
+ *
+ *	@param	isa	The instruction set the entry belongs to.
+ *
+ *	@param	ent	The prefix or opcode.  The entry's strings are
+ *			referenced, not copied.
+ *
+ *	@return	true if the entry was added, false if an entry with the same
+ *		bit string already exists.
+ */
+bool
+optree_add(isa_t isa, const struct oplist_entry *ent)
+{
+
+	if (ent->prefix)
+		return prefix_add(isa, ent);
+	return opcode_add(isa, ent);
+}
+
+
+bool
+opcode_add(isa_t isa, const struct oplist_entry *ent)
+{
+	struct Opcode *op;
+
+	op = opcode_alloc();
+	op->bitmask = ent->bitmask;
+	op->mnemonic = ent->mnemonic;
+	op->detail = ent->detail;
+	op->args = ent->args;
+	op->extension = ent->extension;
+	memcpy(op->node.mask.val, ent->mask, OPKEY_LEN);
+	memcpy(op->node.match.val, ent->match, OPKEY_LEN);
+
+	/* The opcode is left in the arena if it could not be added. */
+	if (!optree_insert(isa, &op->node))
+		return false;
+
+	return true;
+}
+
+
+struct Opcode *
+opcode_alloc(void)
+{
+	struct Opcode *op;
+
+	op = arena_alloc(op_arena, sizeof(*op));
+
+	op->node.type = OPCODE;
+	op->node.mask.len = sizeof(op->node.mask);
+	op->node.match.len = sizeof(op->node.match);
+
+	return op;
 }
 
+
+bool
+prefix_add(isa_t isa, const struct oplist_entry *ent)
+{
+	struct Prefix *prefix;
+
+	if (prefix_count[isa] >= MAX_PREFIXES) {
+		fatal(EX_SOFTWARE, "cannot specify more than %u %s prefixes",
+		      (uint)MAX_PREFIXES, isa_name[isa]);
+	}
+
+	prefix = &prefix_index[isa][prefix_count[isa]];
+	memset(prefix, 0, sizeof(*prefix));
+
+	prefix->bitmask = ent->bitmask;
+	prefix->detail = ent->detail;
+
+	prefix->node.type = PREFIX;
+	prefix->node.mask.len = sizeof(prefix->node.mask);
+	prefix->node.match.len = sizeof(prefix->node.match);
+	memcpy(prefix->node.mask.val, ent->mask, OPKEY_LEN);
+	memcpy(prefix->node.match.val, ent->match, OPKEY_LEN);
+
+	if (!optree_insert(isa, &prefix->node))
+		return false;
+
+	prefix->len = (strlen(prefix->bitmask) + 7) / 8;
+	prefix->id = prefix_count[isa];
+	prefix->mask = 1 << prefix_count[isa];
+	prefix_count[isa]++;
+
+	return true;
+}
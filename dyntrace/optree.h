@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2004,2005 Kelly Yancey
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $kbyanc$
+ */
+
+#ifndef _INCLUDE_DYNTRACE_OPTREE_H
+#define	_INCLUDE_DYNTRACE_OPTREE_H
+
+#include <sys/cdefs.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "radix.h"
+
+/*
+ * Data structures describing opcodes and prefixes shared between the opcode
+ * list parser and the decoder engines.
+ */
+
+
+/*
+ * Maximum length of an opcode bit string, in bytes.  This is the maximum
+ * length of an x86 instruction so opcodes can include everything up to and
+ * including any immediate operands.
+ */
+#define	OPKEY_LEN	15
+
+
+/*!
+ * @struct bitval
+ *
+ * Data structure representing a string of bits up to OPKEY_LEN bytes long.
+ * Used as a key for radix tree lookups so the first byte must include the
+ * length of the structure in bytes (simulating a BSD sockaddr structure for
+ * which the radix code was originally designed).  The bits are stored in
+ * the same order as the instruction text they describe; bits beyond the end
+ * of an opcode's bit string are zero in both its mask and match.
+ *
+ *	@param	len		Length of the structure in bytes.
+ *				Same as sizeof(struct bitval).
+ *
+ *	@param	val		Storage for bit string.
+ */
+struct bitval {
+	uint8_t		 len;
+	uint8_t		 val[OPKEY_LEN];
+};
+
+
+/*!
+ * @struct OpTreeNode
+ *
+ * Data structure representing a single opcode.  This is used as an entry in
+ * the radix tree so the first 2 fields must be pointers to radix tree nodes
+ * (simulating a BSD rtentry structure).
+ */
+struct OpTreeNode {
+	struct radix_node rn[2];
+	struct bitval	 match; 
+	struct bitval	 mask;
+	enum { OPCODE, PREFIX } type;
+};
+
+
+typedef uint prefixmask_t;
+#define	PREFIXMASK_EMPTY	0
+#define	MAX_PREFIXES		(sizeof(prefixmask_t) * 8)
+
+struct Prefix {
+	struct OpTreeNode node;
+
+	uint8_t		 len;
+	uint8_t		 id;
+	prefixmask_t	 mask;
+	const char	*bitmask;
+	const char	*detail;
+};
+
+
+/*!
+ * @struct counter
+ *
+ *	The usage count and timing of an opcode executed with a given set of
+ *	prefixes in a given bucket: a memory region type or, when counting
+ *	by object, an object (see optree_update()).  Counters are created
+ *	when an opcode is first executed with that combination and live in
+ *	a single table, indexed by their identifiers, for the life of the
+ *	process.
+ *
+ *	@param	op		The opcode counted.
+ *
+ *	@param	prefixmask	Prefix mask this counter is for.
+ *
+ *	@param	bucket		Region type or object this counter is for.
+ *
+ *	@param	count		The number of times the opcode has been
+ *				executed with our list of prefixes.
+ *
+ *	@param	cycles_total	The total number of CPU cycles accumulated
+ *				across all executions.
+ *
+ *	@param	cycles_min	The minimum number of CPU cycles for any
+ *				single execution.
+ *
+ *	@param	cycles_max	The maximum number of CPU cycles for any
+ *				single execution.
+ *
+ *	@param	hist		Identifier of the histogram of CPU cycles per
+ *				execution, or zero if no execution has taken
+ *				any cycles (e.g. cycles are not measured).
+ */
+struct counter {
+	struct Opcode	*op;
+	prefixmask_t	 prefixmask;
+	uint		 bucket;
+	uint32_t	 hist;
+
+	uint64_t	 n;
+	uint64_t	 cycles_total;
+	uint		 cycles_min;
+	uint		 cycles_max;
+};
+
+
+/*
+ * Kinds of operands an opcode has, from the <arg> elements of its
+ * description in the opcode list.
+ */
+#define	OPARG_MEMREAD		0x01	/* Reads memory. */
+#define	OPARG_MEMWRITE		0x02	/* Writes memory. */
+#define	OPARG_IMM		0x04	/* Immediate operand. */
+#define	OPARG_REG		0x08	/* General or special register. */
+#define	OPARG_SIMD		0x10	/* MMX or SSE register. */
+#define	OPARG_REGS		0x20	/* More than one register operand. */
+
+/*
+ * Instruction set extensions opcodes belong to, from the extension
+ * attribute of their description in the opcode list.  The AVX extensions
+ * are not described by the opcode lists; VEX and EVEX encoded instructions
+ * are recognized by the length decoder instead.
+ */
+typedef enum {
+	OPEXT_BASE		= 0,	/* General-purpose instructions */
+	OPEXT_X87		= 1,
+	OPEXT_MMX		= 2,
+	OPEXT_SSE		= 3,
+	OPEXT_SSE2		= 4,
+	OPEXT_SSE3		= 5,
+	OPEXT_SSSE3		= 6,
+	OPEXT_SSE41		= 7,
+	OPEXT_SSE42		= 8,
+	OPEXT_AVX128		= 9,	/* VEX.128 */
+	OPEXT_AVX256		= 10,	/* VEX.256 */
+	OPEXT_AVX512		= 11	/* EVEX */
+} opext_t;
+
+#define	NUMOPEXTS		 12
+
+extern const char *opext_name[NUMOPEXTS];
+
+
+/*!
+ * @struct Opcode
+ */
+struct Opcode {
+	struct OpTreeNode node;
+
+	isa_t		 isa;		/* Instruction set; set for output. */
+	uint		 order;		/* Output position within isa. */
+
+	const char	*bitmask;
+	const char	*mnemonic;
+	const char	*detail;
+	uint8_t		 args;		/* OPARG_* flags. */
+	opext_t		 extension;
+};
+
+
+/*!
+ * @struct oplist_entry
+ *
+ *	A prefix or opcode as described in an opcode list.
+ *
+ *	@param	prefix		true for a prefix, false for an opcode.
+ *
+ *	@param	mnemonic	The opcode's mnemonic; NULL for prefixes.
+ *
+ *	@param	detail		Optional detail string; may be NULL.
+ *
+ *	@param	args		OPARG_* flags describing the opcode's
+ *				operands; zero for prefixes.
+ *
+ *	@param	extension	Instruction set extension of the opcode;
+ *				OPEXT_BASE for prefixes.
+ *
+ *	@param	mask		Significant bits of \a bitmask, as parsed by
+ *				oplist_parse_bitmask().
+ *
+ *	@param	match		Values of the significant bits.
+ */
+struct oplist_entry {
+	bool		 prefix;
+	const char	*bitmask;
+	const char	*mnemonic;
+	const char	*detail;
+	uint8_t		 args;
+	opext_t		 extension;
+	uint8_t		 mask[OPKEY_LEN];
+	uint8_t		 match[OPKEY_LEN];
+};
+
+typedef void oplist_handler_t(isa_t isa, const struct oplist_entry *ent,
+			      void *arg);
+
+
+/*!
+ * @struct oplist_builtin
+ *
+ *	An opcode list compiled into the dyntrace binary by opgen.  The
+ *	oplist_builtins array is terminated by an entry with a NULL name.
+ *
+ *	@param	name		File name of the opcode list the entries were
+ *				generated from.
+ */
+struct oplist_builtin {
+	const char	*name;
+	isa_t		 isa;
+	const struct oplist_entry *entries;
+	uint		 nentries;
+};
+
+
+__BEGIN_DECLS
+
+/* A decoder: find the opcode or prefix at the start of OPKEY_LEN bytes. */
+typedef struct OpTreeNode *optree_lookup_t(isa_t isa, const void *keyptr);
+
+/* Compile a decoder for an instruction set from its opcodes. */
+typedef void optree_compile_t(isa_t isa, struct OpTreeNode * const *nodes,
+			      uint nnodes, optree_lookup_t *lookup);
+
+/* Determine the length of the instruction at the start of the text. */
+typedef uint optree_len_t(isa_t isa, const void *text, size_t textlen,
+			  uint *flagsp);
+
+/*!
+ * @struct decoder
+ *
+ *	A decoder engine, selectable with optree_set_decoder().
+ *
+ *	@param	init		Build the engine's structures for an
+ *				instruction set once its opcode lists are
+ *				loaded; NULL if there is nothing to build.
+ *
+ *	@param	lookup		Identify the opcode or prefix at the start
+ *				of OPKEY_LEN bytes of instruction text.
+ *
+ *	@param	len		Determine the length of an instruction.
+ *
+ *	@param	initialized	Whether init has been called for every
+ *				instruction set.
+ */
+struct decoder {
+	const char	*name;
+	optree_compile_t *init;
+	optree_lookup_t	*lookup;
+	optree_len_t	*len;
+	bool		 initialized;
+};
+
+/* oplist.c */
+extern isa_t	 oplist_parsefile(const char *filepath,
+				  oplist_handler_t *handler, void *arg);
+extern isa_t	 oplist_load(const char *filepath,
+			     oplist_handler_t *handler, void *arg);
+extern void	 oplist_parse_bitmask(const char *bitstr,
+				      uint8_t *mask, uint8_t *match);
+
+/* oplist-builtin.c (generated by opgen) */
+extern const struct oplist_builtin oplist_builtins[];
+
+/* optable.c */
+extern optree_compile_t optable_compile;
+extern struct OpTreeNode *optable_lookup(isa_t isa, const void *keyptr);
+
+/* opscan.c */
+extern optree_compile_t opscan_compile;
+extern struct OpTreeNode *opscan_lookup(isa_t isa, const void *keyptr);
+
+/* oplen.c */
+#define	OPLEN_BRANCH		0x01	/* May not fall through. */
+#define	OPLEN_VEX		0x02	/* VEX or EVEX encoded. */
+#define	OPLEN_VEX256		0x04	/* 256-bit vector length. */
+#define	OPLEN_EVEX		0x08	/* EVEX encoded. */
+#define	OPLEN_SYSCALL		0x10	/* May enter the kernel. */
+
+extern optree_len_t oplen_decode;
+
+__END_DECLS
+
+#endif
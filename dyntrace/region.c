@@ -27,9 +27,13 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
+#include <sys/stat.h>
 
 #include <assert.h>
+#include <fnmatch.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
@@ -38,31 +42,105 @@
 
 
 /*
- * Minimum and maximum number of bytes to cache per region of the target
- * process's address space.
+ * The contents of read-only regions are cached in pages of this many bytes,
+ * read from the target as they are first referenced.  Pages from all
+ * regions share a single budget (see region_cache_set_size()); when it is
+ * exhausted, the least recently used page is discarded.
  */
-#define	REGION_BUFFER_MINSIZE	32
-#define	REGION_BUFFER_MAXSIZE	1024*1024
+#define	REGION_CACHE_PAGE	4096
+#define	REGION_CACHE_DEFAULT_MB	64
+
+/*
+ * Decode results for read-only text regions are kept in tables covering
+ * this many bytes each, allocated as instructions in them are decoded.
+ */
+#define	REGION_DECODE_PAGE	4096
+
+/* Initial number of entries allocated to a region list. */
+#define	REGION_LIST_MINSIZE	64
+
+/* Initial number of object names allocated. */
+#define	REGION_OBJECTS_MINSIZE	64
+
+/*
+ * Number of bytes at the start of a region compared against the target's
+ * memory to check a file mapped in its place holds the same contents.
+ */
+#define	REGION_MAP_CHECKLEN	256
+
+
+struct region_page {
+	TAILQ_ENTRY(region_page) lru;	/* Least recently used first. */
+	region_t	 region;	/* Region the page belongs to. */
+	size_t		 index;		/* Page number within the region. */
+	size_t		 len;		/* Bytes read from the target. */
+	uint8_t		 data[REGION_CACHE_PAGE];
+};
+
+TAILQ_HEAD(region_page_list, region_page);
+
+
+struct region_decode_page {
+	struct region_decode_page *next;	/* Next free page. */
+	isa_t		 isa;		/* Instruction set decoded for. */
+	uint32_t	 id[REGION_DECODE_PAGE];  /* Zero if not decoded. */
+};
 
 
 struct region_info {
-	LIST_ENTRY(region_info) link;
+	region_list_t	 rlist;		/* List the region belongs to. */
+	region_t	 next;		/* Next free region. */
 
 	vm_offset_t	 start;
 	vm_offset_t	 end;
 
 	region_type_t	 type;
 	bool		 readonly;
+	uint		 object;	/* Object identifier; zero if none. */
+
+	struct region_page **pages;	/* Cached contents by page. */
+	size_t		 npages;	/* Entries in pages. */
+
+	struct region_decode_page **decode;	/* Decode results by page. */
+	size_t		 decodepages;	/* Entries in decode. */
 
-	vm_offset_t	 bufaddr;	/* First address cached. */
-	size_t		 buflen;	/* Bytes in cache buffer. */
-	uint8_t		*buffer;
-	size_t		 bufsize;	/* Memory allocated to buffer. */
+	void		*map;		/* Backing file mapping, or NULL. */
+	size_t		 maplen;	/* Bytes of the region mapped. */
+	bool		 maptried;	/* region_map() already called. */
 };
 
 
+/*
+ * A region list is an array of non-overlapping regions sorted by address,
+ * searched by bisection.  The most recently found region is checked first
+ * as execution tends to stay in the same region for a while.  Similarly,
+ * memory maps list regions in address order so each update during a
+ * refresh usually applies to the region following the previous one.
+ *
+ * Region records and decode tables are allocated from an arena belonging
+ * to the list so they are all freed at once with it.  Those removed from
+ * the list before then are kept on free lists for reuse.
+ */
 struct region_list {
-	LIST_HEAD(, region_info) head;	/* List of regions. */
+	region_t	*regions;
+	size_t		 n;
+	size_t		 size;		/* Entries allocated. */
+	region_t	 last;		/* Most recently found; may be NULL. */
+	size_t		 next;		/* Index after last update. */
+
+	arena_t		 arena;
+	region_t	 freeregions;
+	struct region_decode_page *freedecode;
+};
+
+
+/*
+ * A rule grouping the objects whose names match a shell pattern under a
+ * single name; see region_object_rule().
+ */
+struct region_object_rule {
+	char		*name;
+	char		*pattern;
 };
 
 
@@ -76,8 +154,32 @@ const char *region_type_name[NUMREGIONTYPES] = {
 	"stack"
 };
 
+static struct region_page_list region_lru =
+			TAILQ_HEAD_INITIALIZER(region_lru);
+static size_t	 region_cache_pages;	/* Pages currently cached. */
+static size_t	 region_cache_limit =	/* Maximum number of pages cached. */
+			REGION_CACHE_DEFAULT_MB * 1024 * 1024 /
+			REGION_CACHE_PAGE;
+static uint64_t	 region_cache_hits;
+static uint64_t	 region_cache_misses;
+static uint64_t	 region_cache_evictions;
+
+static struct region_object_rule *object_rules = NULL;
+static uint	 nobject_rules = 0;
+static char	**object_names = NULL;	/* Indexed by identifier - 1. */
+static uint	 nobjects = 0;
+static uint	 maxobjects = 0;
+
+static size_t	 region_index(region_list_t rlist, vm_offset_t addr);
 static region_t	 region_find(region_list_t rlist, vm_offset_t addr);
-static void	 region_remove(region_t *regionp);
+static void	 region_remove(region_list_t rlist, size_t first, size_t last);
+static void	 region_free(region_t region);
+static void	 region_release(region_t region);
+static void	 region_decode_discard(region_t region);
+static void	 region_page_free(struct region_page *page);
+static struct region_page *
+		 region_page_get(target_t targ, region_t region,
+				 size_t index);
 
 
 /*!
@@ -94,7 +196,16 @@ region_list_new(void)
 	if (rlist == NULL)
 		fatal(EX_OSERR, "malloc: %m");
 
-	LIST_INIT(&rlist->head);
+	rlist->size = REGION_LIST_MINSIZE;
+	rlist->regions = malloc(rlist->size * sizeof(*rlist->regions));
+	if (rlist->regions == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+	rlist->n = 0;
+	rlist->last = NULL;
+	rlist->next = 0;
+	rlist->arena = arena_new();
+	rlist->freeregions = NULL;
+	rlist->freedecode = NULL;
 	return rlist;
 }
 
@@ -110,16 +221,46 @@ void
 region_list_done(region_list_t *rlistp)
 {
 	region_list_t rlist = *rlistp;
-	region_t region;
+	size_t i;
 
 	*rlistp = NULL;
 
-	while (!LIST_EMPTY(&rlist->head)) {
-		region = LIST_FIRST(&rlist->head);
-		region_remove(&region);
+	for (i = 0; i < rlist->n; i++)
+		region_release(rlist->regions[i]);
+	arena_done(&rlist->arena);
+	free(rlist->regions);
+	free(rlist);
+}
+
+
+/*!
+ * region_index() - Internal routine to locate the position in a region list
+ *		    of the first region ending after the specified address.
+ *
+ *	@param	rlist	Region list to search.
+ *
+ *	@param	addr	The address to locate.
+ *
+ *	@return	the index of the region enclosing the address if there is
+ *		one, otherwise the index at which a region starting at the
+ *		address would be inserted.
+ */
+size_t
+region_index(region_list_t rlist, vm_offset_t addr)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = rlist->n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rlist->regions[mid]->end > addr)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
 
-	free(rlist);
+	return lo;
 }
 
 
@@ -132,18 +273,16 @@ region_list_done(region_list_t *rlistp)
  *	@param	addr	The address to locate.
  *
  *	This is functionally identical to the region_lookup() routine except
- *	that it does not reorder to region list.  The intention is for
- *	region_find() to be used to locate regions without purturbing the list.
+ *	that it does not remember the region found.
  */
 region_t
 region_find(region_list_t rlist, vm_offset_t addr)
 {
-	region_t region;
+	size_t i;
 
-	LIST_FOREACH(region, &rlist->head, link) {		
-		if (region->start <= addr && region->end > addr)
-			return region;
-	}
+	i = region_index(rlist, addr);
+	if (i < rlist->n && rlist->regions[i]->start <= addr)
+		return rlist->regions[i];
 
 	return NULL;
 }
@@ -157,48 +296,154 @@ region_find(region_list_t rlist, vm_offset_t addr)
  *
  *	@param	addr	The address to locate.
  *
- *	Recently-accessed regions are moved to the head of the region list
- *	on the assumption they are most likely to be referenced again in
- *	the near future (due to locality of reference).
+ *	The most recently found region is checked before searching the list
+ *	on the assumption it is the most likely to be referenced again (due
+ *	to locality of reference).
  */
 region_t
 region_lookup(region_list_t rlist, vm_offset_t addr)
 {
 	region_t region;
 
-	region = region_find(rlist, addr);
-
-	if (region == LIST_FIRST(&rlist->head) || region == NULL)
+	region = rlist->last;
+	if (region != NULL && region->start <= addr && region->end > addr)
 		return region;
 
-	/*
-	 * Move the matched region to the head of the list to take advantage of
-	 * the locality of reference in the traced code.
-	 */
-	LIST_REMOVE(region, link);
-	LIST_INSERT_HEAD(&rlist->head, region, link);
+	region = region_find(rlist, addr);
+	if (region != NULL)
+		rlist->last = region;
 
 	return region;
 }
 
 
 /*!
- * region_remove() - Remove a region from its region list and free it.
+ * region_next() - Locate the first region in a region list which ends after
+ *		   the specified address.
+ *
+ *	@param	rlist	Region list to search.
+ *
+ *	@param	addr	The address to search from.
+ *
+ *	@return	the region enclosing the address or, if there is none, the
+ *		region following it.  NULL if there is neither.
+ */
+region_t
+region_next(region_list_t rlist, vm_offset_t addr)
+{
+	size_t i;
+
+	i = region_index(rlist, addr);
+	return (i < rlist->n) ? rlist->regions[i] : NULL;
+}
+
+
+/*!
+ * region_remove() - Internal routine to remove a range of regions from a
+ *		     region list and free them.
+ *
+ *	@param	rlist	Region list to remove the regions from.
  *
- *	@param	regionp	Pointer to region handle to remove.
+ *	@param	first	Index of the first region to remove.
  *
- *	@post	The region handle pointed to by regionp is invalidated.
+ *	@param	last	Index after the last region to remove.
  */
 void
-region_remove(region_t *regionp)
+region_remove(region_list_t rlist, size_t first, size_t last)
 {
-	region_t region = *regionp;
+	size_t i;
+
+	assert(first <= last && last <= rlist->n);
+
+	for (i = first; i < last; i++) {
+		if (rlist->regions[i] == rlist->last)
+			rlist->last = NULL;
+		region_free(rlist->regions[i]);
+	}
 
-	*regionp = NULL;
-	LIST_REMOVE(region, link);
-	if (region->buffer != NULL)
-		free(region->buffer);
-	free(region);
+	memmove(&rlist->regions[first], &rlist->regions[last],
+		(rlist->n - last) * sizeof(*rlist->regions));
+	rlist->n -= last - first;
+}
+
+
+/*!
+ * region_free() - Internal routine to free a region and its caches.
+ *
+ *	@param	region	The region to free.
+ *
+ *	The region's record and decode tables are put on its list's free
+ *	lists.
+ */
+void
+region_free(region_t region)
+{
+	region_list_t rlist = region->rlist;
+
+	region_decode_discard(region);
+	region_release(region);
+
+	region->next = rlist->freeregions;
+	rlist->freeregions = region;
+}
+
+
+/*!
+ * region_release() - Internal routine to release the resources of a region
+ *		      which are not allocated from its list's arena.
+ *
+ *	@param	region	The region to release the resources of.
+ */
+void
+region_release(region_t region)
+{
+	size_t i;
+
+	if (region->pages != NULL) {
+		for (i = 0; i < region->npages; i++) {
+			if (region->pages[i] != NULL)
+				region_page_free(region->pages[i]);
+		}
+		free(region->pages);
+		region->pages = NULL;
+	}
+	free(region->decode);
+	region->decode = NULL;
+	if (region->map != NULL) {
+		munmap(region->map, region->maplen);
+		region->map = NULL;
+	}
+}
+
+
+/*!
+ * region_decode_discard() - Internal routine to discard the decode results
+ *			     recorded for a region.
+ *
+ *	@param	region	The region to discard the decode results of.
+ *
+ *	The decode tables are put on the region list's free list.
+ */
+void
+region_decode_discard(region_t region)
+{
+	region_list_t rlist = region->rlist;
+	struct region_decode_page *page;
+	size_t i;
+
+	if (region->decode == NULL)
+		return;
+
+	for (i = 0; i < region->decodepages; i++) {
+		page = region->decode[i];
+		if (page == NULL)
+			continue;
+		page->next = rlist->freedecode;
+		rlist->freedecode = page;
+	}
+	free(region->decode);
+	region->decode = NULL;
+	region->decodepages = 0;
 }
 
 
@@ -216,92 +461,250 @@ region_remove(region_t *regionp)
  *
  *	@param	readonly Whether or not the region is read-only.
  *
+ *	@return	the new or updated region.
+ *
  *	Called from the system-specific memory map parser code to update
- *	the given region list.  Existing regions may be extended or replaced.
+ *	the given region list.  Existing regions may be extended or replaced;
+ *	any which overlap the new region are removed.
  */
-void
+region_t
 region_update(region_list_t rlist, vm_offset_t start, vm_offset_t end,
 	      region_type_t type, bool readonly)
 {
 	region_t region;
+	size_t i;
 
 	assert(end > start);
 
 	/*
-	 * Lookup any existing regions which contain the new regions' start
-	 * address.  This will find overlapping regions, but not proper
-	 * sub-regions.  The latter is OK as the new region will be ahead
-	 * of the old region in the list so it will effectively "block" it.
-	 * This isn't ideal, but works as a time versus memory tradeoff.
+	 * Find the first existing region which ends after the new region's
+	 * start address.  If the new region exactly matches or is an
+	 * extension of it, then we simply update the existing region.  This
+	 * is the most common case.
 	 */
-	while ((region = region_find(rlist, start)) != NULL) {
+	i = rlist->next;
+	if (i > rlist->n || (i < rlist->n && rlist->regions[i]->end <= start) ||
+	    (i > 0 && rlist->regions[i - 1]->end > start))
+		i = region_index(rlist, start);
 
-		/*
-		 * If the new region exactly matches or is an extension of an
-		 * existing region, then we simply update the existing region
-		 * and return.  This is the most common case.
-		 */
+	if (i < rlist->n) {
+		region = rlist->regions[i];
 		if (region->start == start && region->end <= end &&
 		    region->type == type && region->readonly == readonly) {
+			if (region->end < end)
+				region_clear(rlist, region->end, end);
 			region->end = end;
-			return;
+			rlist->next = i + 1;
+			return region;
 		}
-
-		/*
-		 * Remove any regions that overlap the start address.
-		 */
-		region_remove(&region);
 	}
 
-	assert(region == NULL);
-
 	/*
-	 * Create a new region record and add it to the head of the list.
+	 * Remove whatever the new region overlaps.
 	 */
+	region_clear(rlist, start, end);
+	i = region_index(rlist, start);
+	rlist->next = i + 1;
 
-	region = calloc(1, sizeof(*region));
-	if (region == NULL)
-		fatal(EX_OSERR, "malloc: %m");
+	/*
+	 * Create a new region record and insert it in the list.
+	 */
+	region = rlist->freeregions;
+	if (region != NULL) {
+		rlist->freeregions = region->next;
+		memset(region, 0, sizeof(*region));
+	}
+	else
+		region = arena_alloc(rlist->arena, sizeof(*region));
+	region->rlist = rlist;
+
+	if (rlist->n == rlist->size) {
+		rlist->size *= 2;
+		rlist->regions = realloc(rlist->regions,
+					 rlist->size * sizeof(*rlist->regions));
+		if (rlist->regions == NULL)
+			fatal(EX_OSERR, "realloc: %m");
+	}
 
-	LIST_INSERT_HEAD(&rlist->head, region, link);
+	memmove(&rlist->regions[i + 1], &rlist->regions[i],
+		(rlist->n - i) * sizeof(*rlist->regions));
+	rlist->regions[i] = region;
+	rlist->n++;
 
 	region->start = start;
 	region->end = end;
 	region->type = type;
 	region->readonly = readonly;
 
-	if (!readonly)
+	return region;
+}
+
+
+/*!
+ * region_replace() - Update the given region list to include a region with
+ *		      the specified properties, discarding whatever was
+ *		      previously known about its address range.
+ *
+ *	@param	rlist	Region list to update.
+ *
+ *	@param	start	Memory region start address.
+ *
+ *	@param	end	Memory region end address.
+ *
+ *	@param	type	Type of memory region.
+ *
+ *	@param	readonly Whether or not the region is read-only.
+ *
+ *	@return	the new region.
+ *
+ *	Unlike region_update(), an existing region with the same properties
+ *	is not kept: its cached contents, decode results, file mapping and
+ *	object describe memory which has since been mapped over.
+ */
+region_t
+region_replace(region_list_t rlist, vm_offset_t start, vm_offset_t end,
+	       region_type_t type, bool readonly)
+{
+
+	region_clear(rlist, start, end);
+	return region_update(rlist, start, end, type, readonly);
+}
+
+
+/*!
+ * region_clear() - Remove an address range from a region list.
+ *
+ *	@param	rlist	Region list to update.
+ *
+ *	@param	start	Start address of the range to remove.
+ *
+ *	@param	end	End address of the range to remove.
+ *
+ *	Regions entirely within the range are removed.  The parts of regions
+ *	partially overlapping the range that lie outside of it are kept as
+ *	new regions of the same type and object, without any cached contents.
+ */
+void
+region_clear(region_list_t rlist, vm_offset_t start, vm_offset_t end)
+{
+	struct region_info head, tail;
+	region_t region;
+	size_t i, j;
+
+	assert(end > start);
+
+	i = region_index(rlist, start);
+	for (j = i; j < rlist->n; j++) {
+		if (rlist->regions[j]->start >= end)
+			break;
+	}
+	if (i == j)
 		return;
 
-	/*
-	 * The region is read-only so we can cache the memory contents to
-	 * save a call to the kernel for every instruction.  We cache the
-	 * minimum amount unless the region is a text segment, in which case
-	 * it is highly probable for code to be executed there so we cache
-	 * more.
-	 */
-	region->bufsize = REGION_BUFFER_MINSIZE;
+	region = rlist->regions[i];
+	head = *region;
+	head.end = start;
 
-	if (REGION_IS_TEXT(region->type))
-		region->bufsize = REGION_BUFFER_MAXSIZE;
+	region = rlist->regions[j - 1];
+	tail = *region;
+	tail.start = end;
 
-	if (region->bufsize > end - start)
-		region->bufsize = end - start;
+	region_remove(rlist, i, j);
 
-	/*
-	 * Allocate buffer to cache the region's contents.  If the allocation
-	 * fails, just pretend the region isn't read-only.  This will likely
-	 * reduce throughput of the tracer, but will allow it to continue
-	 * to run without impacting the results.
-	 */
-	region->buffer = malloc(region->bufsize);
-	if (region->buffer == NULL) {
-		warn("malloc: %m (non-fatal)");
-		region->readonly = false;
+	if (head.start < head.end) {
+		region = region_update(rlist, head.start, head.end, head.type,
+				       head.readonly);
+		region_set_object(region, head.object);
+	}
+	if (tail.start < tail.end) {
+		region = region_update(rlist, tail.start, tail.end, tail.type,
+				       tail.readonly);
+		region_set_object(region, tail.object);
 	}
 }
 
 
+/*!
+ * region_map() - Map the file backing a read-only region in place of
+ *		  reading the region's contents from the target.
+ *
+ *	@param	targ	The target process the region belongs to.
+ *
+ *	@param	region	The region to map the file for.
+ *
+ *	@param	fd	Descriptor of the file backing the region.
+ *
+ *	@param	offset	Offset in the file of the region's first byte; must be
+ *			a multiple of the page size.
+ *
+ *	@return	true if the file was mapped, false if the region's contents
+ *		will continue to be read from the target.
+ *
+ *	Reads from a mapped region are satisfied from the mapping without
+ *	any system calls.  The start of the mapping is compared against the
+ *	target's memory so that a file which does not match (e.g. it was
+ *	replaced after the target loaded it) is not used.  Only one attempt
+ *	is made to map each region; see region_can_map().
+ */
+bool
+region_map(target_t targ, region_t region, int fd, off_t offset)
+{
+	uint8_t check[REGION_MAP_CHECKLEN];
+	size_t len, checklen;
+	struct stat sb;
+	void *map;
+
+	assert(region->readonly);
+	region->maptried = true;
+
+	len = region->end - region->start;
+	if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) ||
+	    offset >= sb.st_size)
+		return false;
+	if (len > (size_t)(sb.st_size - offset))
+		len = sb.st_size - offset;
+
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+	if (map == MAP_FAILED) {
+		warn("mmap: %m (non-fatal)");
+		return false;
+	}
+
+	checklen = len;
+	if (checklen > sizeof(check))
+		checklen = sizeof(check);
+	if (target_read(targ, region->start, check, checklen) != checklen ||
+	    memcmp(check, map, checklen) != 0) {
+		debug("file does not match region at %#jx",
+		      (uintmax_t)region->start);
+		munmap(map, len);
+		return false;
+	}
+
+	region->map = map;
+	region->maplen = len;
+
+	return true;
+}
+
+
+/*!
+ * region_can_map() - Determine whether region_map() should be called for a
+ *		      region.
+ *
+ *	@param	region	The region to check.
+ *
+ *	@return	true if the region is read-only and no attempt has yet been
+ *		made to map its backing file.
+ */
+bool
+region_can_map(region_t region)
+{
+
+	return region->readonly && !region->maptried;
+}
+
+
 /*!
  * region_read() - Read contents of target process' memory utilizing the
  *		   region cache.
@@ -328,60 +731,201 @@ size_t
 region_read(target_t targ, region_t region, vm_offset_t addr,
 	    void *dest, size_t len)
 {
-	vm_offset_t start;
-	ssize_t offset;
+	struct region_page *page;
+	size_t offset, index, n, done;
 
 	assert(len > 0);
 	assert(addr + len <= region->end);
 
+	/*
+	 * Mapped regions are read from the backing file's pages directly.
+	 */
+	if (region->map != NULL &&
+	    addr + len <= region->start + region->maplen) {
+		memcpy(dest, (uint8_t *)region->map + (addr - region->start),
+		       len);
+		return len;
+	}
+
 	/*
 	 * If the region is not readonly, we cannot cache the memory contents
 	 * as they may change (e.g. self-modifying code).  So we have to ask
 	 * the kernel to supply the memory contents every time.
 	 */
-	if (!region->readonly)
+	if (!region->readonly || region_cache_limit == 0)
 		return target_read(targ, addr, dest, len);
 
-	assert(region->buffer != NULL);
-
-	offset = addr - region->bufaddr;
-
 	/*
-	 * Satisfy the request from the region's cache if we can.
+	 * Copy from each cached page the read spans, filling pages which are
+	 * not cached yet.  Reads crossing a page boundary are uncommon (they
+	 * are never longer than an instruction) so this usually loops once.
 	 */
-	if (offset >= 0 && offset + len <= region->buflen) {
-		memcpy(dest, region->buffer + offset, len);
-		return len;
+	offset = addr - region->start;
+	done = 0;
+	while (done < len) {
+		index = offset / REGION_CACHE_PAGE;
+		page = region_page_get(targ, region, index);
+		if (page == NULL)
+			return done + target_read(targ, addr + done,
+						  (uint8_t *)dest + done,
+						  len - done);
+
+		n = offset % REGION_CACHE_PAGE;
+		if (n >= page->len)
+			break;
+		if (page->len - n > len - done)
+			n = len - done;
+		else
+			n = page->len - n;
+
+		memcpy((uint8_t *)dest + done,
+		       page->data + offset % REGION_CACHE_PAGE, n);
+		done += n;
+		offset += n;
+		if (page->len < REGION_CACHE_PAGE)
+			break;
+	}
+
+	return done;
+}
+
+
+/*!
+ * region_page_get() - Internal routine to get a page of a region's contents
+ *		       from the region cache.
+ *
+ *	@param	targ	The target process the region belongs to.
+ *
+ *	@param	region	The read-only region to get the page of.
+ *
+ *	@param	index	Page number within the region.
+ *
+ *	@return	the cached page, read from the target if it was not already
+ *		cached, or NULL if memory could not be allocated for it.
+ *
+ *	The page returned becomes the most recently used.  Caching a new
+ *	page may evict the least recently used page of any region to keep
+ *	within the cache size limit.
+ */
+struct region_page *
+region_page_get(target_t targ, region_t region, size_t index)
+{
+	struct region_page **pages, *page;
+	vm_offset_t addr;
+	size_t npages, len;
+
+	if (index < region->npages && region->pages[index] != NULL) {
+		page = region->pages[index];
+		region_cache_hits++;
+		TAILQ_REMOVE(&region_lru, page, lru);
+		TAILQ_INSERT_TAIL(&region_lru, page, lru);
+		return page;
+	}
+
+	region_cache_misses++;
+
+	/* The region may have been extended since the index was sized. */
+	if (index >= region->npages) {
+		npages = (region->end - region->start +
+			  REGION_CACHE_PAGE - 1) / REGION_CACHE_PAGE;
+		assert(index < npages);
+		pages = realloc(region->pages, npages * sizeof(*pages));
+		if (pages == NULL)
+			return NULL;
+		memset(pages + region->npages, 0,
+		       (npages - region->npages) * sizeof(*pages));
+		region->pages = pages;
+		region->npages = npages;
 	}
 
 	/*
-	 * Reload the region's cache.
-	 * We start the region cache slightly before the requested addr
-	 * so that simple loops do not cause spurious cache misses.
+	 * Reuse the least recently used page if the cache is full, otherwise
+	 * allocate a new one.
 	 */
-	start = region->start;
-	if (start + region->bufsize <= addr)
-		start = region->end - region->bufsize;
-	if (start > addr)
-		start = addr + len - (region->bufsize / 2);
+	if (region_cache_pages >= region_cache_limit) {
+		page = TAILQ_FIRST(&region_lru);
+		assert(page != NULL);
+		TAILQ_REMOVE(&region_lru, page, lru);
+		page->region->pages[page->index] = NULL;
+		region_cache_evictions++;
+	}
+	else {
+		page = malloc(sizeof(*page));
+		if (page == NULL)
+			return NULL;
+		region_cache_pages++;
+	}
 
-	region->buflen = region->end - start;
-	if (region->buflen > region->bufsize)
-		region->buflen = region->bufsize;
+	addr = region->start + index * REGION_CACHE_PAGE;
+	len = region->end - addr;
+	if (len > REGION_CACHE_PAGE)
+		len = REGION_CACHE_PAGE;
 
-#if 0
-	debug("XXX region cache miss, buflen = %u", region->buflen);
-#endif
+	page->region = region;
+	page->index = index;
+	page->len = target_read(targ, addr, page->data, len);
 
-	region->buflen = target_read(targ, start, region->buffer,
-				     region->buflen);
-	region->bufaddr = start;
+	region->pages[index] = page;
+	TAILQ_INSERT_TAIL(&region_lru, page, lru);
+	return page;
+}
 
-	offset = addr - start;
-	assert(offset >= 0);
 
-	memcpy(dest, region->buffer + offset, len);
-	return len;
+/*!
+ * region_page_free() - Internal routine to remove a page from the region
+ *			cache and free it.
+ *
+ *	@param	page	The page to free.
+ */
+void
+region_page_free(struct region_page *page)
+{
+
+	TAILQ_REMOVE(&region_lru, page, lru);
+	page->region->pages[page->index] = NULL;
+	region_cache_pages--;
+	free(page);
+}
+
+
+/*!
+ * region_cache_set_size() - Set the amount of memory used to cache the
+ *			     contents of read-only regions.
+ *
+ *	@param	mb	Cache size in megabytes; zero disables the cache.
+ *
+ *	Must be called before any regions are read.
+ */
+void
+region_cache_set_size(size_t mb)
+{
+
+	assert(region_cache_pages == 0);
+	region_cache_limit = mb * (1024 * 1024 / REGION_CACHE_PAGE);
+}
+
+
+/*!
+ * region_cache_report() - Print region cache statistics.
+ *
+ *	Intended to be called when tracing completes with debug output
+ *	enabled.
+ */
+void
+region_cache_report(void)
+{
+	uint64_t lookups = region_cache_hits + region_cache_misses;
+
+	if (lookups == 0)
+		return;
+
+	debug("region cache: %llu hits, %llu misses (%.1f%% hit rate), "
+	      "%llu evictions, %zu KB cached",
+	      (unsigned long long)region_cache_hits,
+	      (unsigned long long)region_cache_misses,
+	      region_cache_hits * 100.0 / lookups,
+	      (unsigned long long)region_cache_evictions,
+	      region_cache_pages * (REGION_CACHE_PAGE / 1024));
 }
 
 
@@ -428,3 +972,272 @@ region_get_range(region_t region, vm_offset_t *startp, vm_offset_t *endp)
 
 	return (region->end - region->start);
 }
+
+
+/*!
+ * region_get_object() - Get the object a memory region belongs to.
+ *
+ *	@param	region	The memory region to get the object of.
+ *
+ *	@return	the object identifier set by region_set_object(), or zero if
+ *		the region has not been assigned to an object.
+ */
+uint
+region_get_object(region_t region)
+{
+	return region->object;
+}
+
+
+/*!
+ * region_set_object() - Assign a memory region to an object.
+ *
+ *	@param	region	The memory region to assign.
+ *
+ *	@param	object	Object identifier returned by region_object(), or
+ *			zero for none.
+ *
+ *	Decode results recorded for the region are discarded if its object
+ *	changes since they identify counters kept for the old object.
+ */
+void
+region_set_object(region_t region, uint object)
+{
+
+	assert(object <= nobjects);
+
+	if (region->object == object)
+		return;
+
+	region_decode_discard(region);
+	region->object = object;
+}
+
+
+/*!
+ * region_object_rule() - Add a rule grouping objects under a single name.
+ *
+ *	@param	rule	The rule, in the form \a name=pattern.  Objects whose
+ *			names match the shell pattern (see fnmatch(3)) are
+ *			reported as \a name.
+ *
+ *	@return	true if the rule was added, false if it is malformed.
+ *
+ *	Rules are tried in the order they were added; the first which
+ *	matches is used.  Rules must be added before the first call to
+ *	region_object().
+ */
+bool
+region_object_rule(const char *rule)
+{
+	struct region_object_rule *rules;
+	const char *eq;
+
+	assert(nobjects == 0);
+
+	eq = strchr(rule, '=');
+	if (eq == NULL || eq == rule || eq[1] == '\0')
+		return false;
+
+	rules = realloc(object_rules, (nobject_rules + 1) * sizeof(*rules));
+	if (rules == NULL)
+		fatal(EX_OSERR, "realloc: %m");
+	object_rules = rules;
+
+	rules += nobject_rules;
+	rules->name = strdup(rule);
+	if (rules->name == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+	rules->pattern = rules->name + (eq - rule) + 1;
+	rules->pattern[-1] = '\0';
+	nobject_rules++;
+
+	return true;
+}
+
+
+/*!
+ * region_object() - Get the identifier of the object with the given name.
+ *
+ *	@param	name	Name of the object; the path of the file backing a
+ *			region or a bracketed description of anonymous
+ *			memory (e.g. "[jit]").
+ *
+ *	@return	the non-zero object identifier.
+ *
+ *	The name is first replaced by that of the first rule it matches, if
+ *	any.  Identifiers are assigned in the order objects are first seen
+ *	and remain valid for the life of the process so counters can be
+ *	kept per object across target processes.
+ */
+uint
+region_object(const char *name)
+{
+	char **names;
+	uint i;
+
+	for (i = 0; i < nobject_rules; i++) {
+		if (fnmatch(object_rules[i].pattern, name, 0) == 0) {
+			name = object_rules[i].name;
+			break;
+		}
+	}
+
+	for (i = 0; i < nobjects; i++) {
+		if (strcmp(object_names[i], name) == 0)
+			return i + 1;
+	}
+
+	if (nobjects == maxobjects) {
+		maxobjects = (maxobjects == 0) ? REGION_OBJECTS_MINSIZE :
+						 maxobjects * 2;
+		names = realloc(object_names, maxobjects * sizeof(*names));
+		if (names == NULL)
+			fatal(EX_OSERR, "realloc: %m");
+		object_names = names;
+	}
+
+	object_names[nobjects] = strdup(name);
+	if (object_names[nobjects] == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+	nobjects++;
+
+	return nobjects;
+}
+
+
+/*!
+ * region_object_name() - Get the name of an object.
+ *
+ *	@param	object	Non-zero object identifier returned by
+ *			region_object().
+ *
+ *	@return	the object's name, after grouping.
+ */
+const char *
+region_object_name(uint object)
+{
+
+	assert(object > 0 && object <= nobjects);
+	return object_names[object - 1];
+}
+
+
+/*!
+ * region_object_count() - Get the number of objects seen.
+ *
+ *	@return	the highest object identifier assigned by region_object().
+ */
+uint
+region_object_count(void)
+{
+
+	return nobjects;
+}
+
+
+/*!
+ * region_decode_lookup() - Look up the decode result for the instruction at
+ *			    the specified address.
+ *
+ *	@param	region	The memory region containing the instruction.
+ *
+ *	@param	pc	Address of the instruction.
+ *
+ *	@param	isa	Instruction set the instruction is executed in.
+ *
+ *	@return	the identifier stored by region_decode_store() for the
+ *		instruction or zero if there is none.
+ *
+ *	Only read-only text regions keep decode results since the contents
+ *	of other regions may change between executions of an instruction.
+ */
+uint32_t
+region_decode_lookup(region_t region, vm_offset_t pc, isa_t isa)
+{
+	struct region_decode_page *page;
+	size_t offset;
+
+	if (region->decode == NULL)
+		return 0;
+
+	offset = pc - region->start;
+	if (offset / REGION_DECODE_PAGE >= region->decodepages)
+		return 0;
+
+	page = region->decode[offset / REGION_DECODE_PAGE];
+	if (page == NULL || page->isa != isa)
+		return 0;
+
+	return page->id[offset % REGION_DECODE_PAGE];
+}
+
+
+/*!
+ * region_decode_store() - Record the decode result for the instruction at
+ *			   the specified address.
+ *
+ *	@param	region	The memory region containing the instruction.
+ *
+ *	@param	pc	Address of the instruction.
+ *
+ *	@param	isa	Instruction set the instruction is executed in.
+ *
+ *	@param	id	Non-zero identifier of the decode result to return
+ *			from region_decode_lookup().
+ *
+ *	@return	true if the result was recorded, false if the region does
+ *		not keep decode results or memory could not be allocated.
+ *
+ *	The table covering \a pc is allocated when it is first stored to and
+ *	freed along with the region.  Storing a result for a different
+ *	instruction set discards those already in the table.
+ */
+bool
+region_decode_store(region_t region, vm_offset_t pc, isa_t isa, uint32_t id)
+{
+	struct region_decode_page **pages, *page;
+	size_t offset, npages;
+
+	assert(id != 0);
+
+	if (!region->readonly || !REGION_IS_TEXT(region->type))
+		return false;
+
+	offset = pc - region->start;
+
+	/* The region may have been extended since the index was sized. */
+	if (offset / REGION_DECODE_PAGE >= region->decodepages) {
+		npages = (region->end - region->start +
+			  REGION_DECODE_PAGE - 1) / REGION_DECODE_PAGE;
+		pages = realloc(region->decode, npages * sizeof(*pages));
+		if (pages == NULL)
+			return false;
+		memset(pages + region->decodepages, 0,
+		       (npages - region->decodepages) * sizeof(*pages));
+		region->decode = pages;
+		region->decodepages = npages;
+	}
+
+	page = region->decode[offset / REGION_DECODE_PAGE];
+	if (page == NULL) {
+		page = region->rlist->freedecode;
+		if (page != NULL) {
+			region->rlist->freedecode = page->next;
+			memset(page, 0, sizeof(*page));
+		}
+		else {
+			page = arena_alloc(region->rlist->arena,
+					   sizeof(*page));
+		}
+		page->isa = isa;
+		region->decode[offset / REGION_DECODE_PAGE] = page;
+	}
+	else if (page->isa != isa) {
+		memset(page->id, 0, sizeof(page->id));
+		page->isa = isa;
+	}
+
+	page->id[offset % REGION_DECODE_PAGE] = id;
+	return true;
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2004,2005 Kelly Yancey
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $kbyanc$
+ */
+
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include "dyntrace.h"
+
+/*!
+ * @file
+ *
+ * regiontest: check that a region list forgets what it knew about memory
+ * which has been mapped over.
+ *
+ * A read-only text region of a simulated target has its contents cached,
+ * a decode result recorded and its backing file mapped.  Refreshing the
+ * region with region_update() must keep all of that, while replacing it
+ * with region_replace(), as is done when mmap(2) maps new text over it,
+ * must discard it so that the new text is read and decoded afresh.  Run by
+ * "make check".
+ *
+ * Usage: regiontest
+ */
+
+
+/* Location and size of the simulated target's text. */
+#define	REGIONTEST_BASE		0x10000
+#define	REGIONTEST_LEN		8192
+
+/* Address within the text the checks are made at. */
+#define	REGIONTEST_PC		(REGIONTEST_BASE + 16)
+
+
+bool opt_debug = false;
+
+/* Memory of the simulated target, read by target_read(). */
+static uint8_t	 regiontest_mem[REGIONTEST_LEN];
+
+static uint	 nchecks = 0;
+static uint	 nfailed = 0;
+
+
+static void	 regiontest_check(bool ok, const char *what);
+static uint8_t	 regiontest_byte(region_t region);
+
+
+int
+main(void)
+{
+	region_list_t rlist;
+	region_t region;
+	FILE *fp;
+
+	rlist = region_list_new();
+
+	/* The original text is mapped from a file holding the same bytes. */
+	memset(regiontest_mem, 0xaa, sizeof(regiontest_mem));
+	fp = tmpfile();
+	if (fp == NULL)
+		fatal(EX_OSERR, "tmpfile: %m");
+	if (fwrite(regiontest_mem, sizeof(regiontest_mem), 1, fp) != 1 ||
+	    fflush(fp) != 0)
+		fatal(EX_IOERR, "failed to write temporary file: %m");
+
+	region = region_update(rlist, REGIONTEST_BASE,
+			       REGIONTEST_BASE + REGIONTEST_LEN,
+			       REGION_TEXT_LIBRARY, true);
+	region_set_object(region, region_object("/lib/old.so"));
+	regiontest_check(region_map(NULL, region, fileno(fp), 0),
+			 "original text mapped");
+	regiontest_check(region_decode_store(region, REGIONTEST_PC, ISA_X86,
+					     7), "decode result stored");
+	fclose(fp);
+
+	/* A refresh of the memory map finds the same region again. */
+	region = region_update(rlist, REGIONTEST_BASE,
+			       REGIONTEST_BASE + REGIONTEST_LEN,
+			       REGION_TEXT_LIBRARY, true);
+	regiontest_check(region_decode_lookup(region, REGIONTEST_PC,
+					      ISA_X86) == 7,
+			 "decode result kept by refresh");
+	regiontest_check(regiontest_byte(region) == 0xaa,
+			 "text kept by refresh");
+	regiontest_check(region_get_object(region) != 0,
+			 "object kept by refresh");
+
+	/* New text is mapped over the region with the same bounds. */
+	memset(regiontest_mem, 0xbb, sizeof(regiontest_mem));
+	region = region_replace(rlist, REGIONTEST_BASE,
+				REGIONTEST_BASE + REGIONTEST_LEN,
+				REGION_TEXT_LIBRARY, true);
+	regiontest_check(region_decode_lookup(region, REGIONTEST_PC,
+					      ISA_X86) == 0,
+			 "decode result discarded by remap");
+	regiontest_check(regiontest_byte(region) == 0xbb,
+			 "new text read after remap");
+	regiontest_check(region_get_object(region) == 0,
+			 "object discarded by remap");
+	regiontest_check(region_can_map(region),
+			 "new text can be mapped after remap");
+
+	/* The page cached above must not survive a second remap. */
+	memset(regiontest_mem, 0xcc, sizeof(regiontest_mem));
+	region = region_replace(rlist, REGIONTEST_BASE,
+				REGIONTEST_BASE + REGIONTEST_LEN,
+				REGION_TEXT_LIBRARY, true);
+	regiontest_check(regiontest_byte(region) == 0xcc,
+			 "cached page discarded by remap");
+
+	region_list_done(&rlist);
+
+	printf("%u of %u region checks passed\n", nchecks - nfailed,
+	       nchecks);
+	return (nfailed == 0) ? EX_OK : EX_SOFTWARE;
+}
+
+
+/*!
+ * regiontest_check() - Internal routine to record the result of a check.
+ *
+ *	@param	ok	Whether the check passed.
+ *
+ *	@param	what	Description of the check, reported if it failed.
+ */
+void
+regiontest_check(bool ok, const char *what)
+{
+
+	nchecks++;
+	if (!ok) {
+		warn("check failed: %s", what);
+		nfailed++;
+	}
+}
+
+
+/*!
+ * regiontest_byte() - Internal routine to read the text at REGIONTEST_PC.
+ *
+ *	@param	region	The region containing REGIONTEST_PC.
+ *
+ *	@return	the byte read through the region's cache or mapping.
+ */
+uint8_t
+regiontest_byte(region_t region)
+{
+	uint8_t byte;
+
+	if (region_read(NULL, region, REGIONTEST_PC, &byte, 1) != 1)
+		return 0;
+	return byte;
+}
+
+
+/*!
+ * target_read() - Read the memory of the simulated target.
+ *
+ *	@param	targ	Unused; there is only the one target.
+ *
+ *	@param	addr	Address to read from.
+ *
+ *	@param	dest	Pointer to buffer to read contents into.
+ *
+ *	@param	len	The number of bytes to read.
+ *
+ *	@return	number of bytes read.
+ */
+size_t
+target_read(target_t targ, vm_offset_t addr, void *dest, size_t len)
+{
+	size_t offset;
+
+	(void)targ;
+
+	if (addr < REGIONTEST_BASE ||
+	    addr >= REGIONTEST_BASE + REGIONTEST_LEN)
+		return 0;
+
+	offset = addr - REGIONTEST_BASE;
+	if (len > REGIONTEST_LEN - offset)
+		len = REGIONTEST_LEN - offset;
+	memcpy(dest, regiontest_mem + offset, len);
+	return len;
+}
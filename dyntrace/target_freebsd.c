@@ -30,10 +30,16 @@
 
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/elf32.h>
+#include <sys/elf64.h>
 #include <sys/event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/sysctl.h>
+#include <sys/user.h>
 
 #include <assert.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <libgen.h>
 #include <signal.h>
@@ -47,7 +53,11 @@
 #include <pmc.h>
 #endif
 
+#include <machine/psl.h>
 #include <machine/reg.h>
+#ifdef __amd64__
+#include <machine/segments.h>
+#endif
 
 #include "dyntrace.h"
 #include "procfs.h"
@@ -57,8 +67,15 @@
 struct target_state {
 	pid_t		 pid;		/* process identifier. */
 	int		 pfs_map;	/* procfs map file descriptor. */
+	int		 pfs_mem;	/* procfs mem file descriptor. */
 	ptstate_t	 pts;		/* ptrace(2) state. */
 	region_list_t	 rlist;		/* memory regions in process VM. */
+	isa_t		 isa;		/* ISA of the current instruction. */
+	struct reg	 regs;		/* Registers at current instruction. */
+
+	bool		 insyscall;	/* Stepping over a system call. */
+	isa_t		 scisa;		/* ISA of the system call. */
+	struct reg	 scregs;	/* Registers on system call entry. */
 
 #if HAVE_LIBPMC
 	pmc_id_t	 pmc;		/* handle for PMC for cycle counts. */
@@ -81,6 +98,15 @@ static target_t	 tracedproc = NULL;
 static target_t	 target_new(pid_t pid, ptstate_t pts, char *procname);
 static void	 target_region_refresh(target_t targ);
 static void	 freebsd_map_parseline(target_t targ, char *line, uint linenum);
+static void	 freebsd_map_text(target_t targ, region_t region,
+				  const char *path, off_t offset);
+static void	 freebsd_map_region(target_t targ, region_t region,
+				    region_type_t type, bool readonly);
+static const char *freebsd_object_name(const char *objtype,
+				  const char *path, region_type_t type,
+				  bool readonly);
+static off_t	 freebsd_text_offset(int fd);
+static void	 freebsd_syscall_exit(target_t targ);
 
 
 void
@@ -182,8 +208,10 @@ target_new(pid_t pid, ptstate_t pts, char *procname)
 	targ->pid = pid;
 	targ->pts = pts;
 	targ->pfs_map = procfs_map_open(pid);
+	targ->pfs_mem = procfs_mem_open(pid);
 	targ->rlist = region_list_new();
 	targ->procname = procname;
+	targ->isa = ISA_X86;
 
 	assert(tracedproc == NULL);
 	tracedproc = targ;
@@ -281,6 +309,7 @@ target_detach(target_t *targp)
 	ptrace_detach(targ->pts);
 	ptrace_done(&targ->pts);
 	procfs_map_close(&targ->pfs_map);
+	procfs_mem_close(&targ->pfs_mem);
 	region_list_done(&targ->rlist);
 
 	free(targ->procname);
@@ -323,6 +352,15 @@ target_wait(void)
 			region_list_done(&targ->rlist);
 			targ->rlist = region_list_new();
 			target_region_refresh(targ);
+			targ->insyscall = false;
+
+			/*
+			 * Access to the memory of a process image the user
+			 * may not debug (e.g. setuid) is revoked on exec, so
+			 * reopen the procfs mem node too.
+			 */
+			procfs_mem_close(&targ->pfs_mem);
+			targ->pfs_mem = procfs_mem_open(targ->pid);
 		}
 
 		kevp++;
@@ -340,9 +378,39 @@ target_step(target_t targ)
 }
 
 
+/*!
+ * target_syscall() - Note that the target is about to execute a system call.
+ *
+ *	@param	targ	The target process.
+ *
+ *	The system call's arguments are saved so that, once it has been
+ *	stepped over, changes it made to the target's memory map (mmap,
+ *	munmap, mprotect) can be applied to the region list directly rather
+ *	than re-reading the whole map on the next region lookup miss.
+ */
+void
+target_syscall(target_t targ)
+{
+
+	targ->scregs = targ->regs;
+	targ->scisa = targ->isa;
+	targ->insyscall = true;
+}
+
+
+/*!
+ * target_read() - Read the contents of the target's virtual memory.
+ *
+ *	Reads are made with pread(2) on the procfs mem node when procfs is
+ *	available as it is cheaper than ptrace(PT_IO); the region cache
+ *	fetches enough text for a whole instruction in a single read.
+ */
 size_t
 target_read(target_t targ, vm_offset_t addr, void *dest, size_t len)
 {
+
+	if (targ->pfs_mem >= 0)
+		return procfs_mem_read(targ->pfs_mem, addr, dest, len);
 	return ptrace_read(targ->pts, addr, dest, len);
 }
 
@@ -350,10 +418,48 @@ target_read(target_t targ, vm_offset_t addr, void *dest, size_t len)
 vm_offset_t
 target_get_pc(target_t targ)
 {
-	struct reg regs;
+	struct reg *regs = &targ->regs;
+
+	ptrace_getregs(targ->pts, regs);
 
-	ptrace_getregs(targ->pts, &regs);
-	return regs.r_eip;
+#ifdef __amd64__
+	/*
+	 * Whether the process is executing 32-bit code in compatibility
+	 * mode or native 64-bit code is determined by its code segment.
+	 * Since we already have the registers in hand, record the mode
+	 * now so that target_get_isa() does not cost another system call.
+	 */
+	if (regs->r_cs == GSEL(GUCODE32_SEL, SEL_UPL))
+		targ->isa = ISA_X86;
+	else
+		targ->isa = ISA_AMD64;
+#endif
+
+	if (targ->insyscall) {
+		freebsd_syscall_exit(targ);
+		targ->insyscall = false;
+	}
+
+#ifdef __amd64__
+	return regs->r_rip;
+#else
+	return regs->r_eip;
+#endif
+}
+
+
+/*!
+ * target_get_isa() - Get the instruction set the target is executing.
+ *
+ *	@param	targ	The target process.
+ *
+ *	@return	the instruction set of the instruction at the program
+ *		counter most recently returned by target_get_pc().
+ */
+isa_t
+target_get_isa(target_t targ)
+{
+	return targ->isa;
 }
 
 
@@ -444,6 +550,7 @@ freebsd_map_parseline(target_t targ, char *line, uint linenum)
 	char *args[20];
 	vm_offset_t start, end;
 	region_type_t type;
+	region_t region;
 	bool readonly;
 	int i;
 
@@ -480,6 +587,446 @@ freebsd_map_parseline(target_t targ, char *line, uint linenum)
 	else if (end == stack_top)
 		type = REGION_STACK;
 
-	region_update(targ->rlist, start, end, type, readonly);
+	region = region_update(targ->rlist, start, end, type, readonly);
+
+	if (opt_objects && region_get_object(region) == 0) {
+		region_set_object(region, region_object(
+		    freebsd_object_name(args[11], args[12], type, readonly)));
+	}
+
+	/*
+	 * Read-only text backed by a file can be read from a mapping of
+	 * the file rather than from the target.
+	 */
+	if (REGION_IS_TEXT(type) && region_can_map(region) &&
+	    args[12] != NULL && args[12][0] == '/')
+		freebsd_map_text(targ, region, args[12], -1);
 }
 
+
+/*!
+ * freebsd_map_text() - Internal routine to map the file backing a text
+ *			region.
+ *
+ *	@param	targ	The target process.
+ *
+ *	@param	region	The read-only text region.
+ *
+ *	@param	path	Path of the file backing the region.
+ *
+ *	@param	offset	Offset in the file of the region's first byte, or -1
+ *			if it is not known.
+ *
+ *	The procfs memory map does not say which part of the file a region
+ *	maps, so when no offset is given it is taken to be the executable
+ *	segment of an ELF file.  region_map() checks that the file's contents
+ *	match before using the mapping.
+ */
+void
+freebsd_map_text(target_t targ, region_t region, const char *path,
+		 off_t offset)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		debug("%s: %m", path);
+		return;
+	}
+
+	if (offset < 0)
+		offset = freebsd_text_offset(fd);
+	if (region_map(targ, region, fd, offset))
+		debug("mapped %s for text region", path);
+
+	close(fd);
+}
+
+
+/*!
+ * freebsd_map_region() - Internal routine to name and map the file backing
+ *			  a region added by a system call.
+ *
+ *	@param	targ	The target process.
+ *
+ *	@param	region	The new region.
+ *
+ *	@param	type	The region's type.
+ *
+ *	@param	readonly Whether or not the region is read-only.
+ *
+ *	Only the kernel's entry for the region is consulted, so unlike
+ *	target_region_refresh() the rest of the region list is left alone.
+ *	The entry also gives the file offset the region maps, so the text of
+ *	any file can be mapped rather than only an ELF executable segment.
+ */
+void
+freebsd_map_region(target_t targ, region_t region, region_type_t type,
+		   bool readonly)
+{
+#ifdef KERN_PROC_VMMAP
+	struct kinfo_vmentry *kve;
+	vm_offset_t start;
+	const char *objtype, *path;
+	char *buf, *pos;
+	size_t len;
+	int mib[4];
+
+	region_get_range(region, &start, NULL);
+
+	mib[0] = CTL_KERN;
+	mib[1] = KERN_PROC;
+	mib[2] = KERN_PROC_VMMAP;
+	mib[3] = targ->pid;
+
+	/* The target is stopped, so its map cannot change between calls. */
+	if (sysctl(mib, 4, NULL, &len, NULL, 0) < 0) {
+		debug("sysctl kern.proc.vmmap: %m");
+		return;
+	}
+	buf = malloc(len);
+	if (buf == NULL)
+		fatal(EX_OSERR, "malloc: %m");
+	if (sysctl(mib, 4, buf, &len, NULL, 0) < 0) {
+		debug("sysctl kern.proc.vmmap: %m");
+		free(buf);
+		return;
+	}
+
+	/* Entries are variable length; kve_structsize gives each one's. */
+	kve = NULL;
+	for (pos = buf; pos < buf + len; pos += kve->kve_structsize) {
+		kve = (struct kinfo_vmentry *)pos;
+		if (kve->kve_structsize == 0 ||
+		    (kve->kve_start <= start && kve->kve_end > start))
+			break;
+	}
+	if (pos >= buf + len || kve->kve_structsize == 0) {
+		debug("no memory map entry for region at %#jx",
+		      (uintmax_t)start);
+		free(buf);
+		return;
+	}
+
+	objtype = (kve->kve_type == KVME_TYPE_VNODE) ? "vnode" : "";
+	path = (kve->kve_path[0] != '\0') ? kve->kve_path : NULL;
+
+	if (opt_objects && region_get_object(region) == 0) {
+		region_set_object(region, region_object(
+		    freebsd_object_name(objtype, path, type, readonly)));
+	}
+
+	if (REGION_IS_TEXT(type) && region_can_map(region) &&
+	    path != NULL && path[0] == '/') {
+		freebsd_map_text(targ, region, path,
+		    kve->kve_offset + (start - kve->kve_start));
+	}
+
+	free(buf);
+#else
+	/* Without the per-entry map, fall back to reading the whole map. */
+	(void)region;
+	(void)type;
+	(void)readonly;
+	target_region_refresh(targ);
+#endif
+}
+
+
+/*!
+ * freebsd_object_name() - Internal routine to name the object a region
+ *			   belongs to.
+ *
+ *	@param	objtype	The VM object type given by the memory map (e.g.
+ *			"vnode").
+ *
+ *	@param	path	The path given by the memory map; may be NULL.
+ *
+ *	@param	type	The region's type.
+ *
+ *	@param	readonly Whether or not the region is read-only.
+ *
+ *	@return	the path of the file backing the region or, for regions
+ *		not backed by a file, a bracketed description of them.
+ */
+const char *
+freebsd_object_name(const char *objtype, const char *path,
+		    region_type_t type, bool readonly)
+{
+
+	if (strcmp(objtype, "vnode") == 0)
+		return (path != NULL && path[0] == '/') ? path : "[file]";
+	if (type == REGION_STACK)
+		return "[stack]";
+
+	/* The shared page holds the signal trampoline and vdso. */
+	if (strcmp(objtype, "phys") == 0)
+		return "[vdso]";
+
+	/* Writable executable memory is assumed to hold generated code. */
+	return readonly ? "[anonymous]" : "[jit]";
+}
+
+
+/*!
+ * freebsd_text_offset() - Internal routine to locate the executable segment
+ *			   of an ELF file.
+ *
+ *	@param	fd	Descriptor of the file.
+ *
+ *	@return	the page-aligned file offset of the first executable
+ *		loadable segment, or zero if there is none or the file is
+ *		not ELF.
+ */
+off_t
+freebsd_text_offset(int fd)
+{
+	union {
+		Elf32_Ehdr	 e32;
+		Elf64_Ehdr	 e64;
+	} ehdr;
+	union {
+		Elf32_Phdr	 p32;
+		Elf64_Phdr	 p64;
+	} phdr;
+	off_t phoff, offset;
+	uint phnum, phentsize;
+	uint i;
+
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+	    !IS_ELF(ehdr.e32))
+		return 0;
+
+	if (ehdr.e32.e_ident[EI_CLASS] == ELFCLASS32) {
+		phoff = ehdr.e32.e_phoff;
+		phnum = ehdr.e32.e_phnum;
+		phentsize = sizeof(phdr.p32);
+	}
+	else if (ehdr.e32.e_ident[EI_CLASS] == ELFCLASS64) {
+		phoff = ehdr.e64.e_phoff;
+		phnum = ehdr.e64.e_phnum;
+		phentsize = sizeof(phdr.p64);
+	}
+	else
+		return 0;
+
+	for (i = 0; i < phnum; i++) {
+		if (pread(fd, &phdr, phentsize, phoff + i * phentsize) !=
+		    (ssize_t)phentsize)
+			break;
+
+		if (phentsize == sizeof(phdr.p32)) {
+			if (phdr.p32.p_type != PT_LOAD ||
+			    (phdr.p32.p_flags & PF_X) == 0)
+				continue;
+			offset = phdr.p32.p_offset;
+		}
+		else {
+			if (phdr.p64.p_type != PT_LOAD ||
+			    (phdr.p64.p_flags & PF_X) == 0)
+				continue;
+			offset = phdr.p64.p_offset;
+		}
+
+		return trunc_page(offset);
+	}
+
+	return 0;
+}
+
+
+/*!
+ * freebsd_syscall_exit() - Internal routine to apply the effect of a system
+ *			    call on the target's memory map.
+ *
+ *	@param	targ	The target process, stopped after the system call
+ *			noted by target_syscall().
+ *
+ *	Executable mappings created by mmap or mprotect are added to the
+ *	region list and mappings removed or made non-executable are cleared
+ *	from it.  Regions whose protection changes keep their type and object;
+ *	new file mappings trigger a refresh of the memory map so that their
+ *	text can be mapped from the file.  Other changes (e.g. brk) are left
+ *	to be picked up by a full refresh when an address is not found in the
+ *	region list.
+ */
+void
+freebsd_syscall_exit(target_t targ)
+{
+	const struct reg *before = &targ->scregs;
+	const struct reg *after = &targ->regs;
+	uint64_t args[5];
+	uint32_t stack[8];
+	vm_offset_t start, end, sp;
+	vm_offset_t addr, next, rstart, rend;
+	region_type_t type;
+	region_t region;
+	bool readonly;
+	long code;
+	int prot, fd;
+	uint i, skip, object;
+
+#ifdef __amd64__
+	if ((after->r_rflags & PSL_C) != 0)
+		return;
+	code = before->r_rax;
+	sp = before->r_rsp;
+#else
+	if ((after->r_eflags & PSL_C) != 0)
+		return;
+	code = before->r_eax;
+	sp = before->r_esp;
+#endif
+
+	if (targ->scisa == ISA_X86) {
+		/*
+		 * Arguments are passed on the stack, above the return
+		 * address of the libc stub.  The indirect system calls take
+		 * the system call number as their first argument; it is a
+		 * quad for __syscall.
+		 */
+		if (target_read(targ, sp + 4, stack, sizeof(stack)) !=
+		    sizeof(stack))
+			return;
+		skip = 0;
+		if (code == SYS_syscall || code == SYS___syscall) {
+			skip = (code == SYS___syscall) ? 2 : 1;
+			code = stack[0];
+		}
+		for (i = 0; i < 5; i++)
+			args[i] = stack[skip + i];
+	}
+	else {
+#ifdef __amd64__
+		uint64_t regargs[6] = {
+			before->r_rdi, before->r_rsi, before->r_rdx,
+			before->r_r10, before->r_r8, before->r_r9
+		};
+
+		skip = 0;
+		if (code == SYS_syscall || code == SYS___syscall) {
+			skip = 1;
+			code = regargs[0];
+		}
+		for (i = 0; i < 5; i++)
+			args[i] = regargs[skip + i];
+#else
+		return;
+#endif
+	}
+
+	switch (code) {
+	case SYS_mmap:
+#ifdef SYS_freebsd6_mmap
+	case SYS_freebsd6_mmap:
+#endif
+#ifdef __amd64__
+		start = after->r_rax;
+#else
+		start = after->r_eax;
+#endif
+		prot = args[2];
+		fd = args[4];
+		break;
+
+	case SYS_mprotect:
+		start = args[0];
+		prot = args[2];
+		fd = -1;
+		break;
+
+	case SYS_munmap:
+		start = args[0];
+		prot = PROT_NONE;
+		fd = -1;
+		break;
+
+	default:
+		return;
+	}
+
+	if (targ->scisa == ISA_X86)
+		args[1] = (uint32_t)args[1];
+	end = round_page(start + args[1]);
+	start = trunc_page(start);
+	if (end <= start)
+		return;
+
+	if ((prot & PROT_EXEC) == 0) {
+		debug("region %#jx-%#jx removed by system call %ld",
+		      (uintmax_t)start, (uintmax_t)end, code);
+		region_clear(targ->rlist, start, end);
+		return;
+	}
+
+	readonly = (prot & PROT_WRITE) == 0;
+
+	/*
+	 * Changing the protection of existing regions keeps their type and
+	 * object.  The range may span several regions, and gaps between
+	 * them, so each part is updated separately.
+	 */
+	if (code == SYS_mprotect) {
+		debug("region %#jx-%#jx protected by system call %ld",
+		      (uintmax_t)start, (uintmax_t)end, code);
+		for (addr = start; addr < end; addr = next) {
+			type = REGION_NONTEXT_UNKNOWN;
+			object = 0;
+			next = end;
+
+			region = region_next(targ->rlist, addr);
+			if (region != NULL) {
+				region_get_range(region, &rstart, &rend);
+				if (rstart <= addr) {
+					type = region_get_type(region);
+					object = region_get_object(region);
+					next = MIN(rend, end);
+				}
+				else
+					next = MIN(rstart, end);
+			}
+
+			region = region_update(targ->rlist, addr, next, type,
+					       readonly);
+			if (object != 0)
+				region_set_object(region, object);
+			else if (opt_objects) {
+				region_set_object(region, region_object(
+				    freebsd_object_name("", NULL, type,
+							readonly)));
+			}
+		}
+		return;
+	}
+
+	/*
+	 * Classify new executable mappings the same way the memory map
+	 * parser would: read-only file mappings are library text and
+	 * anything else is unknown.
+	 */
+	type = REGION_NONTEXT_UNKNOWN;
+	if (fd >= 0 && readonly)
+		type = REGION_TEXT_LIBRARY;
+
+	debug("region %#jx-%#jx added by system call %ld",
+	      (uintmax_t)start, (uintmax_t)end, code);
+
+	/*
+	 * The new mapping replaces whatever was there before, even if it has
+	 * the same bounds and protection, so nothing cached for the old
+	 * contents may be kept.
+	 */
+	region = region_replace(targ->rlist, start, end, type, readonly);
+
+	/*
+	 * The path of a mapped file is only available from the kernel's
+	 * memory map; look it up to map the file's text (e.g. a library
+	 * loaded by dlopen(3)) and to name the new region's object.
+	 */
+	if (fd >= 0)
+		freebsd_map_region(targ, region, type, readonly);
+	else if (opt_objects) {
+		region_set_object(region, region_object(
+		    freebsd_object_name("", NULL, type, readonly)));
+	}
+}
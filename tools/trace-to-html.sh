@@ -30,12 +30,14 @@ xsltproc --novalid --nonet - $1 << EOF
     <table border="1">
     <tr> 
 	<td>Id</td>
+	<td>ISA</td>
 	<td>Description</td>
 	<td>Encoding</td>
     </tr>
     <xsl:for-each select="prefix">
 	<tr>
 	    <td><xsl:value-of select="@id"/></td>
+	    <td><xsl:value-of select="@isa"/></td>
 	    <td><xsl:value-of select="@detail"/></td>
 	    <td><xsl:value-of select="@bitmask"/></td>
 	</tr>
@@ -54,7 +56,9 @@ xsltproc --novalid --nonet - $1 << EOF
 
 
 <xsl:template match="dyntrace/program/region">
-    <h2>Region: <xsl:value-of select="@type"/></h2>
+    <h2>Region: <xsl:value-of select="@type"/>
+	<xsl:if test="@object"> (<xsl:value-of select="@object"/>)</xsl:if>
+    </h2>
     <table border="1">
     <tr>
 	<td>Mnemonic</td>